@@ -0,0 +1,288 @@
+/* Micro-benchmarks of the arrays.c primitives, each over a sweep of sizes
+   from a few words up to the production L, K and N, so that the steps at
+   the L1, L2 and L3 boundaries show up in the cycles per word and in the
+   bandwidth. Built as its own executable next to the main program. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/arrays.h"
+#include "../include/backend.h"
+#include "../include/kernels.h"
+#include "../include/seed.h"
+#include "../include/xoshiro.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#define TICK_NAME "TSC cycles"
+#else
+#define TICK_NAME "nanoseconds"
+#endif
+
+// Each round repeats a call for at least ROUND_NS, the best of ROUNDS counts
+#define ROUND_NS 20e6
+#define ROUNDS 5
+
+// Calls longer than this are timed once
+#define LONG_NS 200e6
+
+// Calls to next() per timed call
+#define NEXT_BATCH 1024
+
+typedef void (*kernel_fn)(void *ctx);
+
+/* One point of a sweep: the arguments of the call, the bytes it reads and
+   writes, and the units it processes: 64-bit words, or the draws of next
+   and weight_array. */
+struct point {
+    const char *kernel;
+    char shape[32];
+    size_t bytes;
+    double words;
+};
+
+struct vec_ctx {
+    struct arr a;
+    struct arr b;
+    int words;
+};
+
+struct mat_ctx {
+    struct mat *a;
+    struct mat *b;
+    struct arr v;
+};
+
+static size_t cache[3];
+
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static uint64_t ticks(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return (uint64_t)now_ns();
+#endif
+}
+
+static const char *level(size_t bytes) {
+    if (cache[0] > 0 && bytes <= cache[0])
+        return "L1";
+    if (cache[1] > 0 && bytes <= cache[1])
+        return "L2";
+    if (cache[2] > 0 && bytes <= cache[2])
+        return "L3";
+    return "DRAM";
+}
+
+/* Runs fn until ROUND_NS has passed, ROUNDS times, and prints the best
+   time per call against the point. */
+static void measure(struct point *p, kernel_fn fn, void *ctx) {
+    double t0 = now_ns();
+    fn(ctx);
+    double once = now_ns() - t0;
+
+    long iters = once >= ROUND_NS ? 1 : (long)(ROUND_NS / (once > 1 ? once : 1)) + 1;
+    int rounds = once >= LONG_NS ? 1 : ROUNDS;
+    double best_ns = once, best_ticks = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        uint64_t c0 = ticks();
+        t0 = now_ns();
+        for (long i = 0; i < iters; i++)
+            fn(ctx);
+        double ns = (now_ns() - t0) / iters;
+        double tk = (double)(ticks() - c0) / iters;
+
+        if (r == 0 || ns < best_ns) {
+            best_ns = ns;
+            best_ticks = tk;
+        }
+    }
+
+    fprintf(stdout, "%-18s %-14s %12zu %-5s %14.1f %10.3f %9.2f\n", p->kernel, p->shape, p->bytes, level(p->bytes),
+            best_ns, best_ticks / p->words, p->bytes / best_ns);
+}
+
+static volatile uint64_t sink;
+
+static void run_next(void *ctx) {
+    uint64_t x = 0;
+
+    (void)ctx;
+    for (int i = 0; i < NEXT_BATCH; i++)
+        x ^= next();
+    sink = x;
+}
+
+static void run_bax(void *ctx) {
+    struct vec_ctx *c = ctx;
+    sink = bax(c->a.data, c->b.data, c->words);
+}
+
+static void run_array_xor(void *ctx) {
+    struct vec_ctx *c = ctx;
+    struct arr *r = array_xor(&c->a, &c->b);
+    if (r != NULL)
+        free(r->data);
+    free(r);
+}
+
+// Positions weight_array draws over len bits
+static int vec_weight(int len) {
+    return len / 2 < T ? len / 2 : T;
+}
+
+static void run_weight_array(void *ctx) {
+    struct vec_ctx *c = ctx;
+    free(weight_array(c->a.len, vec_weight(c->a.len), NULL));
+}
+
+static void run_mat_arr_mul(void *ctx) {
+    struct mat_ctx *c = ctx;
+    struct arr *r = mat_arr_mul(c->a, &c->v);
+    if (r != NULL)
+        free(r->data);
+    free(r);
+}
+
+static void run_transpose(void *ctx) {
+    struct mat_ctx *c = ctx;
+    free_mat(matrix_transpose(c->a));
+}
+
+static void run_matrix_mul(void *ctx) {
+    struct mat_ctx *c = ctx;
+    free_mat(matrix_mul(c->a, c->b));
+}
+
+static struct arr rand_arr(int len) {
+    struct mat *m = rand_mat(1, len, NULL);
+    struct arr a = { len, calloc(real_dim(len), sizeof(uint64_t)) };
+
+    if (m != NULL && a.data != NULL) {
+        for (int i = 0; i < real_dim(len); i++)
+            a.data[i] = m->data[0][i];
+    }
+    free_mat(m);
+    return a;
+}
+
+// Vector kernels over lengths in words, ending with the production ones
+static void sweep_vectors(void) {
+    int words[] = { 8, 32, 128, 512, 2048, 8192, 32768, 131072, 524288, 2097152,
+                    real_dim(K), real_dim(L), real_dim(N) };
+
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        int w = words[i];
+        struct vec_ctx c = { rand_arr(w * (int)SIZE), rand_arr(w * (int)SIZE), w };
+        if (c.a.data == NULL || c.b.data == NULL) {
+            free(c.a.data);
+            free(c.b.data);
+            continue;
+        }
+
+        size_t row = (size_t)w * sizeof(uint64_t);
+        struct point p = { "bax", "", 2 * row, w };
+        snprintf(p.shape, sizeof(p.shape), "%d", w * (int)SIZE);
+        measure(&p, run_bax, &c);
+
+        p.kernel = "array_xor";
+        p.bytes = 3 * row;
+        measure(&p, run_array_xor, &c);
+
+        // Per position drawn: the sampler's work follows the weight, not the length
+        p.kernel = "weight_array";
+        p.bytes = row;
+        p.words = vec_weight(c.a.len);
+        measure(&p, run_weight_array, &c);
+
+        free(c.a.data);
+        free(c.b.data);
+    }
+}
+
+// Square matrices of growing side, then the shapes of A, S and Y
+static void sweep_matrices(void) {
+    int shapes[][2] = { { 64, 64 }, { 256, 256 }, { 1024, 1024 }, { 4096, 4096 }, { K, N }, { L, K }, { L, N } };
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        int rows = shapes[i][0], cols = shapes[i][1];
+        struct mat_ctx c = { rand_mat(rows, cols, NULL), NULL, rand_arr(cols) };
+        if (c.a == NULL || c.v.data == NULL) {
+            free_mat(c.a);
+            free(c.v.data);
+            continue;
+        }
+
+        size_t m = (size_t)rows * c.a->stride * sizeof(uint64_t);
+        struct point p = { "mat_arr_mul", "", m, (double)rows * real_dim(cols) };
+        snprintf(p.shape, sizeof(p.shape), "%dx%d", rows, cols);
+        measure(&p, run_mat_arr_mul, &c);
+
+        p.kernel = "matrix_transpose";
+        p.bytes = 2 * m;
+        measure(&p, run_transpose, &c);
+
+        free_mat(c.a);
+        free(c.v.data);
+    }
+}
+
+/* Products n x n by n x n, then S * A as key generation runs it. Words
+   count the row XORs of a schoolbook product, rows * cols * words(inner). */
+static void sweep_products(void) {
+    int shapes[][3] = { { 64, 64, 64 }, { 256, 256, 256 }, { 1024, 1024, 1024 }, { L, K, N } };
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        int rows = shapes[i][0], inner = shapes[i][1], cols = shapes[i][2];
+        struct mat_ctx c = { rand_mat(rows, inner, NULL), rand_mat(inner, cols, NULL), { 0, NULL } };
+        if (c.a == NULL || c.b == NULL) {
+            free_mat(c.a);
+            free_mat(c.b);
+            continue;
+        }
+
+        size_t bytes = ((size_t)rows * c.a->stride + (size_t)inner * c.b->stride + (size_t)rows * row_stride(cols))
+                       * sizeof(uint64_t);
+        struct point p = { "matrix_mul", "", bytes, (double)rows * cols * real_dim(inner) };
+        snprintf(p.shape, sizeof(p.shape), "%dx%dx%d", rows, inner, cols);
+        measure(&p, run_matrix_mul, &c);
+
+        free_mat(c.a);
+        free_mat(c.b);
+    }
+}
+
+int main(void) {
+    select_kernels();
+    init_seed();
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    cache[0] = sysconf(_SC_LEVEL1_DCACHE_SIZE) > 0 ? (size_t)sysconf(_SC_LEVEL1_DCACHE_SIZE) : 0;
+    cache[1] = sysconf(_SC_LEVEL2_CACHE_SIZE) > 0 ? (size_t)sysconf(_SC_LEVEL2_CACHE_SIZE) : 0;
+    cache[2] = sysconf(_SC_LEVEL3_CACHE_SIZE) > 0 ? (size_t)sysconf(_SC_LEVEL3_CACHE_SIZE) : 0;
+#endif
+
+    fprintf(stdout, "Kernels %s, L1 %zu, L2 %zu, L3 %zu bytes, %s per word\n\n", kernels.name, cache[0], cache[1],
+            cache[2], TICK_NAME);
+    fprintf(stdout, "%-18s %-14s %12s %-5s %14s %10s %9s\n", "kernel", "shape", "bytes", "fits", "ns/call",
+            "cyc/word", "GB/s");
+
+    struct point p = { "next", "", 4 * sizeof(uint64_t), NEXT_BATCH };
+    snprintf(p.shape, sizeof(p.shape), "%d", NEXT_BATCH);
+    measure(&p, run_next, NULL);
+
+    sweep_vectors();
+    sweep_matrices();
+    sweep_products();
+    return 0;
+}
@@ -4,12 +4,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "arrays.h"
+#include "params.h"
 
-// Constants
-#define L 13000
-#define T 144
-#define K 1300
-#define N 16000
+// Sizes of the active parameter set, as in backend.h
+#define L (active_params->l)
+#define T (active_params->t)
+#define K (active_params->k)
+#define N (active_params->n)
 
 // Paths
 #define A_PUB "target/a_pub.bin"
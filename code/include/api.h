@@ -3,9 +3,23 @@
 
 #include <stdint.h>
 
-void generate_key(void);
-void encrypt(const char *mex, const char *a_path, const char *y_path);
+#include "arrays.h"
+#include "params.h"
+#include "xoshiro.h"
+
+void set_threads(int n);
+/* Key pairs of set p, written under target/. Both return 0 or -1. */
+int generate_key(const struct params *p);
+int generate_seeded_key(const struct params *p);
+/* e is drawn from rng, or from the calling thread's context if it is NULL */
+void encrypt(const char *mex, const char *a_path, const char *y_path, struct rng *rng);
+int encrypt_mat(struct mat *msg, const char *a_path, const char *y_path, struct rng *rng,
+                struct mat **nnc, struct mat **word);
+int encrypt_batch(const char *const *mex, int count, const char *a_path, const char *y_path,
+                  struct rng *rng);
 void decrypt(const char *fnnc, const char *fword, const char *key_path);
-void correct(const char *path1, const char *path2, const char *path3);
+int decrypt_mat(struct mat *nnc, struct mat *word, const char *key_path, struct mat **msg);
+int decrypt_batch(const char *const *fnnc, const char *const *fword, int count, const char *key_path);
+void correct(const struct params *p, const char *path1, const char *path2, const char *path3);
 
 #endif // API_H
@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include "arrays.h"
+
+/* Bump allocator for the temporaries of an operation. Blocks are carved in
+   order from one buffer allocated up front; an operation takes a mark on
+   entry and releases back to it on exit, which frees everything it took in
+   O(1). Nothing is ever returned to the heap before arena_free. */
+struct arena {
+    unsigned char *buf;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
+
+int arena_init(struct arena *a, size_t size);
+void arena_free(struct arena *a);
+
+/* bytes rounded up to MAT_ALIGN, uninitialised. NULL when the arena is full */
+void *arena_alloc(struct arena *a, size_t bytes);
+
+/* Zeroed buffer for a len-bit vector, data NULL when the arena is full */
+struct arr arena_arr(struct arena *a, int len);
+
+/* Zeroed rows x cols matrix, row table included, into *m; -1 when the
+   arena is full. It goes away with the arena, never through free_mat. */
+int arena_mat(struct arena *a, struct mat *m, int rows, int cols);
+
+// Bytes arena_mat takes for a rows x cols matrix
+size_t arena_mat_size(int rows, int cols);
+
+size_t arena_mark(const struct arena *a);
+void arena_release(struct arena *a, size_t mark);
+void arena_reset(struct arena *a);
+
+#endif // ARENA_H
@@ -1,14 +1,57 @@
 #ifndef ARRAYS_H
 #define ARRAYS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define SIZE (sizeof(uint64_t) * 8)
 
+struct rng;
+
+// Alignment of matrix buffers and rows, one cache line
+#define MAT_ALIGN 64
+
+// Buffers at least this large may be backed by huge pages
+#define HUGE_PAGE (2UL << 20)
+
+// Default tile of matrix_mul: rows of a, rows of b^T and words of depth
+#ifndef TILE_ROWS
+#define TILE_ROWS 64
+#endif
+#ifndef TILE_COLS
+#define TILE_COLS 128
+#endif
+#ifndef TILE_DEPTH
+#define TILE_DEPTH 32
+#endif
+
+// Rows of b combined per Four Russians table, must divide SIZE
+#ifndef M4RM_K
+#define M4RM_K 8
+#endif
+
+// Rows of the matrix kept in cache across a batch, must be a multiple of SIZE
+#ifndef BATCH_BLOCK
+#define BATCH_BLOCK 64
+#endif
+
+// Words of the table of matrix_mul_m4rm_into for a b of cols columns
+#define M4RM_SCRATCH(cols) ((size_t)real_dim(cols) << M4RM_K)
+
+// Words of the buffer of sparse_mat_mul_batch_into for a batch of rows vectors
+#define SPARSE_SCRATCH(rows, weight) (2 * (size_t)(rows) * (weight))
+
+/* Row-major bit matrix. Rows live in one MAT_ALIGN-aligned buffer, each
+   padded to stride words; data[i] points at row i. map is set when buf is
+   an mmap that free_mat has to unmap. */
 struct mat {
     int rows;
     int cols;
+    int stride;
     uint64_t **data;
+    uint64_t *buf;
+    void *map;
+    size_t map_len;
 };
 
 struct arr {
@@ -16,23 +59,97 @@ struct arr {
     uint64_t *data;
 };
 
+// Fixed-weight vector of length len stored as the list of its set positions
+struct sparse {
+    int len;
+    int weight;
+    int *pos;
+};
+
+// Fixed-weight rows, positions of row i at pos[i * weight .. (i + 1) * weight)
+struct sparse_mat {
+    int rows;
+    int cols;
+    int weight;
+    int *pos;
+};
+
 int real_dim(int n);
+int row_stride(int cols);
+void set_huge_pages(int enable);
+struct mat *new_mat(int rows, int cols);
+struct mat *mat_view(uint64_t *buf, int rows, int cols, int stride);
+
+/* Rows [begin, begin + rows) of m seen as a rows x cols matrix, cols at most
+   m->cols. It shares the row table of m and is never passed to free_mat. */
+struct mat mat_slice(const struct mat *m, int begin, int rows, int cols);
 void free_mat(struct mat *m);
 
-struct mat *rand_mat(int rows, int cols);
+// Frees a vector returned by the operations below and its words
+void free_arr(struct arr *a);
+
+/* Generators draw from rng, or from the calling thread's own context when
+   rng is NULL, so concurrent callers never share generator state. */
+struct mat *rand_mat(int rows, int cols, struct rng *rng);
+void rand_rows(struct mat *m, int begin, int end, struct rng *rng);
+
+/* Fixed-weight sampler: rows lists of weight distinct positions below len,
+   uniform and without rejection on collisions, written one after the other
+   to pos. The generators below, dense and sparse, all draw through it. */
+int sample_weight(int *pos, int rows, int len, int weight, struct rng *rng);
 
-uint64_t *weight_array(int len, int weight);
-struct mat *weight_matrix(int rows, int cols, int weight);
+/* Same with the caller's bitmap of real_dim(len) zeroed words, left zeroed */
+int sample_weight_into(int *pos, int rows, int len, int weight, uint64_t *bits, struct rng *rng);
+
+uint64_t *weight_array(int len, int weight, struct rng *rng);
+struct sparse *weight_sparse(int len, int weight, struct rng *rng);
+void free_sparse(struct sparse *v);
+struct arr *sparse_to_arr(struct sparse *v);
+struct sparse_mat *weight_sparse_mat(int rows, int cols, int weight, struct rng *rng);
+void free_sparse_mat(struct sparse_mat *m);
+int sparse_rows(struct sparse_mat *m, int begin, int end, struct rng *rng);
+struct mat *weight_matrix(int rows, int cols, int weight, struct rng *rng);
 
 struct mat *matrix_transpose(struct mat *m);
+struct mat *matrix_transpose_naive(struct mat *m);
 uint64_t bax(uint64_t *a, uint64_t *b, int len);
+void set_tile_sizes(int rows, int cols, int depth);
 struct mat *matrix_mul(struct mat *a, struct mat *b);
+struct mat *matrix_mul_naive(struct mat *a, struct mat *b);
+struct mat *matrix_mul_m4rm(struct mat *a, struct mat *b);
+int matrix_mul_m4rm_cols(struct mat *a, struct mat *b, struct mat *c, int w0, int w1);
 
 uint64_t *array_sum(uint64_t *a, uint64_t *b, int len);
 struct mat *matrix_sum(struct mat *a, struct mat *b);
+struct mat *matrix_add(struct mat *dst, struct mat *src);
 struct arr *array_xor(struct arr *a, struct arr *b);
+struct mat *sparse_mat_add(struct mat *m, struct sparse_mat *e);
 
 struct arr *mat_arr_mul(struct mat *mat, struct arr *arr);
+struct arr *sparse_mat_mul(struct mat *cols, struct sparse *v);
+struct mat *mat_arr_mul_batch(struct mat *m, struct mat *v);
+struct mat *sparse_mat_mul_batch(struct mat *cols, struct sparse_mat *e);
+struct mat *sparse_mat_to_mat(struct sparse_mat *e);
 struct arr *concat_arrays(struct arr *a, struct arr *b);
 
+/* Allocation-free forms of the operations above. The result goes to res,
+   whose data must hold the words of the result; every one of them is
+   written and res->len is set. res may be an operand of the element-wise
+   ones. Return 0, or -1 on mismatched shapes. */
+int sparse_to_arr_into(struct arr *res, struct sparse *v);
+int array_sum_into(uint64_t *res, uint64_t *a, uint64_t *b, int len);
+int array_xor_into(struct arr *res, struct arr *a, struct arr *b);
+int matrix_sum_into(struct mat *res, struct mat *a, struct mat *b);
+int mat_arr_mul_into(struct arr *res, struct mat *m, struct arr *a);
+int sparse_mat_mul_into(struct arr *res, struct mat *cols, struct sparse *v);
+int concat_arrays_into(struct arr *res, struct arr *a, struct arr *b);
+
+/* Same for the batch and matrix forms: res has the shape of the result and
+   every row of it is written. Temporaries come from the caller, in the
+   sizes given by M4RM_SCRATCH and SPARSE_SCRATCH. */
+int matrix_transpose_into(struct mat *t, struct mat *m);
+int matrix_mul_m4rm_into(struct mat *c, struct mat *a, struct mat *b, uint64_t *table);
+int mat_arr_mul_batch_into(struct mat *res, struct mat *m, struct mat *v);
+int sparse_mat_mul_batch_into(struct mat *res, struct mat *cols, struct sparse_mat *e, uint64_t *buf);
+
 #endif
@@ -4,18 +4,27 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "arrays.h"
+#include "params.h"
 
-// Constants
-#define L 13000
-#define T 144
-#define K 1300
-#define N 16000
+// Sizes of the active parameter set
+#define L (active_params->l)
+#define T (active_params->t)
+#define K (active_params->k)
+#define N (active_params->n)
 
 // Paths
 #define A_PUB "target/a_pub.bin"
 #define Y_PUB "target/y_pub.bin"
 #define PRIVA "target/priva.bin"
 
+// Column-major copies of the public keys, used by the sparse encryption path
+#define A_COL "target/a_col.bin"
+#define Y_COL "target/y_col.bin"
+
+// Seeds of A and S for seed-compressed key pairs
+#define A_SEED "target/a_seed.bin"
+#define S_SEED "target/s_seed.bin"
+
 #define WRGEN "target/wrgen.bin"
 #define WRNNC "target/wrnnc.bin"
 #define ENCRY "target/encry.txt"
@@ -27,10 +36,19 @@
 
 // Function prototypes
 void write_key(const char *path, struct mat *m);
-uint64_t *convert_to_array(const char *filepath);
+// The first len characters of a text of '0' and '1', as a len-bit vector
+uint64_t *convert_to_array(const char *filepath, int len);
 struct mat *read_key(const char *path);
+struct mat *map_key(const char *path);
+struct mat *create_key_map(const char *path, int rows, int cols);
+void write_key_mapped(const char *path, struct mat *m);
 void write_packet(const char *output_path, struct arr *message);
+int indexed_path(char *buf, size_t size, const char *path, int i);
 struct arr *read_packet(const char *input_path);
 struct arr *correct_errors(struct arr *, struct arr *, struct arr *);
 
+/* Same into res, whose data holds the words of the result; res may be one
+   of the copies. Returns 0, or -1 on mismatched lengths */
+int correct_errors_into(struct arr *res, struct arr *a, struct arr *b, struct arr *c);
+
 #endif // ALEKHNOVICH_H
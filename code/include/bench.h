@@ -0,0 +1,23 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Default timed runs per stage, and untimed runs before them
+#define BENCH_REPS 10
+#define BENCH_WARMUP 2
+
+// Scratch key file of the write_key and read_key stages
+#define BENCH_KEY "target/bench.bin"
+
+/* Times the stages of key generation, encryption and decryption at the
+   scheme's sizes, each on its own: min, median and p99 of reps runs after
+   warmup ones, with bytes touched per run and the GB/s and ops/s of the
+   median. stages lists the names to run, NULL runs them all. The table
+   goes to stdout and, unless json_path is NULL, the same results go there
+   as JSON; with "-" the JSON takes stdout and the table stderr. Returns 0
+   or -1. */
+int bench(int reps, int warmup, const char *const *stages, int count, const char *json_path);
+
+/* Prints the stage names, one per line */
+void bench_list(void);
+
+#endif // BENCH_H
@@ -0,0 +1,20 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Instruction set levels usable by the GF(2) kernels, in increasing order
+enum cpu_level {
+    CPU_SCALAR,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_AVX512_VPOPCNT
+};
+
+/* Detects once (cpuid + xgetbv) the best level supported by both CPU and OS */
+enum cpu_level cpu_level(void);
+
+const char *cpu_level_name(enum cpu_level level);
+
+/* Whether the SSE4.2 crc32 instruction is available */
+int cpu_has_crc32c(void);
+
+#endif // CPU_H
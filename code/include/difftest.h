@@ -0,0 +1,32 @@
+#ifndef DIFFTEST_H
+#define DIFFTEST_H
+
+#include <stdint.h>
+
+// Random shapes tried per operation and kernel variant
+#define DIFF_ROUNDS 20
+
+// Timings of the last accepted run, and the slowdown in percent flagged
+#define DIFF_BASELINE "target/baseline.txt"
+#define DIFF_THRESHOLD 15.0
+
+/* rounds and seed fix the inputs, so a failure is replayed by passing them
+   again. baseline is the timing file, NULL to skip the timings; update
+   rewrites it with this run, as does a first run when it does not exist. */
+struct diff_config {
+    int rounds;
+    uint64_t seed;
+    const char *baseline;
+    int update;
+    double threshold;
+};
+
+/* Differential test of the GF(2) operations. Every kernel variant the CPU
+   runs is swapped in turn, and the results of arrays.c on random shapes,
+   widths off the word boundary included, are compared bit by bit with
+   plain references. Then each kernel is timed on fixed shapes against the
+   baseline. Mismatches and slowdowns past the threshold are printed; returns
+   0 when there are none, -1 otherwise. */
+int difftest(const struct diff_config *cfg);
+
+#endif // DIFFTEST_H
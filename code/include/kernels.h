@@ -0,0 +1,42 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+struct rng_lanes;
+
+/* Hot GF(2) primitives, one implementation per instruction set level */
+struct kernel_set {
+    const char *name;
+
+    /* Parity of the AND of two len-word rows, i.e. their GF(2) dot product */
+    uint64_t (*dot)(const uint64_t *a, const uint64_t *b, int len);
+
+    /* Sets bit i of out (zeroed by the caller) to the dot of rows[i] and v */
+    void (*mat_vec)(uint64_t *const *rows, int n, const uint64_t *v, int len, uint64_t *out);
+
+    /* In-place transpose of a 64x64 bit block, word r holding row r */
+    void (*transpose64)(uint64_t *blk);
+
+    /* Writes n random words, word j drawn from lane j % RNG_LANES. A partial
+       last round still steps every lane, so all variants agree on the output */
+    void (*rand_fill)(struct rng_lanes *l, uint64_t *out, int n);
+
+    /* dst ^= src over n words */
+    void (*xor_words)(uint64_t *dst, const uint64_t *src, size_t n);
+};
+
+// Active kernels, the portable ones until select_kernels() runs
+extern struct kernel_set kernels;
+
+/* Kernels of a given level, which the CPU must support. Builds without x86
+   vector code get the portable ones at every level. */
+struct kernel_set kernels_for(enum cpu_level level);
+
+/* Picks the fastest kernels for this CPU, to be called once at startup */
+void select_kernels(void);
+
+#endif // KERNELS_H
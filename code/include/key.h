@@ -0,0 +1,77 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include "arena.h"
+#include "arrays.h"
+#include "params.h"
+#include "seedkey.h"
+#include "xoshiro.h"
+
+/* Batch size from which key_mat_mul switches to M4RM. Each of its K/8
+   slices walks every row of S, a fixed cost of about 14 ms for the
+   standard set; below that the block path costs 110-135 us a message and
+   M4RM 880 at 16, 220 at 64, tying at 128 and ahead at 256 with 94. */
+#define DECRYPT_M4RM 256
+
+/* Batch size from which key_encrypt transposes row-major keys and takes the
+   column path. For the standard set the transposes take about 66 ms and
+   save about 0.8 ms per message over the batched dense product. */
+#define ENCRYPT_TRANSPOSE 96
+
+/* A loaded key: a stored matrix in either layout, or a seed to expand,
+   with the parameter set it belongs to. Loaded keys are only read, so
+   threads can share one. */
+struct key {
+    struct mat *m;
+    struct seed_mat *seed;
+    int layout;
+    const struct params *params;
+};
+
+int load_key(const char *path, struct key *k);
+
+/* Parameter set of the key at path without loading it: the one named in
+   its header, or for seeds and legacy keys the one its shape belongs to.
+   NULL if it cannot be told. */
+const struct params *key_params(const char *path);
+void free_key(struct key *k);
+
+struct arr *key_arr_mul(struct key *k, struct arr *a);
+struct arr *key_noise_mul(struct key *k, struct sparse *e);
+struct mat *key_arr_mul_batch(struct key *k, struct mat *v);
+struct mat *key_noise_mul_batch(struct key *k, struct sparse_mat *e);
+struct mat *key_mat_mul(struct key *k, struct mat *v);
+
+/* Both work in the parameter set of their keys, whatever the active one */
+int key_encrypt(struct key *a, struct key *y, struct mat *msg, struct rng *rng,
+                struct mat **nnc, struct mat **word);
+int key_decrypt(struct key *s, struct mat *nnc, struct mat *word, struct mat **msg);
+
+/* Bytes of scratch the _into forms below need for keys of the set p */
+size_t key_scratch_size(const struct params *p);
+
+/* Allocation-free forms for one message. Results go to the caller's nnc,
+   word and msg buffers, of real_dim(k) and real_dim(l) words; the noise and
+   every temporary come from scratch, released before returning. Once the
+   keys are loaded, encrypting and decrypting touch no heap. */
+int key_arr_mul_into(struct arr *res, struct key *k, struct arr *a, struct arena *scratch);
+int key_noise_mul_into(struct arr *res, struct key *k, struct sparse *e, struct arena *scratch);
+int key_encrypt_into(struct key *a, struct key *y, struct arr *msg, struct rng *rng, struct arena *scratch,
+                     struct arr *nnc, struct arr *word);
+int key_decrypt_into(struct key *s, struct arr *nnc, struct arr *word, struct arena *scratch, struct arr *msg);
+
+/* Bytes of scratch the batch forms below need for up to rows messages */
+size_t key_batch_scratch_size(const struct params *p, int rows);
+
+/* Allocation-free batch forms, one pass over each key for all the rows.
+   Results go to the caller's matrices, which have one row per message and
+   the columns of the set; key_encrypt and key_decrypt are these over fresh
+   matrices and scratch. */
+int key_arr_mul_batch_into(struct mat *res, struct key *k, struct mat *v, struct arena *scratch);
+int key_noise_mul_batch_into(struct mat *res, struct key *k, struct sparse_mat *e, struct arena *scratch);
+int key_mat_mul_into(struct mat *res, struct key *k, struct mat *v, struct arena *scratch);
+int key_encrypt_batch_into(struct key *a, struct key *y, struct mat *msg, struct rng *rng, struct arena *scratch,
+                           struct mat *nnc, struct mat *word);
+int key_decrypt_batch_into(struct key *s, struct mat *nnc, struct mat *word, struct arena *scratch, struct mat *msg);
+
+#endif // KEY_H
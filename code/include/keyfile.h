@@ -0,0 +1,55 @@
+#ifndef KEYFILE_H
+#define KEYFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arrays.h"
+#include "params.h"
+
+/* Key container, version 1. All header fields are little-endian:
+
+     0  magic "ALEKKEY\0"      24  stride (words per row)
+     8  version               28  layout
+    12  payload offset        32  parameter-set ID
+    16  rows                  36  CRC32C of the payload
+    20  cols                  40  payload size in bytes (64 bit)
+                              48  CRC32C of bytes 0..47
+
+   The payload starts on a KEY_PAGE boundary and holds rows * stride
+   little-endian words, every row padded to stride like in memory, so a
+   mapped file is directly usable as a struct mat. */
+
+#define KEY_MAGIC "ALEKKEY"
+#define KEY_VERSION 1
+#define KEY_PAGE 4096
+
+// Layout of the stored matrix: the key itself or its transpose
+#define KEY_ROW_MAJOR 0
+#define KEY_COL_MAJOR 1
+
+// Parameter set of the keys written now, that of legacy keys is told by their shape
+#define KEY_PARAMS (active_params->id)
+
+struct key_info {
+    int rows;
+    int cols;
+    int stride;
+    int layout;
+    int params;
+};
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+int is_key_file(const char *path);
+int write_key_file(const char *path, struct mat *m, int layout, int params);
+struct mat *read_key_file(const char *path, struct key_info *info);
+
+/* Checks the header of a key file and fills info, without the payload */
+int read_key_info(const char *path, struct key_info *info);
+struct mat *map_key_file(const char *path, struct key_info *info);
+
+/* Checks the payload CRC that map_key_file leaves out, 0 if it matches */
+int verify_key_file(const char *path);
+int convert_key_file(const char *legacy_path, const char *path);
+
+#endif // KEYFILE_H
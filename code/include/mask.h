@@ -0,0 +1,59 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stdint.h>
+
+#include "key.h"
+
+// Masks computed per refill step
+#define MASK_BATCH 64
+
+/* Offline part of encryption. For a noise vector e the pair (A * e, Y * e)
+   does not depend on the message, so a background thread keeps a ring of
+   such masks ready and the online path is left with one XOR of Y * e into
+   the message. Every mask is handed out once. */
+struct mask_pool;
+
+/* capacity: masks held by the ring. low_water: the thread refills the ring
+   to capacity once the fill drops to this level, values outside
+   [0, capacity) use capacity / 2. rate: masks computed per second at most,
+   0 for no limit. */
+struct mask_config {
+    int capacity;
+    int low_water;
+    double rate;
+};
+
+struct mask_stats {
+    int capacity;
+    int low_water;
+    int fill;
+    int fill_min;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refilled;
+    double refill_rate;
+    double compute_rate;
+};
+
+/* Starts the refill thread over keys a and y, which must outlive the pool.
+   The ring is empty at first and fills in the background. */
+struct mask_pool *mask_pool_new(struct key *a, struct key *y, const struct mask_config *cfg);
+void mask_pool_free(struct mask_pool *p);
+
+/* Same result as key_encrypt, with the masks taken from the ring. Rows
+   beyond the fill are counted as misses and computed on the spot. */
+int mask_encrypt(struct mask_pool *p, struct mat *msg, struct mat **nnc, struct mat **word);
+
+/* Same into the caller's nnc and word, one row per message, the misses
+   going through key_encrypt_batch_into over scratch. Touches no heap. */
+int mask_encrypt_batch_into(struct mask_pool *p, struct mat *msg, struct arena *scratch, struct mat *nnc,
+                            struct mat *word);
+
+/* hits and misses count rows of mask_encrypt, fill_min is the lowest fill
+   a take has left. refill_rate is the masks delivered per second since the
+   pool started, throttle pauses and idle time included; compute_rate the
+   masks per second of refill work alone. */
+void mask_pool_stats(struct mask_pool *p, struct mask_stats *st);
+
+#endif // MASK_H
@@ -0,0 +1,56 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "arrays.h"
+
+/* A packet is a bit vector as write_packet stores it: the length in bits
+   as a little-endian u32, then the real_dim(len) words, little-endian too,
+   so packets read the same on any host. A ciphertext is its nnc packet
+   followed by its word packet, as one contiguous blob. */
+
+// Packets per readv or writev call, two iovecs each
+#define PACKET_CHUNK 32
+
+// Bytes of the length in front of the words
+#define PACKET_HEADER 4
+
+/* Turns n words between host order and little-endian, in place. Nothing
+   to do on little-endian hosts. */
+void swap_le(uint64_t *w, size_t n);
+
+size_t packet_size(int len);
+size_t cipher_size(int nnc_len, int word_len);
+
+/* Writes the packet of a to buf. Returns the bytes written, 0 if they do
+   not fit in size */
+size_t packet_encode(const struct arr *a, void *buf, size_t size);
+
+/* Reads the packet at the start of buf into a, whose data holds
+   real_dim(a->len) words on entry; a->len is set to the decoded length.
+   Returns the bytes consumed, 0 if buf is short or the vector does not fit */
+size_t packet_decode(struct arr *a, const void *buf, size_t size);
+
+/* Length in bits of the packet at the start of buf, -1 if buf is short */
+int packet_peek(const void *buf, size_t size);
+
+size_t cipher_encode(const struct arr *nnc, const struct arr *word, void *buf, size_t size);
+size_t cipher_decode(struct arr *nnc, struct arr *word, const void *buf, size_t size);
+
+/* writev and readv carried on over short transfers and EINTR, consuming
+   iov. Sockets are written with MSG_NOSIGNAL, so a peer that went away is
+   an error rather than a SIGPIPE. These are the only reads and writes of
+   the packet and server paths. Return 0, or -1 on errors and early EOF */
+int write_iov(int fd, struct iovec *iov, int n);
+int read_iov(int fd, struct iovec *iov, int n);
+
+/* count packets in one vectored call per PACKET_CHUNK, headers and words
+   going straight from and to the vectors of a. Reads expect the lengths
+   set in a and fail on any other. Return 0 or -1 */
+int packets_writev(int fd, const struct arr *a, int count);
+int packets_readv(int fd, struct arr *a, int count);
+
+#endif // PACKET_H
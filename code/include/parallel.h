@@ -0,0 +1,18 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "arrays.h"
+#include "pool.h"
+
+// Rows per task when generating random and noise matrices
+#define ROW_BLOCK 64
+
+/* Key generation steps split over a pool. Every block of ROW_BLOCK rows is
+   drawn from its own xoshiro256** stream, taken long_jump() apart from rng,
+   so the output does not depend on the number of threads. rng must be
+   seeded; it is moved past all the streams it handed out. */
+struct mat *rand_mat_mt(int rows, int cols, struct pool *pool, struct rng *rng);
+struct sparse_mat *weight_sparse_mat_mt(int rows, int cols, int weight, struct pool *pool, struct rng *rng);
+struct mat *matrix_mul_m4rm_mt(struct mat *a, struct mat *b, struct pool *pool);
+
+#endif // PARALLEL_H
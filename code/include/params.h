@@ -0,0 +1,34 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+/* Sizes of one parameter set: messages of l bits, S is l x k, A is k x n,
+   Y is l x n, and the noise has weight t over n bits. The id is the one
+   stored in key file headers. */
+struct params {
+    int id;
+    const char *name;
+    int l;
+    int k;
+    int n;
+    int t;
+};
+
+// Set of the keys written before the registry, still the default one
+#define PARAMS_DEFAULT 1
+
+/* Active set, the one L, K, N and T stand for. It is chosen once at startup,
+   before any key is loaded or generated. */
+extern const struct params *active_params;
+
+/* Registered sets, count of them in *count */
+const struct params *params_list(int *count);
+
+const struct params *params_by_name(const char *name);
+const struct params *params_by_id(int id);
+
+/* Set having a matrix of this shape, in either layout, NULL if none does */
+const struct params *params_by_shape(int rows, int cols);
+
+void select_params(const struct params *p);
+
+#endif // PARAMS_H
@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Fixed set of worker threads running batches of independent tasks */
+struct pool;
+
+typedef void (*pool_fn)(void *ctx, int task, int worker);
+
+/* threads <= 0 uses one worker per online CPU */
+struct pool *pool_new(int threads);
+int pool_size(struct pool *p);
+
+/* Runs fn(ctx, task, worker) for task = 0 .. tasks - 1 and waits for all */
+void pool_run(struct pool *p, pool_fn fn, void *ctx, int tasks);
+
+void pool_free(struct pool *p);
+
+#endif // POOL_H
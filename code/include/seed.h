@@ -1,7 +1,15 @@
 #ifndef SEED_H
 #define SEED_H
 
+#include "xoshiro.h"
+
 void reset_seed();
 void init_seed();
 
+/* Seeds a context from the system entropy source */
+void rng_seed(struct rng *r);
+
+/* Per-thread context used when a caller passes no rng, seeded on first use */
+struct rng *thread_rng(void);
+
 #endif
@@ -0,0 +1,37 @@
+#ifndef SEEDKEY_H
+#define SEEDKEY_H
+
+#include <stdint.h>
+#include "arrays.h"
+
+#define SEED_BYTES 32
+
+// Rows expanded per block by seed_mat_arr_mul, must divide SIZE
+#define SEED_BLOCK 32
+
+// Words of the block buffer of seed_mat_arr_mul_into for cols columns
+#define SEED_SCRATCH(cols) ((size_t)SEED_BLOCK * real_dim(cols))
+
+/* Uniformly random matrix stored as the seed of a deterministic expander:
+   row i is regenerated on demand, independently of every other row. */
+struct seed_mat {
+    int rows;
+    int cols;
+    uint8_t seed[SEED_BYTES];
+};
+
+struct seed_mat *seed_mat_new(int rows, int cols);
+void seed_mat_row(const struct seed_mat *m, int i, uint64_t *row);
+struct mat *seed_mat_expand(const struct seed_mat *m);
+struct arr *seed_mat_arr_mul(const struct seed_mat *m, struct arr *a);
+
+/* Same into res, rows expanded in the caller's SEED_SCRATCH(cols) words */
+int seed_mat_arr_mul_into(struct arr *res, const struct seed_mat *m, struct arr *a, uint64_t *blk);
+struct mat *seed_mat_arr_mul_batch(const struct seed_mat *m, struct mat *v);
+int seed_mat_arr_mul_batch_into(struct mat *res, const struct seed_mat *m, struct mat *v, uint64_t *blk);
+
+int write_seed_file(const char *path, const struct seed_mat *m);
+struct seed_mat *read_seed_file(const char *path);
+int is_seed_file(const char *path);
+
+#endif // SEEDKEY_H
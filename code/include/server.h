@@ -0,0 +1,42 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "mask.h"
+
+/* Request and response frames share a 12-byte little-endian header: u8 op,
+   u8 status (0 in requests), u16 parameter set id, u32 request id, u32
+   payload length. Set 0 stands for the first set the server loaded, and
+   responses echo the set id of their request. Bit vectors travel packed,
+   real_dim(n) little-endian words each, at the sizes of the set:
+   - ENCRYPT: message -> nnc, word
+   - DECRYPT: nnc, word -> message
+   - CORRECT: three received copies -> corrected message
+   - STATS: nothing -> text counters, one "name value" per line
+   Responses carry the id of their request and may come back out of order. */
+#define SERVE_ENCRYPT 1
+#define SERVE_DECRYPT 2
+#define SERVE_CORRECT 3
+#define SERVE_STATS 4
+
+#define SERVE_OK 0
+#define SERVE_BAD_REQUEST 1
+#define SERVE_NO_KEY 2
+#define SERVE_FAILED 3
+
+// Requests in flight before readers block, and requests of one op per batch
+#define SERVE_QUEUE 1024
+#define SERVE_BATCH 64
+
+/* Loads the keys once and answers requests on a Unix socket at path until
+   SIGINT or SIGTERM. key_paths holds the A, Y and S paths of each of the
+   sets, one parameter set each. A key path of "-" leaves that key out, and
+   the requests needing it get SERVE_NO_KEY, as do those naming a set not
+   loaded. threads <= 0 uses one worker per CPU. With masks set, every set
+   takes its encryption masks from a precomputed pool of its own and STATS
+   reports their state too. */
+int serve(const char *path, const char *const *key_paths, int sets, int threads, const struct mask_config *masks);
+
+/* Asks the server at path for its counters and prints them */
+int serve_stats(const char *path);
+
+#endif // SERVER_H
@@ -0,0 +1,36 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#define STREAM_MAGIC "ALEKSTRM"
+#define STREAM_VERSION 2
+
+// Ciphertexts carried per block, as encrypt writes them for correct
+#define STREAM_COPIES 3
+
+// Blocks encrypted together by one worker, and slots per worker in the queue
+#define STREAM_BATCH 64
+#define STREAM_DEPTH 2
+
+/* Stream format: a 16-byte header (magic, version, bytes per block), then
+   one frame per l-bit block holding a u32 plaintext length and, for each
+   of the STREAM_COPIES ciphertexts of the block, the packed nnc and the
+   packed word, and a zero length closing the stream. Fields and words are
+   little-endian.
+
+   Decryption takes the bitwise majority of the decrypted copies, as
+   decrypt and correct do. That leaves a bit flipped with probability
+   3p^2 - 2p^3, p being the flip rate of one copy set by T/N, so a stream
+   comes back exactly only when the keys carry no noise.
+
+   Input is read STREAM_BATCH blocks at a time into a bounded ring of
+   slots, encrypted or decrypted on threads workers (threads <= 0 uses all
+   CPUs) and written back in order, so memory use does not grow with the
+   size of the input. Sizes are those of the keys' parameter set, and a
+   stream only decrypts under a key of the set it was encrypted in. Both
+   return 0 or -1. */
+int encrypt_stream(FILE *in, FILE *out, const char *a_path, const char *y_path, int threads);
+int decrypt_stream(FILE *in, FILE *out, const char *key_path, int threads);
+
+#endif // STREAM_H
@@ -3,6 +3,12 @@
 
 #include <stdint.h>
 
+/* Generator state owned by its caller. Operations that draw from different
+   contexts can run concurrently; the global s is kept for the old API. */
+struct rng {
+    uint64_t s[4];
+};
+
 extern uint64_t s[4];
 
 /* Function to rotate bits left */
@@ -11,10 +17,34 @@ static inline uint64_t rotl(const uint64_t x, int k);
 /* Advances the state of the generator and returns the next random number */
 uint64_t next(void);
 
+/* Same as next() on a caller-owned state */
+uint64_t next_state(uint64_t *st);
+
 /* Jump function for the generator to generate non-overlapping subsequences */
 void jump(void);
 
 /* Long jump function for the generator for distributed computations */
 void long_jump(void);
 
+/* next(), jump() and long_jump() on a context */
+uint64_t rng_next(struct rng *r);
+void rng_jump(struct rng *r);
+void rng_long_jump(struct rng *r);
+
+// Interleaved streams of the bulk generator, one per 64-bit vector lane
+#define RNG_LANES 8
+
+/* Lane states stored word-major, s[k][l] being word k of lane l, so that a
+   single vector load picks the same word of every lane. */
+struct rng_lanes {
+    uint64_t s[4][RNG_LANES];
+};
+
+/* Splits r into RNG_LANES streams jump() apart and moves r past them */
+void rng_lanes_init(struct rng_lanes *l, struct rng *r);
+
+/* splitmix64 step: advances *x and returns the next output, the way to
+   turn a 64-bit seed into well-mixed state words */
+uint64_t splitmix64(uint64_t *x);
+
 #endif // XOSHIRO256_H
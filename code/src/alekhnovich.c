@@ -8,9 +8,9 @@
 void generate_key() {
     struct mat *a, *s, *e, *y;
 
-    a = rand_mat(K, N);
-    s = rand_mat(L, K);
-    e = weight_matrix(L, N, T);
+    a = rand_mat(K, N, NULL);
+    s = rand_mat(L, K, NULL);
+    e = weight_matrix(L, N, T, NULL);
 
     if(a == NULL ||s == NULL || e == NULL )
         return;
@@ -87,7 +87,7 @@ void encrypt(uint64_t *mex, const char *a_path, const char *y_path) {
 
     e->len = N;
 
-    e->data = weight_array(e->len, T);
+    e->data = weight_array(e->len, T, NULL);
     if(e->data == NULL)
         return;
 
@@ -1,115 +1,339 @@
 #include "../include/api.h"
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "../include/arena.h"
 #include "../include/backend.h"
+#include "../include/key.h"
 #include "../include/arrays.h"
+#include "../include/keyfile.h"
+#include "../include/seedkey.h"
+#include "../include/parallel.h"
+#include "../include/seed.h"
 
-void generate_key() {
-    struct mat *a, *s, *e, *y;
+static int threads = 0;
 
-    a = rand_mat(K, N);
-    s = rand_mat(L, K);
-    e = weight_matrix(L, N, T);
+void set_threads(int n) {
+    threads = n;
+}
 
-    if(a == NULL ||s == NULL || e == NULL )
-        return;
+/* Public key Y = S * A + E, with E drawn sparse and added in place */
+static struct mat *public_key(const struct params *p, struct mat *a, struct mat *s, struct pool *pool,
+                              struct rng *rng) {
+    struct sparse_mat *e = weight_sparse_mat_mt(p->l, p->n, p->t, pool, rng);
+    if(e == NULL)
+        return NULL;
 
-    struct mat *tmp = matrix_mul(s, a);
-    if(tmp == NULL)
-        return;
+    struct mat *y = matrix_mul_m4rm_mt(s, a, pool);
+    if(y != NULL)
+        sparse_mat_add(y, e);
 
-    y = matrix_sum(tmp, e);
+    free_sparse_mat(e);
+    return y;
+}
 
-    if(y == NULL)
-        return;
+int generate_key(const struct params *p) {
+    struct mat *a = NULL, *s = NULL, *y = NULL, *a_col = NULL, *y_col = NULL;
+    struct rng rng;
+    int ret = -1;
+
+    set_huge_pages(1);
+
+    struct pool *pool = pool_new(threads);
+    if(pool == NULL)
+        return -1;
+
+    rng_seed(&rng);
+
+    a = rand_mat_mt(p->k, p->n, pool, &rng);
+    s = rand_mat_mt(p->l, p->k, pool, &rng);
+    if(a != NULL && s != NULL)
+        y = public_key(p, a, s, pool, &rng);
+    pool_free(pool);
+
+    if(y != NULL && write_key_file(A_PUB, a, KEY_ROW_MAJOR, p->id) == 0
+       && write_key_file(Y_PUB, y, KEY_ROW_MAJOR, p->id) == 0
+       && write_key_file(PRIVA, s, KEY_ROW_MAJOR, p->id) == 0) {
+        a_col = matrix_transpose(a);
+        y_col = matrix_transpose(y);
+
+        if(a_col != NULL && y_col != NULL && write_key_file(A_COL, a_col, KEY_COL_MAJOR, p->id) == 0
+           && write_key_file(Y_COL, y_col, KEY_COL_MAJOR, p->id) == 0)
+            ret = 0;
+    }
+
+    free_mat(a);
+    free_mat(s);
+    free_mat(y);
+    free_mat(a_col);
+    free_mat(y_col);
+    return ret;
+}
 
-    write_key(A_PUB, a);
-    write_key(Y_PUB, y);
-    write_key(PRIVA, s);
+/* Same key pair, but A and S are only stored as the seeds they expand from;
+   Y cannot be compressed and is written as usual. */
+int generate_seeded_key(const struct params *p) {
+    struct seed_mat *a_seed, *s_seed;
+    struct mat *a = NULL, *s = NULL, *y = NULL, *y_col = NULL;
+    struct pool *pool = NULL;
+    struct rng rng;
+    int ret = -1;
+
+    set_huge_pages(1);
+
+    a_seed = seed_mat_new(p->k, p->n);
+    s_seed = seed_mat_new(p->l, p->k);
+    if(a_seed != NULL && s_seed != NULL) {
+        a = seed_mat_expand(a_seed);
+        s = seed_mat_expand(s_seed);
+    }
+
+    if(a != NULL && s != NULL && (pool = pool_new(threads)) != NULL) {
+        rng_seed(&rng);
+        y = public_key(p, a, s, pool, &rng);
+        pool_free(pool);
+    }
+
+    if(y != NULL && write_seed_file(A_SEED, a_seed) == 0 && write_seed_file(S_SEED, s_seed) == 0
+       && write_key_file(Y_PUB, y, KEY_ROW_MAJOR, p->id) == 0) {
+        y_col = matrix_transpose(y);
+
+        if(y_col != NULL && write_key_file(Y_COL, y_col, KEY_COL_MAJOR, p->id) == 0)
+            ret = 0;
+    }
+
+    free(a_seed);
+    free(s_seed);
+    free_mat(a);
+    free_mat(s);
+    free_mat(y);
+    free_mat(y_col);
+    return ret;
 }
 
-void encrypt(const char *mex, const char *a_path, const char *y_path) {
+/* One message through key_encrypt_into: past loading the keys and reading
+   the message, the only buffers are the two outputs and the scratch arena */
+void encrypt(const char *mex, const char *a_path, const char *y_path, struct rng *rng) {
     if(mex == NULL)
         return;
 
-    struct mat *a, *y;
-    struct arr *nnc, *word, *tmp;
+    struct key a, y;
+    struct arena scratch;
 
-    a = read_key(a_path);
-
-    y = read_key(y_path);
-
-    if(a == NULL || y == NULL)
+    if(load_key(a_path, &a) != 0)
         return;
-
-    struct arr *e = calloc(1ULL, sizeof(struct mat));
-    if(e == NULL)
+    if(load_key(y_path, &y) != 0) {
+        free_key(&a);
         return;
+    }
+
+    struct arr message = { a.params->l, convert_to_array(mex, a.params->l) };
+    struct arr nnc = { a.params->k, calloc(real_dim(a.params->k), sizeof(uint64_t)) };
+    struct arr word = { a.params->l, calloc(real_dim(a.params->l), sizeof(uint64_t)) };
+
+    if(message.data != NULL && nnc.data != NULL && word.data != NULL
+       && arena_init(&scratch, key_scratch_size(a.params)) == 0) {
+        if(key_encrypt_into(&a, &y, &message, rng, &scratch, &nnc, &word) == 0) {
+            write_packet(WRNNC, &nnc);
+            write_packet(ENCRY, &word);
+        }
+        arena_free(&scratch);
+    }
+
+    free(message.data);
+    free(nnc.data);
+    free(word.data);
+    free_key(&a);
+    free_key(&y);
+}
 
-    e->len = N;
+/* Loads both keys for one key_encrypt over the rows of msg */
+int encrypt_mat(struct mat *msg, const char *a_path, const char *y_path, struct rng *rng,
+                struct mat **nnc, struct mat **word) {
+    struct key a, y;
 
-    e->data = weight_array(e->len, T);
-    if(e->data == NULL)
-        return;
+    if(load_key(a_path, &a) != 0)
+        return -1;
+    if(load_key(y_path, &y) != 0) {
+        free_key(&a);
+        return -1;
+    }
 
-    nnc = mat_arr_mul(a, e);
-    tmp = mat_arr_mul(y, e);
-    if(nnc == NULL || tmp == NULL)
-        return;
+    int ret = key_encrypt(&a, &y, msg, rng, nnc, word);
 
-    word = calloc(1ULL, sizeof(struct arr));
-    if(word == NULL)
-        return;
+    free_key(&a);
+    free_key(&y);
+    return ret;
+}
 
-    struct arr *message = calloc(1ULL, sizeof(struct arr *));
-    if(message == NULL)
-        return;
+/* Batch form of encrypt: pair i goes to WRNNC and ENCRY suffixed with _i.
+   The messages are read at the length of the keys' set */
+int encrypt_batch(const char *const *mex, int count, const char *a_path, const char *y_path,
+                  struct rng *rng) {
+    if(mex == NULL || count <= 0)
+        return -1;
+
+    struct key a, y;
+
+    if(load_key(a_path, &a) != 0)
+        return -1;
+    if(load_key(y_path, &y) != 0) {
+        free_key(&a);
+        return -1;
+    }
+
+    const struct params *p = a.params;
+    struct mat *msg = new_mat(count, p->l);
+    int ret = msg != NULL ? 0 : -1;
+
+    for(int i = 0; i < count && ret == 0; i++) {
+        uint64_t *row = convert_to_array(mex[i], p->l);
+        if(row == NULL)
+            ret = -1;
+        else
+            memcpy(msg->data[i], row, real_dim(p->l) * sizeof(uint64_t));
+        free(row);
+    }
+
+    struct mat *nnc = NULL, *word = NULL;
+    if(ret == 0)
+        ret = key_encrypt(&a, &y, msg, rng, &nnc, &word);
+
+    free_mat(msg);
+    free_key(&a);
+    free_key(&y);
+    if(ret != 0)
+        return -1;
+
+    char path[256];
+    for(int i = 0; i < count; i++) {
+        struct arr n = { nnc->cols, nnc->data[i] };
+        struct arr w = { word->cols, word->data[i] };
+
+        if(indexed_path(path, sizeof(path), WRNNC, i) != 0) {
+            ret = -1;
+            break;
+        }
+        write_packet(path, &n);
+
+        if(indexed_path(path, sizeof(path), ENCRY, i) != 0) {
+            ret = -1;
+            break;
+        }
+        write_packet(path, &w);
+    }
+
+    free_mat(nnc);
+    free_mat(word);
+    return ret;
+}
 
-    message->len = L;
-    message->data = convert_to_array(mex);
+int decrypt_mat(struct mat *nnc, struct mat *word, const char *key_path, struct mat **msg) {
+    struct key s;
 
-    word = array_xor(message, tmp);
+    if(load_key(key_path, &s) != 0)
+        return -1;
 
-    if(word->data == NULL)
-        return;
+    int ret = key_decrypt(&s, nnc, word, msg);
 
-    write_packet(WRNNC, nnc);
-    write_packet(ENCRY, word);
+    free_key(&s);
+    return ret;
 }
 
-void decrypt(const char *fnnc, const char *fword, const char *key_path) {
-    struct mat *s;
-    struct arr *nnc, *word, *message;
-
-    s = read_key(key_path);
-
-    nnc = read_packet(fnnc);
-    word = read_packet(fword);
+/* Batch form of decrypt over count (nnc, word) file pairs; message i goes to
+   NOISY suffixed with _i. The packets must have the sizes of the key's set */
+int decrypt_batch(const char *const *fnnc, const char *const *fword, int count, const char *key_path) {
+    if(fnnc == NULL || fword == NULL || count <= 0)
+        return -1;
+
+    struct key s;
+
+    if(load_key(key_path, &s) != 0)
+        return -1;
+
+    const struct params *p = s.params;
+    struct mat *nnc = new_mat(count, p->k);
+    struct mat *word = new_mat(count, p->l);
+    int ret = nnc != NULL && word != NULL ? 0 : -1;
+
+    for(int i = 0; i < count && ret == 0; i++) {
+        struct arr *n = read_packet(fnnc[i]);
+        struct arr *w = read_packet(fword[i]);
+
+        if(n == NULL || w == NULL || n->len != p->k || w->len != p->l)
+            ret = -1;
+        else {
+            memcpy(nnc->data[i], n->data, real_dim(p->k) * sizeof(uint64_t));
+            memcpy(word->data[i], w->data, real_dim(p->l) * sizeof(uint64_t));
+        }
+
+        free_arr(n);
+        free_arr(w);
+    }
+
+    struct mat *msg = NULL;
+    if(ret == 0)
+        ret = key_decrypt(&s, nnc, word, &msg);
+
+    free_mat(nnc);
+    free_mat(word);
+    free_key(&s);
+
+    char path[256];
+    for(int i = 0; ret == 0 && i < count; i++) {
+        struct arr m = { msg->cols, msg->data[i] };
+
+        if(indexed_path(path, sizeof(path), NOISY, i) != 0)
+            ret = -1;
+        else
+            write_packet(path, &m);
+    }
+
+    free_mat(msg);
+    return ret;
+}
 
-    if(s == NULL || nnc == NULL || word == NULL)
-        return;
+void decrypt(const char *fnnc, const char *fword, const char *key_path) {
+    struct key s;
+    struct arena scratch;
 
-    struct arr *key = mat_arr_mul(s, nnc);
-    if(key == NULL)
+    if(load_key(key_path, &s) != 0)
         return;
 
-    message = array_xor(word, key);
-
-    write_packet(NOISY, message);
+    struct arr *nnc = read_packet(fnnc);
+    struct arr *word = read_packet(fword);
+    struct arr message = { s.params->l, calloc(real_dim(s.params->l), sizeof(uint64_t)) };
+
+    if(nnc != NULL && word != NULL && message.data != NULL
+       && arena_init(&scratch, key_scratch_size(s.params)) == 0) {
+        if(key_decrypt_into(&s, nnc, word, &scratch, &message) == 0)
+            write_packet(NOISY, &message);
+        arena_free(&scratch);
+    }
+
+    free(message.data);
+    free_arr(nnc);
+    free_arr(word);
+    free_key(&s);
 }
 
-void correct(const char *path1, const char *path2, const char *path3) {
-    struct arr *a, *b, *c;
+/* The three copies must be messages of set p */
+void correct(const struct params *p, const char *path1, const char *path2, const char *path3) {
+    struct arr *a, *b, *c, *res = NULL;
 
     a = read_packet(path1);
     b = read_packet(path2);
     c = read_packet(path3);
 
-    if(a == NULL || b == NULL || c == NULL)
-        return;
+    if(a != NULL && b != NULL && c != NULL && a->len == p->l && b->len == p->l && c->len == p->l)
+        res = correct_errors(a, b, c);
 
-    struct arr *res = correct_errors(a, b, c);
+    if(res != NULL)
+        write_packet(PLAIN, res);
 
-    write_packet(PLAIN, res);
+    free_arr(a);
+    free_arr(b);
+    free_arr(c);
+    free_arr(res);
 }
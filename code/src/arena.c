@@ -0,0 +1,82 @@
+#include "../include/arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t round_up(size_t bytes) {
+    return (bytes + MAT_ALIGN - 1) / MAT_ALIGN * MAT_ALIGN;
+}
+
+int arena_init(struct arena *a, size_t size) {
+    void *buf = NULL;
+
+    memset(a, 0, sizeof(*a));
+    size = round_up(size);
+    if (size == 0 || posix_memalign(&buf, MAT_ALIGN, size) != 0)
+        return -1;
+
+    a->buf = buf;
+    a->size = size;
+    return 0;
+}
+
+void arena_free(struct arena *a) {
+    free(a->buf);
+    memset(a, 0, sizeof(*a));
+}
+
+void *arena_alloc(struct arena *a, size_t bytes) {
+    bytes = round_up(bytes);
+    if (a->buf == NULL || bytes > a->size - a->used)
+        return NULL;
+
+    void *p = a->buf + a->used;
+    a->used += bytes;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return p;
+}
+
+struct arr arena_arr(struct arena *a, int len) {
+    size_t bytes = (size_t)real_dim(len) * sizeof(uint64_t);
+    struct arr v = { len, arena_alloc(a, bytes) };
+
+    if (v.data != NULL)
+        memset(v.data, 0, bytes);
+    return v;
+}
+
+size_t arena_mat_size(int rows, int cols) {
+    return round_up((size_t)rows * sizeof(uint64_t *)) + round_up((size_t)rows * row_stride(cols) * sizeof(uint64_t));
+}
+
+int arena_mat(struct arena *a, struct mat *m, int rows, int cols) {
+    int stride = row_stride(cols);
+    size_t words = (size_t)rows * stride;
+    uint64_t **data = arena_alloc(a, rows * sizeof(uint64_t *));
+    uint64_t *buf = arena_alloc(a, words * sizeof(uint64_t));
+
+    if (data == NULL || buf == NULL)
+        return -1;
+
+    memset(buf, 0, words * sizeof(uint64_t));
+    for (int i = 0; i < rows; i++)
+        data[i] = buf + (size_t)i * stride;
+
+    *m = (struct mat){ rows, cols, stride, data, buf, NULL, 0 };
+    return 0;
+}
+
+size_t arena_mark(const struct arena *a) {
+    return a->used;
+}
+
+void arena_release(struct arena *a, size_t mark) {
+    if (mark < a->used)
+        a->used = mark;
+}
+
+void arena_reset(struct arena *a) {
+    a->used = 0;
+}
@@ -3,33 +3,87 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "../include/bitop.h"
 #include "../include/xoshiro.h"
 #include "../include/seed.h"
+#include "../include/kernels.h"
 
 
 int real_dim(int n) {
     return n / SIZE + (n % SIZE ? 1 : 0);
 }
 
+int row_stride(int cols) {
+    int align = MAT_ALIGN / sizeof(uint64_t);
+    return (real_dim(cols) + align - 1) / align * align;
+}
+
+static int huge_pages = 0;
+
+void set_huge_pages(int enable) {
+    huge_pages = enable;
+}
+
 void free_mat(struct mat *m) {
     if (m == NULL)
         return;
 
-    if (m->data != NULL) {
+    if (m->map != NULL)
+        munmap(m->map, m->map_len);
+    else if (m->buf != NULL)
+        free(m->buf);
+    else if (m->data != NULL) {
         for (int i = 0; i < m->rows; i++) {
             if (m->data[i] != NULL)
                 free(m->data[i]);
         }
-        free(m->data);
     }
+
+    free(m->data);
     free(m);
 }
 
-struct mat *rand_mat(int rows, int cols) {
-    if (rows == 0 || cols == 0)
+/* Points the row table of m at consecutive stride-word rows of buf */
+static void set_rows(struct mat *m) {
+    for (int i = 0; i < m->rows; i++)
+        m->data[i] = m->buf + (size_t)i * m->stride;
+}
+
+/* Matrix over rows already laid out stride words apart in buf. free_mat
+   releases buf, so callers passing a mapping set map/map_len to have it unmapped. */
+struct mat *mat_view(uint64_t *buf, int rows, int cols, int stride) {
+    struct mat *m = calloc(1, sizeof(struct mat));
+    if (m == NULL)
+        return NULL;
+
+    m->data = calloc(rows, sizeof(uint64_t *));
+    if (m->data == NULL) {
+        free(m);
+        return NULL;
+    }
+
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = stride;
+    m->buf = buf;
+
+    set_rows(m);
+    return m;
+}
+
+/* Zeroed matrix in a single MAT_ALIGN-aligned buffer. With set_huge_pages(1)
+   large buffers are mapped anonymously and advised for transparent huge pages. */
+struct mat mat_slice(const struct mat *m, int begin, int rows, int cols) {
+    struct mat v = { rows, cols, m->stride, m->data + begin, NULL, NULL, 0 };
+    return v;
+}
+
+struct mat *new_mat(int rows, int cols) {
+    if (rows <= 0 || cols <= 0)
         return NULL;
 
     struct mat *m = calloc(1, sizeof(struct mat));
@@ -38,6 +92,7 @@ struct mat *rand_mat(int rows, int cols) {
 
     m->rows = rows;
     m->cols = cols;
+    m->stride = row_stride(cols);
 
     m->data = calloc(rows, sizeof(uint64_t *));
     if (m->data == NULL) {
@@ -45,99 +100,301 @@ struct mat *rand_mat(int rows, int cols) {
         return NULL;
     }
 
-    init_seed();
+    size_t bytes = (size_t)rows * m->stride * sizeof(uint64_t);
+
+    if (huge_pages && bytes >= HUGE_PAGE) {
+        m->map_len = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        m->map = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m->map == MAP_FAILED) {
+            m->map = NULL;
+        } else {
+#ifdef MADV_HUGEPAGE
+            madvise(m->map, m->map_len, MADV_HUGEPAGE);
+#endif
+            m->buf = m->map;
+        }
+    }
 
-    for (int i = 0; i < rows; i++) {
-        m->data[i] = calloc(real_dim(cols), sizeof(uint64_t));
-        if (m->data[i] == NULL) {
+    if (m->buf == NULL) {
+        void *buf = NULL;
+        if (posix_memalign(&buf, MAT_ALIGN, bytes) != 0) {
             free_mat(m);
             return NULL;
         }
-
-        for (int j = 0; j < real_dim(cols); j++)
-            m->data[i][j] = next();
+        memset(buf, 0, bytes);
+        m->buf = buf;
     }
 
+    set_rows(m);
     return m;
 }
 
-uint64_t *weight_array(int len, int weight) {
-    if (len == 0 || weight == 0)
+struct mat *rand_mat(int rows, int cols, struct rng *rng) {
+    if (rows == 0 || cols == 0)
         return NULL;
 
-    uint64_t *array = calloc(real_dim(len), sizeof(uint64_t));
-    if (array == NULL)
+    struct mat *m = new_mat(rows, cols);
+    if (m == NULL)
         return NULL;
 
-    init_seed();
+    rand_rows(m, 0, rows, rng);
+
+    return m;
+}
+
+/* Uniform draws below n from 32-bit halves of the generator output, by
+   Lemire's multiply-shift: the high word of x * n is the draw, and only the
+   n / 2^32 share of x falling in the uneven low zone is drawn again. */
+struct bounded {
+    struct rng *rng;
+    uint64_t bits;
+    int left;
+};
+
+static inline uint32_t bounded_next(struct bounded *b, uint32_t n) {
+    for (;;) {
+        if (b->left == 0) {
+            b->bits = rng_next(b->rng);
+            b->left = 2;
+        }
 
-    for (int i = 0; i < weight; i++) {
-        int pos;
-        do {
-            pos = next() % len;
-        } while (array[pos / SIZE] & (1ULL << (pos % SIZE)));
+        uint64_t m = (uint64_t)(uint32_t)b->bits * n;
+        b->bits >>= 32;
+        b->left--;
 
-        array[pos / SIZE] |= (1ULL << (pos % SIZE));
+        if ((uint32_t)m >= n || (uint32_t)m >= (uint32_t)-n % n)
+            return (uint32_t)(m >> 32);
     }
+}
+
+int sample_weight(int *pos, int rows, int len, int weight, struct rng *rng) {
+    if (len <= 0)
+        return -1;
+
+    uint64_t *bits = calloc(real_dim(len), sizeof(uint64_t));
+    if (bits == NULL)
+        return -1;
 
+    int ret = sample_weight_into(pos, rows, len, weight, bits, rng);
+
+    free(bits);
+    return ret;
+}
+
+int sample_weight_into(int *pos, int rows, int len, int weight, uint64_t *bits, struct rng *rng) {
+    if (pos == NULL || bits == NULL || len <= 0 || weight <= 0 || weight > len)
+        return -1;
+
+    struct bounded b = { rng != NULL ? rng : thread_rng(), 0, 0 };
+
+    /* Floyd's sampling, the set-valued form of a partial Fisher-Yates: step
+       j draws below j + 1 and falls back on j itself when the draw is taken,
+       which j cannot be yet. One draw per position and no retries. */
+    for (int r = 0; r < rows; r++) {
+        int *row = pos + (size_t)r * weight;
+
+        for (int i = 0, j = len - weight; i < weight; i++, j++) {
+            int p = (int)bounded_next(&b, (uint32_t)j + 1);
+            if (bits[p / SIZE] & (1ULL << (p % SIZE)))
+                p = j;
+
+            bits[p / SIZE] |= 1ULL << (p % SIZE);
+            row[i] = p;
+        }
+
+        // Only the drawn bits are cleared, the bitmap is reused by the next row
+        for (int i = 0; i < weight; i++)
+            bits[row[i] / SIZE] = 0;
+    }
+
+    return 0;
+}
+
+uint64_t *weight_array(int len, int weight, struct rng *rng) {
+    if (len == 0 || weight == 0 || weight > len)
+        return NULL;
+
+    uint64_t *array = calloc(real_dim(len), sizeof(uint64_t));
+    int *pos = malloc(weight * sizeof(int));
+    if (array == NULL || pos == NULL || sample_weight(pos, 1, len, weight, rng) != 0) {
+        free(array);
+        free(pos);
+        return NULL;
+    }
+
+    for (int i = 0; i < weight; i++)
+        array[pos[i] / SIZE] |= 1ULL << (pos[i] % SIZE);
+
+    free(pos);
     return array;
 }
 
-struct mat *weight_matrix(int rows, int cols, int weight) {
-    if (rows == 0 || cols == 0 || weight == 0)
+struct sparse *weight_sparse(int len, int weight, struct rng *rng) {
+    if (len == 0 || weight == 0 || weight > len)
         return NULL;
 
-    struct mat *m = calloc(1, sizeof(struct mat));
+    struct sparse *v = calloc(1, sizeof(struct sparse));
+    if (v == NULL)
+        return NULL;
+
+    v->len = len;
+    v->weight = weight;
+
+    v->pos = calloc(weight, sizeof(int));
+    if (v->pos == NULL || sample_weight(v->pos, 1, len, weight, rng) != 0) {
+        free_sparse(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+void free_sparse(struct sparse *v) {
+    if (v == NULL)
+        return;
+
+    free(v->pos);
+    free(v);
+}
+
+struct sparse_mat *weight_sparse_mat(int rows, int cols, int weight, struct rng *rng) {
+    if (rows == 0 || cols == 0 || weight == 0 || weight > cols)
+        return NULL;
+
+    struct sparse_mat *m = calloc(1, sizeof(struct sparse_mat));
     if (m == NULL)
         return NULL;
 
     m->rows = rows;
     m->cols = cols;
+    m->weight = weight;
 
-    m->data = calloc(rows, sizeof(uint64_t *));
-    if (m->data == NULL) {
-        free(m);
+    m->pos = calloc((size_t)rows * weight, sizeof(int));
+    if (m->pos == NULL || sample_weight(m->pos, rows, cols, weight, rng) != 0) {
+        free_sparse_mat(m);
         return NULL;
     }
 
-    init_seed();
+    return m;
+}
+
+/* Fills rows [begin, end) of m from RNG_LANES streams split off rng, so the
+   fill is bound by memory bandwidth rather than by one state's latency. */
+void rand_rows(struct mat *m, int begin, int end, struct rng *rng) {
+    struct rng_lanes lanes;
+    int words = real_dim(m->cols);
 
-    for (int i = 0; i < rows; i++) {
-        m->data[i] = weight_array(cols, weight);
-        if (m->data[i] == NULL) {
-            free_mat(m);
-            return NULL;
-        }
+    rng_lanes_init(&lanes, rng != NULL ? rng : thread_rng());
+
+    for (int i = begin; i < end; i++)
+        kernels.rand_fill(&lanes, m->data[i], words);
+}
+
+/* Draws rows [begin, end) of the noise matrix m from rng */
+int sparse_rows(struct sparse_mat *m, int begin, int end, struct rng *rng) {
+    if (end <= begin)
+        return 0;
+
+    return sample_weight(m->pos + (size_t)begin * m->weight, end - begin, m->cols, m->weight, rng);
+}
+
+void free_sparse_mat(struct sparse_mat *m) {
+    if (m == NULL)
+        return;
+
+    free(m->pos);
+    free(m);
+}
+
+/* In-place m += e over GF(2): flips the weight listed bits of every row. */
+struct mat *sparse_mat_add(struct mat *m, struct sparse_mat *e) {
+    if (m == NULL || e == NULL || m->rows != e->rows || m->cols != e->cols)
+        return NULL;
+
+    for (int i = 0; i < e->rows; i++) {
+        int *row = e->pos + (size_t)i * e->weight;
+
+        for (int j = 0; j < e->weight; j++)
+            m->data[i][row[j] / SIZE] ^= 1ULL << (row[j] % SIZE);
     }
 
     return m;
 }
 
-struct mat *matrix_transpose(struct mat *m) {
-    if (m == NULL)
+/* Result in a fresh arr, freed with its data by the caller */
+static struct arr *new_arr(int len) {
+    struct arr *res = calloc(1, sizeof(struct arr));
+    if (res == NULL)
         return NULL;
 
-    struct mat *t = calloc(1, sizeof(struct mat));
-    if (t == NULL)
+    res->len = len;
+    res->data = calloc(real_dim(len), sizeof(uint64_t));
+    if (res->data == NULL) {
+        free(res);
         return NULL;
+    }
+
+    return res;
+}
+
+void free_arr(struct arr *a) {
+    if (a != NULL)
+        free(a->data);
+    free(a);
+}
 
-    t->rows = m->cols;
-    t->cols = m->rows;
+struct arr *sparse_to_arr(struct sparse *v) {
+    if (v == NULL)
+        return NULL;
 
-    t->data = calloc(t->rows, sizeof(uint64_t *));
-    if (t->data == NULL) {
-        free(t);
+    struct arr *res = new_arr(v->len);
+    if (res != NULL && sparse_to_arr_into(res, v) != 0) {
+        free_arr(res);
         return NULL;
     }
 
-    for (int i = 0; i < t->rows; i++) {
-        t->data[i] = calloc(real_dim(t->cols), sizeof(uint64_t));
-        if (t->data[i] == NULL) {
-            free_mat(t);
-            return NULL;
-        }
+    return res;
+}
+
+int sparse_to_arr_into(struct arr *res, struct sparse *v) {
+    if (res == NULL || res->data == NULL || v == NULL)
+        return -1;
+
+    res->len = v->len;
+    memset(res->data, 0, real_dim(v->len) * sizeof(uint64_t));
+
+    for (int i = 0; i < v->weight; i++)
+        res->data[v->pos[i] / SIZE] |= 1ULL << (v->pos[i] % SIZE);
+
+    return 0;
+}
+
+struct mat *weight_matrix(int rows, int cols, int weight, struct rng *rng) {
+    if (rows == 0 || cols == 0 || weight == 0 || weight > cols)
+        return NULL;
+
+    struct mat *m = new_mat(rows, cols);
+    struct sparse_mat *e = weight_sparse_mat(rows, cols, weight, rng);
+    if (m == NULL || e == NULL) {
+        free_mat(m);
+        free_sparse_mat(e);
+        return NULL;
     }
 
+    sparse_mat_add(m, e);
+
+    free_sparse_mat(e);
+    return m;
+}
+
+struct mat *matrix_transpose_naive(struct mat *m) {
+    if (m == NULL)
+        return NULL;
+
+    struct mat *t = new_mat(m->cols, m->rows);
+    if (t == NULL)
+        return NULL;
+
     for (int i = 0; i < m->rows; i++) {
         for (int j = 0; j < m->cols; j++) {
             int bit_pos_in_block = j % SIZE;
@@ -155,51 +412,117 @@ struct mat *matrix_transpose(struct mat *m) {
     return t;
 }
 
-uint64_t bax(uint64_t *a, uint64_t *b, int len) {
-    uint64_t res = 0;
+/* Block-wise transpose: each 64x64 tile of m is gathered into 64 words,
+   transposed in registers and scattered to the mirrored tile of t. */
+struct mat *matrix_transpose(struct mat *m) {
+    if (m == NULL)
+        return NULL;
+
+    struct mat *t = new_mat(m->cols, m->rows);
+    if (t != NULL)
+        matrix_transpose_into(t, m);
 
-    for (int i = 0; i < len; i++) {
-        int and = a[i] & b[i];
-        res |= and;
+    return t;
+}
+
+int matrix_transpose_into(struct mat *t, struct mat *m) {
+    if (t == NULL || m == NULL || t->rows != m->cols || t->cols != m->rows)
+        return -1;
+
+    uint64_t blk[64];
+
+    for (int i0 = 0; i0 < m->rows; i0 += SIZE) {
+        int h = m->rows - i0 < (int)SIZE ? m->rows - i0 : (int)SIZE;
+
+        for (int j0 = 0; j0 < m->cols; j0 += SIZE) {
+            int w = m->cols - j0 < (int)SIZE ? m->cols - j0 : (int)SIZE;
+
+            for (int r = 0; r < (int)SIZE; r++)
+                blk[r] = r < h ? m->data[i0 + r][j0 / SIZE] : 0;
+
+            kernels.transpose64(blk);
+
+            for (int r = 0; r < w; r++)
+                t->data[j0 + r][i0 / SIZE] = blk[r];
+        }
     }
 
-    return count_ones(res);
+    return 0;
 }
 
-struct mat *matrix_mul(struct mat *a, struct mat *b) {
+uint64_t bax(uint64_t *a, uint64_t *b, int len) {
+    return kernels.dot(a, b, len);
+}
+
+struct mat *matrix_mul_naive(struct mat *a, struct mat *b) {
     if (a == NULL || b == NULL || a->cols != b->rows)
         return NULL;
 
-    struct mat *c = calloc(1, sizeof(struct mat));
+    struct mat *c = new_mat(a->rows, b->cols);
     if (c == NULL)
         return NULL;
 
-    c->rows = a->rows;
-    c->cols = b->cols;
-
-    c->data = calloc(c->rows, sizeof(uint64_t *));
-    if (c->data == NULL) {
-        free(c);
+    struct mat *bt = matrix_transpose(b);
+    if (bt == NULL) {
+        free_mat(c);
         return NULL;
     }
 
-    for (int i = 0; i < c->rows; i++) {
-        c->data[i] = calloc(real_dim(c->cols), sizeof(uint64_t));
-        if (c->data[i] == NULL) {
-            free_mat(c);
-            return NULL;
+    for (int i = 0; i < a->rows; i++) {
+        for (int j = 0; j < bt->rows; j++) {
+            c->data[i][j / SIZE] |= shift_bit(bax(a->data[i], bt->data[j], real_dim(a->cols)), j % SIZE);
         }
     }
 
+    free_mat(bt);
+    return c;
+}
+
+static struct {
+    int rows;
+    int cols;
+    int depth;
+} tiles = { TILE_ROWS, TILE_COLS, TILE_DEPTH };
+
+void set_tile_sizes(int rows, int cols, int depth) {
+    tiles.rows = rows > 0 ? rows : TILE_ROWS;
+    tiles.cols = cols > 0 ? cols : TILE_COLS;
+    tiles.depth = depth > 0 ? depth : TILE_DEPTH;
+}
+
+/* Same product as matrix_mul_naive, but a, the transpose of b and c are walked
+   in tiles.rows x tiles.cols blocks over slices of tiles.depth words, so the
+   rows of a and b^T in use stay resident in L1/L2 while they are reused. */
+struct mat *matrix_mul(struct mat *a, struct mat *b) {
+    if (a == NULL || b == NULL || a->cols != b->rows)
+        return NULL;
+
+    struct mat *c = new_mat(a->rows, b->cols);
+    if (c == NULL)
+        return NULL;
+
     struct mat *bt = matrix_transpose(b);
     if (bt == NULL) {
         free_mat(c);
         return NULL;
     }
 
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < bt->rows; j++) {
-            c->data[i][j / SIZE] |= shift_bit(bax(a->data[i], bt->data[j], real_dim(a->cols)), j % SIZE);
+    int depth = real_dim(a->cols);
+
+    for (int i0 = 0; i0 < a->rows; i0 += tiles.rows) {
+        int i1 = i0 + tiles.rows < a->rows ? i0 + tiles.rows : a->rows;
+
+        for (int j0 = 0; j0 < bt->rows; j0 += tiles.cols) {
+            int j1 = j0 + tiles.cols < bt->rows ? j0 + tiles.cols : bt->rows;
+
+            for (int w0 = 0; w0 < depth; w0 += tiles.depth) {
+                int len = w0 + tiles.depth < depth ? tiles.depth : depth - w0;
+
+                for (int i = i0; i < i1; i++) {
+                    for (int j = j0; j < j1; j++)
+                        c->data[i][j / SIZE] ^= shift_bit(bax(a->data[i] + w0, bt->data[j] + w0, len), j % SIZE);
+                }
+            }
         }
     }
 
@@ -207,6 +530,92 @@ struct mat *matrix_mul(struct mat *a, struct mat *b) {
     return c;
 }
 
+/* Method of Four Russians: for every slice of M4RM_K rows of b a table with all
+   their 2^M4RM_K linear combinations is built in Gray-code order (one row XOR per
+   entry), then each row of c picks its entry with the matching M4RM_K bits of a.
+   Only words [w0, w1) of the rows of c are produced: column slices are
+   independent, so they can be computed concurrently with narrower tables. */
+static void m4rm_slice(struct mat *a, struct mat *b, struct mat *c, int w0, int w1, uint64_t *table) {
+    int words = w1 - w0;
+
+    memset(table, 0, words * sizeof(uint64_t));
+
+    for (int r = 0; r < a->cols; r += M4RM_K) {
+        int k = a->cols - r < M4RM_K ? a->cols - r : M4RM_K;
+        uint64_t mask = (1ULL << k) - 1;
+
+        for (int g = 1; g < (1 << k); g++) {
+            uint64_t *prev = table + (size_t)((g - 1) ^ ((g - 1) >> 1)) * words;
+            uint64_t *curr = table + (size_t)(g ^ (g >> 1)) * words;
+            uint64_t *row = b->data[r + __builtin_ctz(g)] + w0;
+
+            for (int w = 0; w < words; w++)
+                curr[w] = prev[w] ^ row[w];
+        }
+
+        for (int i = 0; i < a->rows; i++) {
+            uint64_t idx = (a->data[i][r / SIZE] >> (r % SIZE)) & mask;
+            if (idx == 0)
+                continue;
+
+            uint64_t *src = table + idx * words;
+            uint64_t *dst = c->data[i] + w0;
+            for (int w = 0; w < words; w++)
+                dst[w] ^= src[w];
+        }
+    }
+
+    if (w1 == real_dim(b->cols) && b->cols % SIZE) {
+        uint64_t tail = (1ULL << (b->cols % SIZE)) - 1;
+        for (int i = 0; i < c->rows; i++)
+            c->data[i][w1 - 1] &= tail;
+    }
+}
+
+/* Method of Four Russians: for every slice of M4RM_K rows of b a table with all
+   their 2^M4RM_K linear combinations is built in Gray-code order (one row XOR per
+   entry), then each row of c picks its entry with the matching M4RM_K bits of a.
+   Only words [w0, w1) of the rows of c are produced: column slices are
+   independent, so they can be computed concurrently with narrower tables. */
+int matrix_mul_m4rm_cols(struct mat *a, struct mat *b, struct mat *c, int w0, int w1) {
+    uint64_t *table = malloc(((size_t)(w1 - w0) << M4RM_K) * sizeof(uint64_t));
+    if (table == NULL)
+        return -1;
+
+    m4rm_slice(a, b, c, w0, w1, table);
+
+    free(table);
+    return 0;
+}
+
+struct mat *matrix_mul_m4rm(struct mat *a, struct mat *b) {
+    if (a == NULL || b == NULL || a->cols != b->rows)
+        return NULL;
+
+    struct mat *c = new_mat(a->rows, b->cols);
+    if (c == NULL)
+        return NULL;
+
+    if (matrix_mul_m4rm_cols(a, b, c, 0, real_dim(b->cols)) != 0) {
+        free_mat(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+int matrix_mul_m4rm_into(struct mat *c, struct mat *a, struct mat *b, uint64_t *table) {
+    if (c == NULL || a == NULL || b == NULL || table == NULL || a->cols != b->rows || c->rows != a->rows
+        || c->cols != b->cols)
+        return -1;
+
+    for (int i = 0; i < c->rows; i++)
+        memset(c->data[i], 0, real_dim(c->cols) * sizeof(uint64_t));
+
+    m4rm_slice(a, b, c, 0, real_dim(b->cols), table);
+    return 0;
+}
+
 uint64_t *array_sum(uint64_t *a, uint64_t *b, int len) {
     if (a == NULL || b == NULL || len == 0)
         return NULL;
@@ -215,102 +624,286 @@ uint64_t *array_sum(uint64_t *a, uint64_t *b, int len) {
     if (res == NULL)
         return NULL;
 
+    array_sum_into(res, a, b, len);
+    return res;
+}
+
+int array_sum_into(uint64_t *res, uint64_t *a, uint64_t *b, int len) {
+    if (res == NULL || a == NULL || b == NULL || len <= 0)
+        return -1;
+
     for (int i = 0; i < len; i++)
         res[i] = a[i] ^ b[i];
 
-    return res;
+    return 0;
 }
 
 struct arr *array_xor(struct arr *a, struct arr *b) {
     if (a == NULL || b == NULL || a->len != b->len || a->data == NULL || b->data == NULL)
         return NULL;
 
-    struct arr *res = calloc(1, sizeof(struct arr));
-    if (res == NULL)
-        return NULL;
+    struct arr *res = new_arr(a->len);
+    if (res != NULL)
+        array_xor_into(res, a, b);
 
-    res->len = a->len;
-    res->data = calloc(real_dim(a->len), sizeof(uint64_t));
-    if (res->data == NULL)
-        return NULL;
+    return res;
+}
+
+int array_xor_into(struct arr *res, struct arr *a, struct arr *b) {
+    if (res == NULL || res->data == NULL || a == NULL || b == NULL || a->len != b->len || a->data == NULL
+        || b->data == NULL)
+        return -1;
 
+    res->len = a->len;
     for (int i = 0; i < real_dim(res->len); i++)
         res->data[i] = a->data[i] ^ b->data[i];
 
-    return res;
+    return 0;
 }
 
 struct mat *matrix_sum(struct mat *a, struct mat *b) {
     if (a == NULL || b == NULL || a->rows != b->rows || a->cols != b->cols)
         return NULL;
 
-    struct mat *res = calloc(1, sizeof(struct mat));
-    if (res == NULL)
-        return NULL;
+    struct mat *res = new_mat(a->rows, a->cols);
+    if (res != NULL)
+        matrix_sum_into(res, a, b);
 
-    res->rows = a->rows;
-    res->cols = a->cols;
+    return res;
+}
 
-    res->data = calloc(res->rows, sizeof(uint64_t *));
-    if (res->data == NULL) {
-        free(res);
-        return NULL;
+int matrix_sum_into(struct mat *res, struct mat *a, struct mat *b) {
+    if (res == NULL || a == NULL || b == NULL || a->rows != b->rows || a->cols != b->cols || res->rows != a->rows
+        || res->cols != a->cols)
+        return -1;
+
+    // Contiguous operands sharing the stride make the sum one streaming pass
+    if (res->buf != NULL && a->buf != NULL && b->buf != NULL && a->stride == res->stride
+        && b->stride == res->stride) {
+        size_t words = (size_t)res->rows * res->stride;
+        for (size_t k = 0; k < words; k++)
+            res->buf[k] = a->buf[k] ^ b->buf[k];
+        return 0;
     }
 
     for (int i = 0; i < res->rows; i++) {
-        res->data[i] = array_sum(a->data[i], b->data[i], real_dim(res->cols));
-        if (res->data[i] == NULL) {
-            free_mat(res);
-            return NULL;
-        }
+        for (int j = 0; j < real_dim(res->cols); j++)
+            res->data[i][j] = a->data[i][j] ^ b->data[i][j];
     }
 
-    return res;
+    return 0;
+}
+
+/* In-place dst += src over GF(2), one kernel pass when both are contiguous
+   with the same stride */
+struct mat *matrix_add(struct mat *dst, struct mat *src) {
+    if (dst == NULL || src == NULL || dst->rows != src->rows || dst->cols != src->cols)
+        return NULL;
+
+    if (dst->buf != NULL && src->buf != NULL && dst->stride == src->stride) {
+        kernels.xor_words(dst->buf, src->buf, (size_t)dst->rows * dst->stride);
+        return dst;
+    }
+
+    for (int i = 0; i < dst->rows; i++)
+        kernels.xor_words(dst->data[i], src->data[i], real_dim(dst->cols));
+
+    return dst;
 }
 
 struct arr *mat_arr_mul(struct mat *m, struct arr *a) {
     if (m == NULL || a == NULL || m->cols != a->len)
         return NULL;
 
-    struct arr *res = calloc(1, sizeof(struct arr));
-    if (res == NULL)
-        return NULL;
+    struct arr *res = new_arr(m->rows);
+    if (res != NULL)
+        mat_arr_mul_into(res, m, a);
+
+    return res;
+}
+
+int mat_arr_mul_into(struct arr *res, struct mat *m, struct arr *a) {
+    if (res == NULL || res->data == NULL || m == NULL || a == NULL || m->cols != a->len)
+        return -1;
 
     res->len = m->rows;
-    res->data = calloc(real_dim(res->len), sizeof(uint64_t));
-    if (res->data == NULL) {
-        free(res);
+    memset(res->data, 0, real_dim(res->len) * sizeof(uint64_t));
+    kernels.mat_vec(m->data, m->rows, a->data, real_dim(m->cols), res->data);
+
+    return 0;
+}
+
+/* Product of a matrix with a sparse vector, the matrix given column-major
+   (as its transpose): only the weight selected columns are read and XORed. */
+struct arr *sparse_mat_mul(struct mat *cols, struct sparse *v) {
+    if (cols == NULL || v == NULL || cols->rows != v->len)
+        return NULL;
+
+    struct arr *res = new_arr(cols->cols);
+    if (res != NULL)
+        sparse_mat_mul_into(res, cols, v);
+
+    return res;
+}
+
+int sparse_mat_mul_into(struct arr *res, struct mat *cols, struct sparse *v) {
+    if (res == NULL || res->data == NULL || cols == NULL || v == NULL || cols->rows != v->len)
+        return -1;
+
+    int words = real_dim(cols->cols);
+
+    res->len = cols->cols;
+    memset(res->data, 0, words * sizeof(uint64_t));
+
+    for (int i = 0; i < v->weight; i++)
+        kernels.xor_words(res->data, cols->data[v->pos[i]], words);
+
+    return 0;
+}
+
+/* Row b of the result is m times row b of v. m is walked once, BATCH_BLOCK
+   rows at a time, and each block is reused by the whole batch while it is
+   still in cache. */
+struct mat *mat_arr_mul_batch(struct mat *m, struct mat *v) {
+    if (m == NULL || v == NULL || m->cols != v->cols)
         return NULL;
+
+    struct mat *res = new_mat(v->rows, m->rows);
+    if (res != NULL)
+        mat_arr_mul_batch_into(res, m, v);
+
+    return res;
+}
+
+int mat_arr_mul_batch_into(struct mat *res, struct mat *m, struct mat *v) {
+    if (res == NULL || m == NULL || v == NULL || m->cols != v->cols || res->rows != v->rows || res->cols != m->rows)
+        return -1;
+
+    int len = real_dim(m->cols);
+
+    for (int b = 0; b < res->rows; b++)
+        memset(res->data[b], 0, real_dim(res->cols) * sizeof(uint64_t));
+
+    for (int i0 = 0; i0 < m->rows; i0 += BATCH_BLOCK) {
+        int n = m->rows - i0 < BATCH_BLOCK ? m->rows - i0 : BATCH_BLOCK;
+
+        for (int b = 0; b < v->rows; b++)
+            kernels.mat_vec(m->data + i0, n, v->data[b], len, res->data[b] + i0 / SIZE);
     }
 
-    for (int i = 0; i < m->rows; i++) {
-        res->data[i / SIZE] |= shift_bit(bax(m->data[i], a->data, real_dim(m->cols)), i % SIZE);
+    return 0;
+}
+
+/* Batched sparse_mat_mul: row b of the result XORs the rows of cols listed
+   in row b of e. The hits of the batch are sorted by row of cols first, so
+   cols is read once and in order, however many vectors pick the same row.
+   The sort is an LSD radix sort over the hits alone, a byte of the row per
+   pass: unlike bucketing over every row of cols, it costs a small batch no
+   more than its hits. */
+struct mat *sparse_mat_mul_batch(struct mat *cols, struct sparse_mat *e) {
+    if (cols == NULL || e == NULL || cols->rows != e->cols)
+        return NULL;
+
+    struct mat *res = new_mat(e->rows, cols->cols);
+    uint64_t *buf = malloc((SPARSE_SCRATCH(e->rows, e->weight) + 1) * sizeof(uint64_t));
+
+    if (res == NULL || buf == NULL || sparse_mat_mul_batch_into(res, cols, e, buf) != 0) {
+        free_mat(res);
+        res = NULL;
     }
 
+    free(buf);
     return res;
 }
 
-struct arr *concat_arrays(struct arr *a, struct arr *b) {
-    if (a == NULL || b == NULL)
+int sparse_mat_mul_batch_into(struct mat *res, struct mat *cols, struct sparse_mat *e, uint64_t *buf) {
+    if (res == NULL || cols == NULL || e == NULL || buf == NULL || cols->rows != e->cols || res->rows != e->rows
+        || res->cols != cols->cols)
+        return -1;
+
+    size_t hits = (size_t)e->rows * e->weight;
+    uint64_t *hit = buf, *tmp = buf + hits;
+    int words = real_dim(cols->cols);
+
+    for (int b = 0; b < res->rows; b++)
+        memset(res->data[b], 0, words * sizeof(uint64_t));
+
+    // Row of cols in the high half, row of the result in the low one
+    for (size_t k = 0; k < hits; k++)
+        hit[k] = (uint64_t)e->pos[k] << 32 | (uint64_t)(k / e->weight);
+
+    for (int shift = 0; shift < 32 && (uint32_t)(cols->rows - 1) >> shift != 0; shift += 8) {
+        size_t start[257] = { 0 };
+
+        for (size_t k = 0; k < hits; k++)
+            start[(hit[k] >> (32 + shift) & 0xFF) + 1]++;
+        for (int d = 0; d < 256; d++)
+            start[d + 1] += start[d];
+        for (size_t k = 0; k < hits; k++)
+            tmp[start[hit[k] >> (32 + shift) & 0xFF]++] = hit[k];
+
+        uint64_t *t = hit;
+        hit = tmp;
+        tmp = t;
+    }
+
+    for (size_t k = 0; k < hits; k++)
+        kernels.xor_words(res->data[(uint32_t)hit[k]], cols->data[hit[k] >> 32], words);
+
+    return 0;
+}
+
+struct mat *sparse_mat_to_mat(struct sparse_mat *e) {
+    if (e == NULL)
         return NULL;
 
-    struct arr *res = calloc(1, sizeof(struct arr));
-    if (res == NULL)
+    struct mat *m = new_mat(e->rows, e->cols);
+    if (m == NULL)
+        return NULL;
+
+    if (sparse_mat_add(m, e) == NULL) {
+        free_mat(m);
         return NULL;
+    }
 
-    int a_len = real_dim(a->len);
-    int b_len = real_dim(b->len);
+    return m;
+}
 
-    res->len = a->len + b->len;
-    res->data = calloc(a_len + b_len, sizeof(uint64_t));
-    if (res->data == NULL)
+struct arr *concat_arrays(struct arr *a, struct arr *b) {
+    if (a == NULL || b == NULL)
         return NULL;
 
-    for (int i = 0; i < a_len; i++)
+    struct arr *res = new_arr(a->len + b->len);
+    if (res != NULL)
+        concat_arrays_into(res, a, b);
+
+    return res;
+}
+
+/* b starts at bit a->len, so unless a fills its last word each word of b
+   is split over two words of the result. Bits past either length are
+   dropped, leaving the padding clear. */
+int concat_arrays_into(struct arr *res, struct arr *a, struct arr *b) {
+    if (res == NULL || res->data == NULL || a == NULL || b == NULL)
+        return -1;
+
+    int len = a->len + b->len;
+    int whole = a->len / (int)SIZE, shift = a->len % (int)SIZE;
+    int b_words = real_dim(b->len);
+    uint64_t carry = shift != 0 ? a->data[whole] & ((1ULL << shift) - 1) : 0;
+
+    for (int i = 0; i < whole; i++)
         res->data[i] = a->data[i];
 
-    for (int i = 0; i < b_len; i++)
-        res->data[a_len + i] = b->data[i];
+    for (int i = 0; whole + i < real_dim(len); i++) {
+        uint64_t w = i < b_words ? b->data[i] : 0;
+        if (i == b_words - 1 && b->len % SIZE != 0)
+            w &= (1ULL << (b->len % SIZE)) - 1;
 
-    return res;
+        res->data[whole + i] = carry | w << shift;
+        carry = shift != 0 ? w >> (SIZE - shift) : 0;
+    }
+
+    res->len = len;
+    return 0;
 }
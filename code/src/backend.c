@@ -2,6 +2,16 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/packet.h"
+
+// rows and cols precede the packed rows in a key file
+#define KEY_HEADER (2 * sizeof(int))
 
 void write_key( const char *path, struct mat *m) {
     FILE *file = fopen(path, "wb");
@@ -18,13 +28,13 @@ void write_key( const char *path, struct mat *m) {
     fclose(file);
 }
 
-uint64_t *convert_to_array(const char *filepath) {
+uint64_t *convert_to_array(const char *filepath, int len) {
     FILE *file = fopen(filepath, "r");
     if (!file)
         return NULL;
 
 
-    uint64_t *array = calloc(real_dim(L), sizeof(uint64_t));
+    uint64_t *array = calloc(real_dim(len), sizeof(uint64_t));
     if (array == NULL) {
         fclose(file);
         return NULL;
@@ -32,7 +42,7 @@ uint64_t *convert_to_array(const char *filepath) {
 
     char c;
     size_t index = 0;
-    for(int i = 0; i < L && fread(&c, 1, 1, file) == 1; i++){
+    for(int i = 0; i < len && fread(&c, 1, 1, file) == 1; i++){
         if(c == '1')
             array[i / SIZE] |= ((uint64_t)1 << (i % SIZE));
     }
@@ -46,63 +56,181 @@ struct mat *read_key(const char *path) {
     if (file == NULL)
         return NULL;
 
-    struct mat *matrix = calloc(1ULL, sizeof(struct mat));
-    if (matrix == NULL)
+    int rows, cols;
+    if (fread(&rows, sizeof(int), 1, file) != 1 || fread(&cols, sizeof(int), 1, file) != 1) {
+        fclose(file);
         return NULL;
+    }
 
-    fread(&(matrix->rows), sizeof(int), 1, file);
-    fread(&(matrix->cols), sizeof(int), 1, file);
-
-    matrix->data = calloc(matrix->rows, sizeof(uint64_t *));
-    if (matrix->data == NULL)
+    struct mat *matrix = new_mat(rows, cols);
+    if (matrix == NULL) {
+        fclose(file);
         return NULL;
+    }
 
+    // Rows are packed on disk and padded to the stride in memory
     for (int i = 0; i < matrix->rows; i++) {
-        matrix->data[i] = calloc(real_dim(matrix->cols), sizeof(uint64_t));
-        if (matrix->data[i] == NULL)
+        if (fread(matrix->data[i], sizeof(uint64_t), real_dim(matrix->cols), file) != (size_t)real_dim(matrix->cols)) {
+            free_mat(matrix);
+            fclose(file);
             return NULL;
-
-        fread(matrix->data[i], sizeof(uint64_t), real_dim(matrix->cols), file);
+        }
     }
 
     fclose(file);
     return matrix;
 }
 
-void write_packet(const char *output_path, struct arr *message) {
-    FILE *file = fopen(output_path, "wb");
-    if(file == NULL)
+/* Matrix over the rows of a mapped key file, stride is the packed row size */
+static struct mat *key_view(void *map, size_t map_len, int rows, int cols) {
+    struct mat *m = mat_view((uint64_t *)((char *)map + KEY_HEADER), rows, cols, real_dim(cols));
+    if (m == NULL)
+        return NULL;
+
+    m->map = map;
+    m->map_len = map_len;
+    return m;
+}
+
+/* Read-only, zero-copy view of a key file: the rows are the page cache pages,
+   shared by every process mapping the same file. free_mat unmaps it. */
+struct mat *map_key(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < KEY_HEADER) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    int rows = ((int *)map)[0];
+    int cols = ((int *)map)[1];
+
+    if (rows <= 0 || cols <= 0 || KEY_HEADER + (size_t)rows * real_dim(cols) * sizeof(uint64_t) > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    struct mat *m = key_view(map, st.st_size, rows, cols);
+    if (m == NULL)
+        munmap(map, st.st_size);
+
+    return m;
+}
+
+/* Creates a key file of the right size for a rows x cols matrix and returns a
+   writable view over it: whatever is stored in its rows lands in the file. */
+struct mat *create_key_map(const char *path, int rows, int cols) {
+    if (rows <= 0 || cols <= 0)
+        return NULL;
+
+    size_t len = KEY_HEADER + (size_t)rows * real_dim(cols) * sizeof(uint64_t);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, len) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    ((int *)map)[0] = rows;
+    ((int *)map)[1] = cols;
+
+    struct mat *m = key_view(map, len, rows, cols);
+    if (m == NULL)
+        munmap(map, len);
+
+    return m;
+}
+
+void write_key_mapped(const char *path, struct mat *m) {
+    if (m == NULL)
+        return;
+
+    struct mat *dst = create_key_map(path, m->rows, m->cols);
+    if (dst == NULL)
         return;
 
+    for (int i = 0; i < m->rows; i++)
+        memcpy(dst->data[i], m->data[i], real_dim(m->cols) * sizeof(uint64_t));
+
+    free_mat(dst);
+}
+
+/* Header and words leave in a single writev */
+void write_packet(const char *output_path, struct arr *message) {
     if(message == NULL || message->data == NULL)
         return;
 
-    fwrite(&(message->len), sizeof(int), 1, file);
+    int fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0)
+        return;
 
-    for(int i = 0; i < real_dim(message->len); i++)
-        fwrite(&(message->data[i]), sizeof(uint64_t), 1, file);
+    packets_writev(fd, message, 1);
+    close(fd);
+}
 
-    fclose(file);
+/* path with "_<i>" before its extension, for the outputs of batch i */
+int indexed_path(char *buf, size_t size, const char *path, int i) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    int stem = (dot != NULL && (slash == NULL || dot > slash)) ? (int)(dot - path) : (int)strlen(path);
+
+    int n = snprintf(buf, size, "%.*s_%d%s", stem, path, i, path + stem);
+    return n < 0 || (size_t)n >= size ? -1 : 0;
 }
 
+/* The file size gives the words before the header is read, so header and
+   words come in with a single readv straight into the packet */
 struct arr *read_packet(const char *path){
-    FILE *file = fopen(path, "rb");
-    if(file == NULL)
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
         return NULL;
 
+    struct stat st;
     struct arr *packet = calloc(1ULL, sizeof(struct arr));
-    if(packet == NULL)
-        return NULL;
+    uint8_t len[PACKET_HEADER];
+    size_t words = 0;
 
-    fread(&(packet->len), sizeof(int), 1, file);
-    packet->data = calloc(real_dim(packet->len), sizeof(uint64_t));
-    if(packet->data == NULL)
-        return NULL;
+    if(packet != NULL && fstat(fd, &st) == 0 && st.st_size >= (off_t)PACKET_HEADER) {
+        words = (st.st_size - PACKET_HEADER) / sizeof(uint64_t);
+        packet->data = calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    }
 
-    for(int i = 0; i < real_dim(packet->len); i++)
-        fread(&(packet->data[i]), sizeof(uint64_t), 1, file);
+    if(packet != NULL && packet->data != NULL) {
+        struct iovec iov[2] = { { len, PACKET_HEADER }, { packet->data, words * sizeof(uint64_t) } };
 
-    fclose(file);
+        packet->len = read_iov(fd, iov, 2) == 0 ? packet_peek(len, PACKET_HEADER) : -1;
+        if(packet->len < 0 || (size_t)real_dim(packet->len) > words) {
+            free(packet->data);
+            packet->data = NULL;
+        } else {
+            swap_le(packet->data, words);
+        }
+    }
+
+    close(fd);
+
+    if(packet != NULL && packet->data == NULL) {
+        free(packet);
+        return NULL;
+    }
     return packet;
 }
 
@@ -114,14 +242,26 @@ struct arr *correct_errors(struct arr *a, struct arr *b, struct arr *c){
     if(res == NULL)
         return NULL;
 
-    res->len = a->len;
-    res->data = calloc(a->len, SIZE);
-    if(res->data == NULL)
+    res->data = calloc(real_dim(a->len), sizeof(uint64_t));
+    if(res->data == NULL){
+        free(res);
         return NULL;
-
-    for(int i = 0; i < a->len; i++){
-        res->data[i] = (a->data[i] & b->data[i]) | (b->data[i] & c->data[i]) | (c->data[i] ^ a->data[i]);
     }
 
+    correct_errors_into(res, a, b, c);
     return res;
 }
+
+int correct_errors_into(struct arr *res, struct arr *a, struct arr *b, struct arr *c){
+    if(res == NULL || res->data == NULL || a->len != b->len || b->len != c->len)
+        return -1;
+
+    // Bitwise majority of the three copies, read in full before res is written
+    for(int i = 0; i < real_dim(a->len); i++){
+        uint64_t x = a->data[i], y = b->data[i], z = c->data[i];
+        res->data[i] = (x & y) | (y & z) | (z & x);
+    }
+
+    res->len = a->len;
+    return 0;
+}
@@ -0,0 +1,539 @@
+#include "../include/bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../include/backend.h"
+#include "../include/kernels.h"
+#include "../include/key.h"
+#include "../include/keyfile.h"
+
+// Rows of the largest batch stage
+#define BATCH_MAX 256
+
+/* Operands shared by the stages. Encryption goes through column-major
+   copies of A and Y, as generate writes them, except for the dense stages
+   which take A and Y as they are. */
+struct bench_ctx {
+    struct mat *a;
+    struct mat *s;
+    struct mat *y;
+    struct key ka;
+    struct key ky;
+    struct key ks;
+    struct arr e;
+    struct mat *msg;
+    struct mat *nnc;
+    struct mat *word;
+
+    // Buffers of the allocation-free single-message stages
+    struct arena scratch;
+    struct arr m1;
+    struct arr n1;
+    struct arr w1;
+    struct arr d1;
+
+    // Buffers of the batch stages, BATCH_MAX rows each
+    struct key da;
+    struct key dy;
+    struct arena batch;
+    struct mat *bmsg;
+    struct mat *bnnc;
+    struct mat *bword;
+    struct mat *bout;
+};
+
+/* Runs a stage once and returns the seconds spent in the operation alone,
+   or a negative value if it failed. */
+typedef double (*stage_fn)(struct bench_ctx *c);
+
+struct stage {
+    const char *name;
+    stage_fn run;
+    size_t bytes;
+};
+
+struct result {
+    const char *name;
+    double min;
+    double median;
+    double p99;
+    size_t bytes;
+};
+
+#if defined(__clang__)
+#define COMPILER "clang " __clang_version__
+#elif defined(__GNUC__)
+#define COMPILER "gcc " __VERSION__
+#else
+#define COMPILER "unknown"
+#endif
+
+// Set by the build to the commit it was made from
+#ifndef BUILD_ID
+#define BUILD_ID "unknown"
+#endif
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static size_t mat_bytes(int rows, int cols) {
+    return (size_t)rows * row_stride(cols) * sizeof(uint64_t);
+}
+
+// Times an operation returning a matrix, then frees it
+#define TIME_MAT(expr)                 \
+    do {                               \
+        double t0 = now();             \
+        struct mat *res_ = (expr);     \
+        double t = now() - t0;         \
+        (void)c;                       \
+        if (res_ == NULL)              \
+            return -1;                 \
+        free_mat(res_);                \
+        return t;                      \
+    } while (0)
+
+static double run_rand_mat(struct bench_ctx *c) {
+    TIME_MAT(rand_mat(K, N, NULL));
+}
+
+static double run_weight_matrix(struct bench_ctx *c) {
+    TIME_MAT(weight_matrix(L, N, T, NULL));
+}
+
+static double run_transpose(struct bench_ctx *c) {
+    TIME_MAT(matrix_transpose(c->y));
+}
+
+static double run_matrix_mul(struct bench_ctx *c) {
+    TIME_MAT(matrix_mul(c->s, c->a));
+}
+
+static double run_matrix_mul_m4rm(struct bench_ctx *c) {
+    TIME_MAT(matrix_mul_m4rm(c->s, c->a));
+}
+
+static double run_matrix_sum(struct bench_ctx *c) {
+    TIME_MAT(matrix_sum(c->y, c->y));
+}
+
+// write_key reports nothing, so the file it leaves is checked instead
+static int key_written(struct mat *m) {
+    struct stat st;
+    off_t size = 2 * sizeof(int) + (off_t)m->rows * real_dim(m->cols) * sizeof(uint64_t);
+
+    return stat(BENCH_KEY, &st) == 0 && st.st_size == size;
+}
+
+static double run_write_key(struct bench_ctx *c) {
+    unlink(BENCH_KEY);
+
+    double t0 = now();
+    write_key(BENCH_KEY, c->y);
+    double t = now() - t0;
+
+    return key_written(c->y) ? t : -1;
+}
+
+static double run_read_key(struct bench_ctx *c) {
+    TIME_MAT(read_key(BENCH_KEY));
+}
+
+static double run_arr_mul(struct mat *m, struct arr *e) {
+    double t0 = now();
+    struct arr *res = mat_arr_mul(m, e);
+    double t = now() - t0;
+
+    if (res == NULL)
+        return -1;
+
+    free_arr(res);
+    return t;
+}
+
+static double run_arr_mul_a(struct bench_ctx *c) {
+    return run_arr_mul(c->a, &c->e);
+}
+
+static double run_arr_mul_y(struct bench_ctx *c) {
+    return run_arr_mul(c->y, &c->e);
+}
+
+static double run_encrypt(struct bench_ctx *c) {
+    struct mat *nnc, *word;
+
+    double t0 = now();
+    int ret = key_encrypt(&c->ka, &c->ky, c->msg, NULL, &nnc, &word);
+    double t = now() - t0;
+
+    if (ret != 0)
+        return -1;
+
+    free_mat(nnc);
+    free_mat(word);
+    return t;
+}
+
+static double run_decrypt(struct bench_ctx *c) {
+    struct mat *msg;
+
+    double t0 = now();
+    int ret = key_decrypt(&c->ks, c->nnc, c->word, &msg);
+    double t = now() - t0;
+
+    if (ret != 0)
+        return -1;
+
+    free_mat(msg);
+    return t;
+}
+
+static double run_encrypt_into(struct bench_ctx *c) {
+    double t0 = now();
+    int ret = key_encrypt_into(&c->ka, &c->ky, &c->m1, NULL, &c->scratch, &c->n1, &c->w1);
+    double t = now() - t0;
+
+    return ret == 0 ? t : -1;
+}
+
+static double run_decrypt_into(struct bench_ctx *c) {
+    double t0 = now();
+    int ret = key_decrypt_into(&c->ks, &c->n1, &c->w1, &c->scratch, &c->d1);
+    double t = now() - t0;
+
+    return ret == 0 ? t : -1;
+}
+
+/* Time per message of one batch of rows through the batch forms, so that
+   the stages line up with encrypt_into and decrypt_into */
+static double run_encrypt_batch(struct bench_ctx *c, int rows) {
+    struct mat msg = mat_slice(c->bmsg, 0, rows, L);
+    struct mat nnc = mat_slice(c->bnnc, 0, rows, K), word = mat_slice(c->bword, 0, rows, L);
+
+    double t0 = now();
+    int ret = key_encrypt_batch_into(&c->ka, &c->ky, &msg, NULL, &c->batch, &nnc, &word);
+    double t = now() - t0;
+
+    return ret == 0 ? t / rows : -1;
+}
+
+static double run_decrypt_batch(struct bench_ctx *c, int rows) {
+    struct mat nnc = mat_slice(c->bnnc, 0, rows, K), word = mat_slice(c->bword, 0, rows, L);
+    struct mat msg = mat_slice(c->bout, 0, rows, L);
+
+    double t0 = now();
+    int ret = key_decrypt_batch_into(&c->ks, &nnc, &word, &c->batch, &msg);
+    double t = now() - t0;
+
+    return ret == 0 ? t / rows : -1;
+}
+
+// Dense keys through key_encrypt, which transposes them for large batches
+static double run_encrypt_dense(struct bench_ctx *c, int rows) {
+    struct mat msg = mat_slice(c->bmsg, 0, rows, L);
+    struct mat *nnc, *word;
+
+    double t0 = now();
+    int ret = key_encrypt(&c->da, &c->dy, &msg, NULL, &nnc, &word);
+    double t = now() - t0;
+
+    if (ret != 0)
+        return -1;
+
+    free_mat(nnc);
+    free_mat(word);
+    return t / rows;
+}
+
+static double run_encrypt_batch_1(struct bench_ctx *c) {
+    return run_encrypt_batch(c, 1);
+}
+
+static double run_encrypt_batch_16(struct bench_ctx *c) {
+    return run_encrypt_batch(c, 16);
+}
+
+static double run_encrypt_batch_256(struct bench_ctx *c) {
+    return run_encrypt_batch(c, BATCH_MAX);
+}
+
+static double run_decrypt_batch_1(struct bench_ctx *c) {
+    return run_decrypt_batch(c, 1);
+}
+
+static double run_decrypt_batch_16(struct bench_ctx *c) {
+    return run_decrypt_batch(c, 16);
+}
+
+static double run_decrypt_batch_256(struct bench_ctx *c) {
+    return run_decrypt_batch(c, BATCH_MAX);
+}
+
+static double run_encrypt_dense_1(struct bench_ctx *c) {
+    return run_encrypt_dense(c, 1);
+}
+
+static double run_encrypt_dense_16(struct bench_ctx *c) {
+    return run_encrypt_dense(c, 16);
+}
+
+static double run_encrypt_dense_256(struct bench_ctx *c) {
+    return run_encrypt_dense(c, BATCH_MAX);
+}
+
+/* Bytes are those read and written by one run: the operands and the
+   result, or for encryption the T key columns picked by the noise. The
+   batch stages count them per message, the keys shared by the batch. */
+static struct stage stages_all[] = {
+    { "rand_mat", run_rand_mat, 0 },
+    { "weight_matrix", run_weight_matrix, 0 },
+    { "matrix_transpose", run_transpose, 0 },
+    { "matrix_mul", run_matrix_mul, 0 },
+    { "matrix_mul_m4rm", run_matrix_mul_m4rm, 0 },
+    { "matrix_sum", run_matrix_sum, 0 },
+    { "write_key", run_write_key, 0 },
+    { "read_key", run_read_key, 0 },
+    { "mat_arr_mul_a", run_arr_mul_a, 0 },
+    { "mat_arr_mul_y", run_arr_mul_y, 0 },
+    { "encrypt", run_encrypt, 0 },
+    { "decrypt", run_decrypt, 0 },
+    { "encrypt_into", run_encrypt_into, 0 },
+    { "decrypt_into", run_decrypt_into, 0 },
+    { "encrypt_batch_1", run_encrypt_batch_1, 0 },
+    { "encrypt_batch_16", run_encrypt_batch_16, 0 },
+    { "encrypt_batch_256", run_encrypt_batch_256, 0 },
+    { "decrypt_batch_1", run_decrypt_batch_1, 0 },
+    { "decrypt_batch_16", run_decrypt_batch_16, 0 },
+    { "decrypt_batch_256", run_decrypt_batch_256, 0 },
+    { "encrypt_dense_1", run_encrypt_dense_1, 0 },
+    { "encrypt_dense_16", run_encrypt_dense_16, 0 },
+    { "encrypt_dense_256", run_encrypt_dense_256, 0 },
+};
+
+#define STAGES ((int)(sizeof(stages_all) / sizeof(stages_all[0])))
+
+static void set_bytes(void) {
+    size_t a = mat_bytes(K, N), s = mat_bytes(L, K), y = mat_bytes(L, N);
+    size_t cols = (size_t)T * (row_stride(K) + row_stride(L)) * sizeof(uint64_t);
+    size_t msg = real_dim(L) * sizeof(uint64_t), nnc = real_dim(K) * sizeof(uint64_t);
+    size_t enc = cols + 2 * msg + nnc, dec = 2 * msg + nnc;
+    size_t bytes[STAGES] = { a, y, 2 * y, s + a + y, s + a + y, 3 * y, y, y, a, y,
+                             enc, s + dec, enc, s + dec,
+                             enc, enc, enc, s + dec, s / 16 + dec, s / BATCH_MAX + dec,
+                             a + y + dec, (a + y) / 16 + dec, (a + y) / BATCH_MAX + dec };
+
+    for (int i = 0; i < STAGES; i++)
+        stages_all[i].bytes = bytes[i];
+}
+
+void bench_list(void) {
+    for (int i = 0; i < STAGES; i++)
+        fprintf(stdout, "%s\n", stages_all[i].name);
+}
+
+static void free_ctx(struct bench_ctx *c) {
+    free_mat(c->a);
+    free_mat(c->s);
+    free_mat(c->y);
+    free_mat(c->ka.m);
+    free_mat(c->ky.m);
+    free(c->e.data);
+    free_mat(c->msg);
+    free_mat(c->nnc);
+    free_mat(c->word);
+    arena_free(&c->scratch);
+    free(c->n1.data);
+    free(c->w1.data);
+    free(c->d1.data);
+    arena_free(&c->batch);
+    free_mat(c->bmsg);
+    free_mat(c->bnnc);
+    free_mat(c->bword);
+    free_mat(c->bout);
+}
+
+static int init_ctx(struct bench_ctx *c) {
+    memset(c, 0, sizeof(*c));
+
+    c->a = rand_mat(K, N, NULL);
+    c->s = rand_mat(L, K, NULL);
+    c->y = rand_mat(L, N, NULL);
+    c->msg = rand_mat(1, L, NULL);
+    c->e = (struct arr){ N, weight_array(N, T, NULL) };
+    c->ka = (struct key){ matrix_transpose(c->a), NULL, KEY_COL_MAJOR, active_params };
+    c->ky = (struct key){ matrix_transpose(c->y), NULL, KEY_COL_MAJOR, active_params };
+    c->ks = (struct key){ c->s, NULL, KEY_ROW_MAJOR, active_params };
+    c->m1 = (struct arr){ L, c->msg != NULL ? c->msg->data[0] : NULL };
+    c->n1 = (struct arr){ K, calloc(real_dim(K), sizeof(uint64_t)) };
+    c->w1 = (struct arr){ L, calloc(real_dim(L), sizeof(uint64_t)) };
+    c->d1 = (struct arr){ L, calloc(real_dim(L), sizeof(uint64_t)) };
+    c->da = (struct key){ c->a, NULL, KEY_ROW_MAJOR, active_params };
+    c->dy = (struct key){ c->y, NULL, KEY_ROW_MAJOR, active_params };
+    c->bmsg = rand_mat(BATCH_MAX, L, NULL);
+    c->bnnc = new_mat(BATCH_MAX, K);
+    c->bword = new_mat(BATCH_MAX, L);
+    c->bout = new_mat(BATCH_MAX, L);
+
+    if (c->a == NULL || c->s == NULL || c->y == NULL || c->msg == NULL || c->e.data == NULL || c->ka.m == NULL
+        || c->ky.m == NULL || c->n1.data == NULL || c->w1.data == NULL || c->d1.data == NULL || c->bmsg == NULL
+        || c->bnnc == NULL || c->bword == NULL || c->bout == NULL
+        || arena_init(&c->scratch, key_scratch_size(active_params)) != 0
+        || arena_init(&c->batch, key_batch_scratch_size(active_params, BATCH_MAX)) != 0
+        || key_encrypt(&c->ka, &c->ky, c->msg, NULL, &c->nnc, &c->word) != 0
+        || run_encrypt_batch(c, BATCH_MAX) < 0) {
+        free_ctx(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int run_stage(struct bench_ctx *c, struct stage *st, int reps, int warmup, double *times, struct result *r) {
+    for (int i = 0; i < warmup + reps; i++) {
+        double t = st->run(c);
+        if (t < 0)
+            return -1;
+        if (i >= warmup)
+            times[i - warmup] = t;
+    }
+
+    // Nearest-rank percentiles
+    qsort(times, reps, sizeof(double), cmp_double);
+    r->name = st->name;
+    r->min = times[0];
+    r->median = times[(reps - 1) / 2];
+    r->p99 = times[(99 * reps + 99) / 100 - 1];
+    r->bytes = st->bytes;
+    return 0;
+}
+
+static void print_table(FILE *out, struct result *res, int n) {
+    fprintf(out, "%-18s %10s %10s %10s %12s %8s %10s\n", "stage", "min ms", "median ms", "p99 ms", "bytes", "GB/s",
+            "ops/s");
+
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%-18s %10.3f %10.3f %10.3f %12zu %8.2f %10.1f\n", res[i].name, res[i].min * 1e3,
+                res[i].median * 1e3, res[i].p99 * 1e3, res[i].bytes, res[i].bytes / res[i].median / 1e9,
+                1 / res[i].median);
+    }
+}
+
+static int write_json(const char *path, struct result *res, int n, int reps, int warmup) {
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (f == NULL)
+        return -1;
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+
+    fprintf(f, "{\n  \"host\": \"%s\",\n  \"compiler\": \"%s\",\n  \"build\": \"%s\",\n", host, COMPILER, BUILD_ID);
+    fprintf(f, "  \"kernels\": \"%s\",\n  \"cpus\": %ld,\n", kernels.name, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "  \"params\": { \"name\": \"%s\", \"L\": %d, \"K\": %d, \"N\": %d, \"T\": %d },\n",
+            active_params->name, L, K, N, T);
+    fprintf(f, "  \"reps\": %d,\n  \"warmup\": %d,\n  \"stages\": [\n", reps, warmup);
+
+    for (int i = 0; i < n; i++) {
+        fprintf(f,
+                "    { \"name\": \"%s\", \"min_ms\": %.6f, \"median_ms\": %.6f, \"p99_ms\": %.6f, \"bytes\": %zu, "
+                "\"gb_per_s\": %.4f, \"ops_per_s\": %.3f }%s\n",
+                res[i].name, res[i].min * 1e3, res[i].median * 1e3, res[i].p99 * 1e3, res[i].bytes,
+                res[i].bytes / res[i].median / 1e9, 1 / res[i].median, i + 1 < n ? "," : "");
+    }
+
+    fprintf(f, "  ]\n}\n");
+
+    int ret = ferror(f) ? -1 : 0;
+    if (f != stdout && fclose(f) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int selected(const char *name, const char *const *stages, int count) {
+    if (stages == NULL)
+        return 1;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(stages[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int bench(int reps, int warmup, const char *const *stages, int count, const char *json_path) {
+    if (reps <= 0 || warmup < 0)
+        return -1;
+
+    for (int i = 0; stages != NULL && i < count; i++) {
+        int known = 0;
+        for (int j = 0; j < STAGES; j++)
+            known |= strcmp(stages[i], stages_all[j].name) == 0;
+
+        if (!known) {
+            fprintf(stderr, "Unknown stage %s\n", stages[i]);
+            return -1;
+        }
+    }
+
+    struct bench_ctx c;
+    struct result res[STAGES];
+    double *times = malloc(reps * sizeof(double));
+    int n = 0, ret = 0;
+
+    if (times == NULL || init_ctx(&c) != 0) {
+        free(times);
+        return -1;
+    }
+
+    // With the JSON on stdout, the table moves to stderr
+    FILE *out = json_path != NULL && strcmp(json_path, "-") == 0 ? stderr : stdout;
+
+    set_bytes();
+    fprintf(out, "Benchmarking with %s kernels, %d runs after %d warmup...\n\n", kernels.name, reps, warmup);
+
+    // read_key reads what is written here, whether write_key runs or not
+    if (selected("read_key", stages, count)) {
+        unlink(BENCH_KEY);
+        write_key(BENCH_KEY, c.y);
+        if (!key_written(c.y)) {
+            fprintf(stderr, "Failed to write %s\n", BENCH_KEY);
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < STAGES && ret == 0; i++) {
+        if (!selected(stages_all[i].name, stages, count))
+            continue;
+
+        if (run_stage(&c, &stages_all[i], reps, warmup, times, &res[n]) != 0) {
+            fprintf(stderr, "Failed to run stage %s\n", stages_all[i].name);
+            ret = -1;
+        } else {
+            n++;
+        }
+    }
+
+    unlink(BENCH_KEY);
+
+    if (ret == 0) {
+        print_table(out, res, n);
+        if (json_path != NULL)
+            ret = write_json(json_path, res, n, reps, warmup);
+    }
+
+    free_ctx(&c);
+    free(times);
+    return ret;
+}
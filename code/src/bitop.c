@@ -11,10 +11,5 @@ uint64_t shift_bit(uint64_t n, int pos){
 }
 
 uint64_t count_ones(uint64_t n){
-    uint64_t count = 0;
-
-    for(int i = 0; i < sizeof(uint64_t); i++)
-        count += fetch_bit(n, i);
-
-    return count;
+    return __builtin_popcountll(n);
 }
@@ -0,0 +1,99 @@
+#include "../include/cpu.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+#ifndef bit_AVX512VPOPCNTDQ
+#define bit_AVX512VPOPCNTDQ (1 << 14)
+#endif
+
+// XCR0 bits for SSE, AVX, opmask, ZMM0-15 and ZMM16-31 register state
+#define XCR0_AVX 0x06
+#define XCR0_AVX512 0xe6
+
+static uint64_t xgetbv(void) {
+    uint32_t lo, hi;
+
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static enum cpu_level detect(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return CPU_SCALAR;
+
+    // OSXSAVE and AVX, otherwise the OS does not preserve the wide registers
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return CPU_SCALAR;
+
+    uint64_t xcr0 = xgetbv();
+    if ((xcr0 & XCR0_AVX) != XCR0_AVX)
+        return CPU_SCALAR;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return CPU_SCALAR;
+
+    if (!(ebx & bit_AVX2))
+        return CPU_SCALAR;
+
+    if (!(ebx & bit_AVX512F) || (xcr0 & XCR0_AVX512) != XCR0_AVX512)
+        return CPU_AVX2;
+
+    if (!(ecx & bit_AVX512VPOPCNTDQ))
+        return CPU_AVX512;
+
+    return CPU_AVX512_VPOPCNT;
+}
+
+static int detect_crc32c(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+}
+#else
+static enum cpu_level detect(void) {
+    return CPU_SCALAR;
+}
+
+static int detect_crc32c(void) {
+    return 0;
+}
+#endif
+
+enum cpu_level cpu_level(void) {
+    static int detected = 0;
+    static enum cpu_level level;
+
+    if (!detected) {
+        level = detect();
+        detected = 1;
+    }
+
+    return level;
+}
+
+int cpu_has_crc32c(void) {
+    static int detected = -1;
+
+    if (detected < 0)
+        detected = detect_crc32c();
+
+    return detected;
+}
+
+const char *cpu_level_name(enum cpu_level level) {
+    switch (level) {
+        case CPU_AVX2:
+            return "avx2";
+        case CPU_AVX512:
+            return "avx512";
+        case CPU_AVX512_VPOPCNT:
+            return "avx512-vpopcnt";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,783 @@
+#include "../include/difftest.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/arrays.h"
+#include "../include/bitop.h"
+#include "../include/kernels.h"
+#include "../include/parallel.h"
+#include "../include/pool.h"
+#include "../include/xoshiro.h"
+
+// Largest side of a random shape, of a product and of a vector
+#define DIFF_SIDE 160
+#define DIFF_LEN 1000
+
+// Each timing repeats a call for at least DIFF_ROUND_NS, the best of DIFF_TIMES
+#define DIFF_ROUND_NS 10e6
+#define DIFF_TIMES 5
+
+// Entries kept from the baseline file
+#define DIFF_ENTRIES 128
+
+struct diff {
+    struct rng rng;
+    const char *variant;
+    uint64_t seed;
+    int round;
+    long checks;
+    long failures;
+    struct pool *pool;
+};
+
+// Widths around the word and block boundaries, drawn half of the time
+static const int edges[] = { 1, 2, 63, 64, 65, 127, 128, 129, 191, 192, 193 };
+
+static void seed_rng(struct rng *r, uint64_t seed) {
+    for (int k = 0; k < 4; k++)
+        r->s[k] = splitmix64(&seed);
+}
+
+static int draw(struct diff *d, int n) {
+    return (int)(rng_next(&d->rng) % (uint64_t)n);
+}
+
+static int dim(struct diff *d, int max) {
+    if (draw(d, 2)) {
+        int e = edges[draw(d, sizeof(edges) / sizeof(edges[0]))];
+        if (e <= max)
+            return e;
+    }
+    return 1 + draw(d, max);
+}
+
+static int get_bit(const uint64_t *row, int i) {
+    return (int)(row[i / SIZE] >> (i % SIZE) & 1);
+}
+
+static void put_bit(uint64_t *row, int i, int b) {
+    row[i / SIZE] = (row[i / SIZE] & ~(1ULL << (i % SIZE))) | ((uint64_t)b << (i % SIZE));
+}
+
+static int same_bits(const uint64_t *x, const uint64_t *y, int n) {
+    for (int i = 0; i < n; i++) {
+        if (get_bit(x, i) != get_bit(y, i))
+            return 0;
+    }
+    return 1;
+}
+
+static int same_mat(struct mat *x, struct mat *y) {
+    if (x == NULL || y == NULL || x->rows != y->rows || x->cols != y->cols)
+        return 0;
+
+    for (int i = 0; i < x->rows; i++) {
+        if (!same_bits(x->data[i], y->data[i], x->cols))
+            return 0;
+    }
+    return 1;
+}
+
+/* Counts a check and prints the failed ones with what replays them */
+static void check(struct diff *d, int ok, const char *op, const char *fmt, ...) {
+    d->checks++;
+    if (ok)
+        return;
+
+    char shape[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(shape, sizeof(shape), fmt, ap);
+    va_end(ap);
+
+    d->failures++;
+    fprintf(stdout, "FAIL %-22s %-15s shape %-16s seed %" PRIu64 " round %d\n", op, d->variant, shape, d->seed,
+            d->round);
+}
+
+/* Random rows drawn straight from the generator, so the inputs do not
+   depend on the kernels under test. dirty leaves random bits past cols, as
+   keys may have; vectors are kept clean, as the operations producing them
+   leave them. */
+static struct mat *random_mat(struct diff *d, int rows, int cols, int dirty) {
+    struct mat *m = new_mat(rows, cols);
+    if (m == NULL)
+        return NULL;
+
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < real_dim(cols); j++)
+            m->data[i][j] = rng_next(&d->rng);
+        if (!dirty && cols % SIZE)
+            m->data[i][cols / SIZE] &= (1ULL << (cols % SIZE)) - 1;
+    }
+
+    return m;
+}
+
+static struct mat *copy_mat(struct mat *m) {
+    struct mat *c = new_mat(m->rows, m->cols);
+    if (c == NULL)
+        return NULL;
+
+    for (int i = 0; i < m->rows; i++)
+        memcpy(c->data[i], m->data[i], m->stride * sizeof(uint64_t));
+    return c;
+}
+
+static struct mat *ref_transpose(struct mat *m) {
+    struct mat *t = new_mat(m->cols, m->rows);
+    if (t == NULL)
+        return NULL;
+
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++)
+            put_bit(t->data[j], i, get_bit(m->data[i], j));
+    }
+    return t;
+}
+
+static struct mat *ref_mul(struct mat *a, struct mat *b) {
+    struct mat *c = new_mat(a->rows, b->cols);
+    if (c == NULL)
+        return NULL;
+
+    for (int i = 0; i < a->rows; i++) {
+        for (int j = 0; j < b->cols; j++) {
+            int bit = 0;
+            for (int k = 0; k < a->cols; k++)
+                bit ^= get_bit(a->data[i], k) & get_bit(b->data[k], j);
+            put_bit(c->data[i], j, bit);
+        }
+    }
+    return c;
+}
+
+static struct mat *ref_sum(struct mat *a, struct mat *b) {
+    struct mat *c = new_mat(a->rows, a->cols);
+    if (c == NULL)
+        return NULL;
+
+    for (int i = 0; i < a->rows; i++) {
+        for (int j = 0; j < a->cols; j++)
+            put_bit(c->data[i], j, get_bit(a->data[i], j) ^ get_bit(b->data[i], j));
+    }
+    return c;
+}
+
+// Rows of e as a dense matrix, one bit flipped per listed position
+static struct mat *ref_dense(struct sparse_mat *e) {
+    struct mat *m = new_mat(e->rows, e->cols);
+    if (m == NULL)
+        return NULL;
+
+    for (int i = 0; i < e->rows; i++) {
+        for (int j = 0; j < e->weight; j++) {
+            int p = e->pos[(size_t)i * e->weight + j];
+            put_bit(m->data[i], p, get_bit(m->data[i], p) ^ 1);
+        }
+    }
+    return m;
+}
+
+static int arr_mat(struct arr *a, struct mat *m, int row) {
+    return a != NULL && a->len == m->cols && same_bits(a->data, m->data[row], a->len);
+}
+
+// a then b, bit by bit, with the padding of the last word clear
+static uint64_t *ref_concat(struct arr *a, struct arr *b) {
+    uint64_t *r = calloc(real_dim(a->len + b->len), sizeof(uint64_t));
+
+    for (int i = 0; r != NULL && i < a->len; i++)
+        put_bit(r, i, get_bit(a->data, i));
+    for (int i = 0; r != NULL && i < b->len; i++)
+        put_bit(r, a->len + i, get_bit(b->data, i));
+
+    return r;
+}
+
+// kernels.dot, bax, kernels.xor_words and kernels.transpose64 on raw words
+static void check_words(struct diff *d) {
+    int len = dim(d, 40);
+    uint64_t *a = malloc(len * sizeof(uint64_t)), *b = malloc(len * sizeof(uint64_t));
+    uint64_t *x = malloc(len * sizeof(uint64_t));
+    if (a == NULL || b == NULL || x == NULL)
+        goto out;
+
+    for (int i = 0; i < len; i++) {
+        a[i] = rng_next(&d->rng);
+        b[i] = rng_next(&d->rng);
+        x[i] = a[i];
+    }
+
+    uint64_t parity = 0;
+    for (int i = 0; i < len * (int)SIZE; i++)
+        parity ^= get_bit(a, i) & get_bit(b, i);
+
+    check(d, kernels.dot(a, b, len) == parity, "dot", "%d words", len);
+    check(d, bax(a, b, len) == parity, "bax", "%d words", len);
+
+    int n = draw(d, len + 1);
+    kernels.xor_words(x, b, n);
+    int ok = 1;
+    for (int i = 0; i < len * (int)SIZE; i++)
+        ok &= get_bit(x, i) == (get_bit(a, i) ^ (i < n * (int)SIZE ? get_bit(b, i) : 0));
+    check(d, ok, "xor_words", "%d of %d words", n, len);
+
+    uint64_t blk[64], ref[64] = { 0 };
+    for (int r = 0; r < 64; r++)
+        blk[r] = rng_next(&d->rng);
+    for (int r = 0; r < 64; r++) {
+        for (int c = 0; c < 64; c++)
+            put_bit(&ref[c], r, get_bit(&blk[r], c));
+    }
+    kernels.transpose64(blk);
+    check(d, memcmp(blk, ref, sizeof(blk)) == 0, "transpose64", "64x64");
+
+    uint64_t w = rng_next(&d->rng), ones = 0;
+    int pos = draw(d, 64);
+    for (int i = 0; i < 64; i++)
+        ones += get_bit(&w, i);
+    check(d, count_ones(w) == ones, "count_ones", "1 word");
+    check(d, fetch_bit(w, pos) == get_bit(&w, pos), "fetch_bit", "bit %d", pos);
+
+out:
+    free(a);
+    free(b);
+    free(x);
+}
+
+/* kernels.rand_fill against the lanes stepped one by one: word j comes from
+   lane j % RNG_LANES */
+static void check_rand_fill(struct diff *d) {
+    int n = dim(d, 4 * RNG_LANES + 3);
+    uint64_t *out = malloc(n * sizeof(uint64_t));
+    if (out == NULL)
+        return;
+
+    struct rng r = d->rng, lane[RNG_LANES];
+    struct rng_lanes l;
+    rng_lanes_init(&l, &r);
+    for (int j = 0; j < RNG_LANES; j++) {
+        for (int k = 0; k < 4; k++)
+            lane[j].s[k] = l.s[k][j];
+    }
+
+    kernels.rand_fill(&l, out, n);
+
+    int ok = 1;
+    for (int j = 0; j < n; j++)
+        ok &= out[j] == rng_next(&lane[j % RNG_LANES]);
+    check(d, ok, "rand_fill", "%d words", n);
+    free(out);
+}
+
+static void check_mat_vec(struct diff *d) {
+    int rows = dim(d, DIFF_LEN), cols = dim(d, DIFF_LEN), batch = dim(d, 8);
+    struct mat *m = random_mat(d, rows, cols, 1);
+    struct mat *v = random_mat(d, batch, cols, 0);
+    struct mat *mt = m != NULL ? ref_transpose(m) : NULL;
+    struct mat *ref = v != NULL && mt != NULL ? ref_mul(v, mt) : NULL;
+
+    if (ref != NULL) {
+        struct arr a = { cols, v->data[0] };
+        struct arr *r = mat_arr_mul(m, &a);
+        check(d, arr_mat(r, ref, 0), "mat_arr_mul", "%dx%d", rows, cols);
+        free_arr(r);
+
+        struct mat *rb = mat_arr_mul_batch(m, v);
+        check(d, same_mat(rb, ref), "mat_arr_mul_batch", "%dx%d by %d", rows, cols, batch);
+        free_mat(rb);
+
+        struct mat *t = matrix_transpose(m);
+        check(d, same_mat(t, mt), "matrix_transpose", "%dx%d", rows, cols);
+        free_mat(t);
+
+        t = matrix_transpose_naive(m);
+        check(d, same_mat(t, mt), "matrix_transpose_naive", "%dx%d", rows, cols);
+        free_mat(t);
+    }
+
+    free_mat(m);
+    free_mat(v);
+    free_mat(mt);
+    free_mat(ref);
+}
+
+static void check_products(struct diff *d) {
+    int rows = dim(d, DIFF_SIDE), inner = dim(d, DIFF_SIDE), cols = dim(d, DIFF_SIDE);
+    struct mat *a = random_mat(d, rows, inner, 1);
+    struct mat *b = random_mat(d, inner, cols, 1);
+    struct mat *ref = a != NULL && b != NULL ? ref_mul(a, b) : NULL;
+
+    if (ref != NULL) {
+        struct mat *c = matrix_mul(a, b);
+        check(d, same_mat(c, ref), "matrix_mul", "%dx%dx%d", rows, inner, cols);
+        free_mat(c);
+
+        c = matrix_mul_naive(a, b);
+        check(d, same_mat(c, ref), "matrix_mul_naive", "%dx%dx%d", rows, inner, cols);
+        free_mat(c);
+
+        c = matrix_mul_m4rm(a, b);
+        check(d, same_mat(c, ref), "matrix_mul_m4rm", "%dx%dx%d", rows, inner, cols);
+        free_mat(c);
+
+        c = matrix_mul_m4rm_mt(a, b, d->pool);
+        check(d, same_mat(c, ref), "matrix_mul_m4rm_mt", "%dx%dx%d", rows, inner, cols);
+        free_mat(c);
+
+        /* DIFF_SIDE stays within one default tile, so the edges of the
+           tiled loops are only reached with tiles of a few words */
+        int tr = 1 + draw(d, 8), tc = 1 + draw(d, 8), td = 1 + draw(d, 2);
+        set_tile_sizes(tr, tc, td);
+        c = matrix_mul(a, b);
+        check(d, same_mat(c, ref), "matrix_mul", "%dx%dx%d tiles %dx%dx%d", rows, inner, cols, tr, tc, td);
+        free_mat(c);
+        set_tile_sizes(0, 0, 0);
+    }
+
+    free_mat(a);
+    free_mat(b);
+    free_mat(ref);
+}
+
+static void check_sums(struct diff *d) {
+    int rows = dim(d, DIFF_SIDE), cols = dim(d, DIFF_LEN);
+    struct mat *a = random_mat(d, rows, cols, 1);
+    struct mat *b = random_mat(d, rows, cols, 1);
+    struct mat *ref = a != NULL && b != NULL ? ref_sum(a, b) : NULL;
+
+    if (ref != NULL) {
+        struct mat *c = matrix_sum(a, b);
+        check(d, same_mat(c, ref), "matrix_sum", "%dx%d", rows, cols);
+        free_mat(c);
+
+        c = copy_mat(a);
+        check(d, c != NULL && matrix_add(c, b) == c && same_mat(c, ref), "matrix_add", "%dx%d", rows, cols);
+        free_mat(c);
+
+        struct arr x = { cols, a->data[0] }, y = { cols, b->data[0] };
+        struct arr *r = array_xor(&x, &y);
+        check(d, arr_mat(r, ref, 0), "array_xor", "%d", cols);
+        free_arr(r);
+
+        uint64_t *s = array_sum(a->data[0], b->data[0], real_dim(cols));
+        check(d, s != NULL && same_bits(s, ref->data[0], cols), "array_sum", "%d", cols);
+        free(s);
+    }
+
+    free_mat(a);
+    free_mat(b);
+    free_mat(ref);
+}
+
+/* Operands are dirty past their lengths and res starts out as garbage, so
+   every word of the result, padding included, is compared */
+static void check_concat(struct diff *d) {
+    int a_len = dim(d, DIFF_LEN), b_len = dim(d, DIFF_LEN), len = a_len + b_len;
+    struct mat *m = random_mat(d, 2, a_len > b_len ? a_len : b_len, 1);
+    uint64_t *ref = NULL, *buf = malloc(real_dim(len) * sizeof(uint64_t));
+
+    if (m != NULL && buf != NULL) {
+        struct arr a = { a_len, m->data[0] }, b = { b_len, m->data[1] };
+        ref = ref_concat(&a, &b);
+
+        struct arr *r = concat_arrays(&a, &b);
+        check(d, ref != NULL && r != NULL && r->len == len &&
+                 memcmp(r->data, ref, real_dim(len) * sizeof(uint64_t)) == 0,
+              "concat_arrays", "%d+%d", a_len, b_len);
+        free_arr(r);
+
+        for (int i = 0; i < real_dim(len); i++)
+            buf[i] = rng_next(&d->rng);
+        struct arr res = { 0, buf };
+        check(d, ref != NULL && concat_arrays_into(&res, &a, &b) == 0 && res.len == len &&
+                 memcmp(buf, ref, real_dim(len) * sizeof(uint64_t)) == 0,
+              "concat_arrays_into", "%d+%d", a_len, b_len);
+    }
+
+    free_mat(m);
+    free(ref);
+    free(buf);
+}
+
+static void check_sparse(struct diff *d) {
+    int len = dim(d, DIFF_LEN), cols = dim(d, DIFF_LEN), rows = dim(d, 8);
+    int weight = 1 + draw(d, len < 40 ? len : 40);
+    struct mat *m = random_mat(d, len, cols, 1);
+    struct sparse *v = weight_sparse(len, weight, &d->rng);
+    struct sparse_mat *e = weight_sparse_mat(rows, len, weight, &d->rng);
+    struct mat *dense = e != NULL ? ref_dense(e) : NULL;
+    struct mat *ref = m != NULL && dense != NULL ? ref_mul(dense, m) : NULL;
+
+    if (ref != NULL && v != NULL) {
+        struct sparse_mat one = { 1, len, weight, v->pos };
+        struct mat *vd = ref_dense(&one);
+        struct mat *vref = vd != NULL ? ref_mul(vd, m) : NULL;
+
+        struct arr *r = sparse_to_arr(v);
+        check(d, vd != NULL && arr_mat(r, vd, 0), "sparse_to_arr", "%d weight %d", len, weight);
+        free_arr(r);
+
+        r = sparse_mat_mul(m, v);
+        check(d, vref != NULL && arr_mat(r, vref, 0), "sparse_mat_mul", "%dx%d weight %d", len, cols, weight);
+        free_arr(r);
+        free_mat(vd);
+        free_mat(vref);
+
+        struct mat *c = sparse_mat_mul_batch(m, e);
+        check(d, same_mat(c, ref), "sparse_mat_mul_batch", "%dx%d by %d", len, cols, rows);
+        free_mat(c);
+
+        c = sparse_mat_to_mat(e);
+        check(d, same_mat(c, dense), "sparse_mat_to_mat", "%dx%d", rows, len);
+        free_mat(c);
+
+        struct mat *base = random_mat(d, rows, len, 1);
+        struct mat *sum = base != NULL ? ref_sum(base, dense) : NULL;
+        check(d, sum != NULL && sparse_mat_add(base, e) == base && same_mat(base, sum), "sparse_mat_add", "%dx%d",
+              rows, len);
+        free_mat(base);
+        free_mat(sum);
+    }
+
+    free_mat(m);
+    free_sparse(v);
+    free_sparse_mat(e);
+    free_mat(dense);
+    free_mat(ref);
+}
+
+/* The samplers have no single right output: the rows must hold weight
+   distinct positions below len, and weight_array and each row of
+   weight_matrix exactly weight set bits and nothing past len */
+static void check_samplers(struct diff *d) {
+    int len = dim(d, DIFF_LEN), rows = dim(d, 8);
+    int weight = 1 + draw(d, len);
+    int *pos = malloc((size_t)rows * weight * sizeof(int));
+    uint64_t *seen = calloc(real_dim(len), sizeof(uint64_t));
+
+    if (pos != NULL && seen != NULL) {
+        int ok = sample_weight(pos, rows, len, weight, &d->rng) == 0;
+        for (int i = 0; i < rows && ok; i++) {
+            for (int j = 0; j < weight && ok; j++) {
+                int p = pos[(size_t)i * weight + j];
+                ok = p >= 0 && p < len && !get_bit(seen, p);
+                if (ok)
+                    put_bit(seen, p, 1);
+            }
+            memset(seen, 0, real_dim(len) * sizeof(uint64_t));
+        }
+        check(d, ok, "sample_weight", "%dx%d weight %d", rows, len, weight);
+    }
+
+    uint64_t *w = weight_array(len, weight, &d->rng);
+    int ones = 0, pad = 0;
+    for (int i = 0; w != NULL && i < real_dim(len) * (int)SIZE; i++) {
+        if (i < len)
+            ones += get_bit(w, i);
+        else
+            pad |= get_bit(w, i);
+    }
+    check(d, w != NULL && ones == weight && !pad, "weight_array", "%d weight %d", len, weight);
+
+    struct mat *m = weight_matrix(rows, len, weight, &d->rng);
+    int ok = m != NULL && m->rows == rows && m->cols == len;
+    for (int i = 0; ok && i < rows; i++) {
+        ones = pad = 0;
+        for (int j = 0; j < real_dim(len) * (int)SIZE; j++) {
+            if (j < len)
+                ones += get_bit(m->data[i], j);
+            else
+                pad |= get_bit(m->data[i], j);
+        }
+        ok = ones == weight && !pad;
+    }
+    check(d, ok, "weight_matrix", "%dx%d weight %d", rows, len, weight);
+    free_mat(m);
+
+    free(pos);
+    free(seen);
+    free(w);
+}
+
+static void check_variant(struct diff *d, int rounds) {
+    seed_rng(&d->rng, d->seed);
+
+    for (d->round = 0; d->round < rounds; d->round++) {
+        check_words(d);
+        check_rand_fill(d);
+        check_mat_vec(d);
+        check_products(d);
+        check_sums(d);
+        check_concat(d);
+        check_sparse(d);
+        check_samplers(d);
+    }
+}
+
+/* Operands of the timed calls, fixed shapes that do not depend on the
+   parameter set so that baselines stay comparable */
+struct timing_ctx {
+    struct mat *m;
+    struct mat *acc;
+    struct mat *a;
+    struct mat *b;
+    struct mat *v;
+    struct sparse_mat *e;
+    struct rng_lanes lanes;
+    uint64_t *words;
+};
+
+typedef void (*timed_fn)(struct timing_ctx *c);
+
+static volatile uint64_t sink;
+
+static void time_dot(struct timing_ctx *c) {
+    sink = kernels.dot(c->m->data[0], c->m->data[1], c->m->stride);
+}
+
+static void time_mat_vec(struct timing_ctx *c) {
+    struct arr a = { c->m->cols, c->v->data[0] };
+    free_arr(mat_arr_mul(c->m, &a));
+}
+
+static void time_mat_vec_batch(struct timing_ctx *c) {
+    free_mat(mat_arr_mul_batch(c->m, c->v));
+}
+
+static void time_transpose(struct timing_ctx *c) {
+    free_mat(matrix_transpose(c->m));
+}
+
+static void time_matrix_mul(struct timing_ctx *c) {
+    free_mat(matrix_mul(c->a, c->b));
+}
+
+static void time_matrix_mul_m4rm(struct timing_ctx *c) {
+    free_mat(matrix_mul_m4rm(c->a, c->b));
+}
+
+static void time_matrix_add(struct timing_ctx *c) {
+    matrix_add(c->acc, c->m);
+}
+
+static void time_sparse_mul_batch(struct timing_ctx *c) {
+    free_mat(sparse_mat_mul_batch(c->m, c->e));
+}
+
+static void time_rand_fill(struct timing_ctx *c) {
+    kernels.rand_fill(&c->lanes, c->words, c->m->stride);
+}
+
+struct timed {
+    const char *op;
+    timed_fn run;
+};
+
+static const struct timed timed_all[] = {
+    { "dot", time_dot },
+    { "mat_arr_mul", time_mat_vec },
+    { "mat_arr_mul_batch", time_mat_vec_batch },
+    { "matrix_transpose", time_transpose },
+    { "matrix_mul", time_matrix_mul },
+    { "matrix_mul_m4rm", time_matrix_mul_m4rm },
+    { "matrix_add", time_matrix_add },
+    { "sparse_mat_mul_batch", time_sparse_mul_batch },
+    { "rand_fill", time_rand_fill },
+};
+
+#define TIMED ((int)(sizeof(timed_all) / sizeof(timed_all[0])))
+
+struct entry {
+    char op[32];
+    char variant[32];
+    double ns;
+};
+
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// Best time per call of DIFF_TIMES rounds of at least DIFF_ROUND_NS each
+static double time_call(timed_fn fn, struct timing_ctx *c) {
+    double t0 = now_ns();
+    fn(c);
+    double once = now_ns() - t0;
+    long iters = (long)(DIFF_ROUND_NS / (once > 1 ? once : 1)) + 1;
+    double best = once;
+
+    for (int r = 0; r < DIFF_TIMES; r++) {
+        t0 = now_ns();
+        for (long i = 0; i < iters; i++)
+            fn(c);
+        double ns = (now_ns() - t0) / iters;
+        if (ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static int init_timing(struct diff *d, struct timing_ctx *c) {
+    memset(c, 0, sizeof(*c));
+    seed_rng(&d->rng, d->seed);
+
+    c->m = random_mat(d, 2048, 4096, 0);
+    c->acc = random_mat(d, 2048, 4096, 0);
+    c->v = random_mat(d, 16, 4096, 0);
+    c->a = random_mat(d, 512, 512, 0);
+    c->b = random_mat(d, 512, 512, 0);
+    c->e = weight_sparse_mat(64, 2048, 64, &d->rng);
+    c->words = c->m != NULL ? malloc(c->m->stride * sizeof(uint64_t)) : NULL;
+    rng_lanes_init(&c->lanes, &d->rng);
+
+    return c->m == NULL || c->acc == NULL || c->v == NULL || c->a == NULL || c->b == NULL || c->e == NULL || c->words == NULL ? -1 : 0;
+}
+
+static void free_timing(struct timing_ctx *c) {
+    free_mat(c->m);
+    free_mat(c->acc);
+    free_mat(c->v);
+    free_mat(c->a);
+    free_mat(c->b);
+    free_sparse_mat(c->e);
+    free(c->words);
+}
+
+// Lines "<op> <variant> <ns>", # starting a comment. Returns the entries or -1
+static int read_baseline(const char *path, struct entry *base, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char line[128];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %31s %lf", base[n].op, base[n].variant, &base[n].ns) == 3)
+            n++;
+    }
+
+    fclose(f);
+    return n;
+}
+
+static int write_baseline(const char *path, struct entry *res, int n) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+
+    fprintf(f, "# op variant ns-per-call\n");
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%s %s %.1f\n", res[i].op, res[i].variant, res[i].ns);
+
+    int ret = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0)
+        ret = -1;
+    return ret;
+}
+
+static const struct entry *find(const struct entry *base, int n, const char *op, const char *variant) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(base[i].op, op) == 0 && strcmp(base[i].variant, variant) == 0)
+            return &base[i];
+    }
+    return NULL;
+}
+
+/* Times every op under each variant and compares with the baseline.
+   Returns the slowdowns past the threshold, or -1 on errors. */
+static int run_timings(struct diff *d, const struct diff_config *cfg, const struct kernel_set *sets, int count) {
+    struct timing_ctx c;
+    struct entry base[DIFF_ENTRIES], res[DIFF_ENTRIES];
+    int nb = read_baseline(cfg->baseline, base, DIFF_ENTRIES), n = 0, slow = 0;
+
+    if (init_timing(d, &c) != 0) {
+        free_timing(&c);
+        return -1;
+    }
+
+    fprintf(stdout, "\n%-22s %-15s %14s %14s %8s\n", "op", "variant", "ns/call", "baseline", "change");
+
+    for (int s = 0; s < count; s++) {
+        kernels = sets[s];
+
+        for (int i = 0; i < TIMED && n < DIFF_ENTRIES; i++, n++) {
+            snprintf(res[n].op, sizeof(res[n].op), "%s", timed_all[i].op);
+            snprintf(res[n].variant, sizeof(res[n].variant), "%s", kernels.name);
+            res[n].ns = time_call(timed_all[i].run, &c);
+
+            const struct entry *b = find(base, nb, res[n].op, res[n].variant);
+            if (b == NULL) {
+                fprintf(stdout, "%-22s %-15s %14.1f %14s\n", res[n].op, res[n].variant, res[n].ns, "-");
+                continue;
+            }
+
+            double change = (res[n].ns / b->ns - 1) * 100;
+            int flagged = change > cfg->threshold;
+            slow += flagged;
+            fprintf(stdout, "%-22s %-15s %14.1f %14.1f %+7.1f%%%s\n", res[n].op, res[n].variant, res[n].ns, b->ns,
+                    change, flagged ? "  SLOW" : "");
+        }
+    }
+
+    free_timing(&c);
+
+    if (cfg->update || nb < 0) {
+        if (write_baseline(cfg->baseline, res, n) != 0) {
+            fprintf(stderr, "Failed to write the baseline %s\n", cfg->baseline);
+            return -1;
+        }
+        fprintf(stdout, "\nBaseline written to %s\n", cfg->baseline);
+        return 0;
+    }
+
+    return slow;
+}
+
+int difftest(const struct diff_config *cfg) {
+    if (cfg == NULL || cfg->rounds < 0)
+        return -1;
+
+    struct kernel_set saved = kernels, sets[CPU_AVX512_VPOPCNT + 1];
+    int count = 0;
+
+    // Every level up to the CPU's, the portable kernels being the first
+    for (int level = CPU_SCALAR; level <= (int)cpu_level(); level++)
+        sets[count++] = kernels_for((enum cpu_level)level);
+
+    struct diff d = { .seed = cfg->seed, .pool = pool_new(3) };
+    if (d.pool == NULL)
+        return -1;
+
+    for (int s = 0; s < count; s++) {
+        kernels = sets[s];
+        d.variant = kernels.name;
+
+        long before = d.failures;
+        check_variant(&d, cfg->rounds);
+        fprintf(stdout, "%-15s %s\n", kernels.name, d.failures == before ? "OK" : "FAILED");
+    }
+
+    fprintf(stdout, "%ld checks, %ld failed, seed %" PRIu64 ", %d rounds\n", d.checks, d.failures, d.seed,
+            cfg->rounds);
+
+    int slow = 0;
+    if (cfg->baseline != NULL) {
+        slow = run_timings(&d, cfg, sets, count);
+        if (slow > 0)
+            fprintf(stdout, "\n%d timings slower than the baseline by more than %.1f%%\n", slow, cfg->threshold);
+    }
+
+    kernels = saved;
+    pool_free(d.pool);
+    return d.failures == 0 && slow == 0 ? 0 : -1;
+}
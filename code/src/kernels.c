@@ -0,0 +1,427 @@
+#include "../include/kernels.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/bitop.h"
+#include "../include/cpu.h"
+#include "../include/xoshiro.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define WORD_BITS 64
+
+static uint64_t dot_scalar(const uint64_t *a, const uint64_t *b, int len) {
+    uint64_t acc = 0;
+
+    for (int i = 0; i < len; i++)
+        acc ^= a[i] & b[i];
+
+    return count_ones(acc) & 1ULL;
+}
+
+static void mat_vec_scalar(uint64_t *const *rows, int n, const uint64_t *v, int len, uint64_t *out) {
+    for (int i = 0; i < n; i++)
+        out[i / WORD_BITS] |= dot_scalar(rows[i], v, len) << (i % WORD_BITS);
+}
+
+/* Butterfly step j of the 64x64 transpose: swaps the high j columns of the
+   upper j rows with the low j columns of the lower j rows of each 2j block. */
+static void transpose_step(uint64_t *blk, int j, uint64_t m) {
+    for (int k = 0; k < 64; k = (k + j + 1) & ~j) {
+        uint64_t t = ((blk[k] >> j) ^ blk[k + j]) & m;
+        blk[k] ^= t << j;
+        blk[k + j] ^= t;
+    }
+}
+
+static void transpose64_scalar(uint64_t *blk) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+
+    for (int j = 32; j != 0; j >>= 1, m ^= m << j)
+        transpose_step(blk, j, m);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** on all lanes side by side; the lanes do not depend on each
+   other, so their steps overlap instead of waiting on one state. */
+static void rand_fill_scalar(struct rng_lanes *l, uint64_t *out, int n) {
+    uint64_t blk[RNG_LANES];
+
+    for (int i = 0; i < n; i += RNG_LANES) {
+        uint64_t *dst = n - i >= RNG_LANES ? out + i : blk;
+
+        for (int k = 0; k < RNG_LANES; k++) {
+            uint64_t t = l->s[1][k] << 17;
+
+            dst[k] = rotl64(l->s[1][k] * 5, 7) * 9;
+
+            l->s[2][k] ^= l->s[0][k];
+            l->s[3][k] ^= l->s[1][k];
+            l->s[1][k] ^= l->s[2][k];
+            l->s[0][k] ^= l->s[3][k];
+            l->s[2][k] ^= t;
+            l->s[3][k] = rotl64(l->s[3][k], 45);
+        }
+
+        if (dst == blk)
+            memcpy(out + i, blk, (size_t)(n - i) * sizeof(uint64_t));
+    }
+}
+
+static void xor_words_scalar(uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] ^= src[i];
+}
+
+#if defined(__x86_64__)
+
+/* AVX2: XOR-accumulate 256 bits at a time, one popcount per row at the end.
+   mat_vec walks four rows together so every load of v is shared. */
+
+__attribute__((target("avx2")))
+static inline uint64_t fold256(__m256i x) {
+    __m128i h = _mm_xor_si128(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    return (uint64_t)_mm_cvtsi128_si64(h) ^ (uint64_t)_mm_extract_epi64(h, 1);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t dot_avx2(const uint64_t *a, const uint64_t *b, int len) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_xor_si256(acc, _mm256_and_si256(x, y));
+    }
+
+    uint64_t res = fold256(acc);
+    for (; i < len; i++)
+        res ^= a[i] & b[i];
+
+    return _mm_popcnt_u64(res) & 1ULL;
+}
+
+__attribute__((target("avx2,popcnt")))
+static void mat_vec_avx2(uint64_t *const *rows, int n, const uint64_t *v, int len, uint64_t *out) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        __m256i acc2 = _mm256_setzero_si256();
+        __m256i acc3 = _mm256_setzero_si256();
+        int w = 0;
+
+        for (; w + 4 <= len; w += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(v + w));
+            acc0 = _mm256_xor_si256(acc0, _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(rows[i] + w))));
+            acc1 = _mm256_xor_si256(acc1, _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(rows[i + 1] + w))));
+            acc2 = _mm256_xor_si256(acc2, _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(rows[i + 2] + w))));
+            acc3 = _mm256_xor_si256(acc3, _mm256_and_si256(x, _mm256_loadu_si256((const __m256i *)(rows[i + 3] + w))));
+        }
+
+        uint64_t r0 = fold256(acc0), r1 = fold256(acc1), r2 = fold256(acc2), r3 = fold256(acc3);
+        for (; w < len; w++) {
+            r0 ^= rows[i][w] & v[w];
+            r1 ^= rows[i + 1][w] & v[w];
+            r2 ^= rows[i + 2][w] & v[w];
+            r3 ^= rows[i + 3][w] & v[w];
+        }
+
+        uint64_t bits = (_mm_popcnt_u64(r0) & 1) | (_mm_popcnt_u64(r1) & 1) << 1
+                      | (_mm_popcnt_u64(r2) & 1) << 2 | (_mm_popcnt_u64(r3) & 1) << 3;
+        out[i / WORD_BITS] |= bits << (i % WORD_BITS);
+    }
+
+    for (; i < n; i++)
+        out[i / WORD_BITS] |= dot_avx2(rows[i], v, len) << (i % WORD_BITS);
+}
+
+/* Steps with j >= 4 pair runs of consecutive words, so they go four rows at
+   a time; the last two steps stay scalar. */
+__attribute__((target("avx2")))
+static void transpose64_avx2(uint64_t *blk) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    int j;
+
+    for (j = 32; j >= 4; j >>= 1, m ^= m << j) {
+        __m256i mask = _mm256_set1_epi64x((long long)m);
+
+        for (int k = 0; k < 64; k += 2 * j) {
+            for (int r = k; r < k + j; r += 4) {
+                __m256i x = _mm256_loadu_si256((__m256i *)(blk + r));
+                __m256i y = _mm256_loadu_si256((__m256i *)(blk + r + j));
+                __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi64(x, j), y), mask);
+
+                _mm256_storeu_si256((__m256i *)(blk + r), _mm256_xor_si256(x, _mm256_slli_epi64(t, j)));
+                _mm256_storeu_si256((__m256i *)(blk + r + j), _mm256_xor_si256(y, t));
+            }
+        }
+    }
+
+    for (; j != 0; j >>= 1, m ^= m << j)
+        transpose_step(blk, j, m);
+}
+
+#define ROTL256(x, k) _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+/* One xoshiro256** step on four lanes. The multiplies by 5 and 9 are
+   shift-adds, AVX2 has no 64-bit multiply. */
+__attribute__((target("avx2")))
+static inline __m256i xoshiro_avx2(__m256i *s0, __m256i *s1, __m256i *s2, __m256i *s3) {
+    __m256i x = _mm256_add_epi64(_mm256_slli_epi64(*s1, 2), *s1);
+    x = ROTL256(x, 7);
+    x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+
+    __m256i t = _mm256_slli_epi64(*s1, 17);
+
+    *s2 = _mm256_xor_si256(*s2, *s0);
+    *s3 = _mm256_xor_si256(*s3, *s1);
+    *s1 = _mm256_xor_si256(*s1, *s2);
+    *s0 = _mm256_xor_si256(*s0, *s3);
+    *s2 = _mm256_xor_si256(*s2, t);
+    *s3 = ROTL256(*s3, 45);
+
+    return x;
+}
+
+// Lanes 0-3 and 4-7 as two independent register sets
+__attribute__((target("avx2")))
+static void rand_fill_avx2(struct rng_lanes *l, uint64_t *out, int n) {
+    __m256i a0 = _mm256_loadu_si256((__m256i *)l->s[0]);
+    __m256i a1 = _mm256_loadu_si256((__m256i *)l->s[1]);
+    __m256i a2 = _mm256_loadu_si256((__m256i *)l->s[2]);
+    __m256i a3 = _mm256_loadu_si256((__m256i *)l->s[3]);
+    __m256i b0 = _mm256_loadu_si256((__m256i *)(l->s[0] + 4));
+    __m256i b1 = _mm256_loadu_si256((__m256i *)(l->s[1] + 4));
+    __m256i b2 = _mm256_loadu_si256((__m256i *)(l->s[2] + 4));
+    __m256i b3 = _mm256_loadu_si256((__m256i *)(l->s[3] + 4));
+    uint64_t blk[RNG_LANES];
+
+    for (int i = 0; i < n; i += RNG_LANES) {
+        uint64_t *dst = n - i >= RNG_LANES ? out + i : blk;
+
+        _mm256_storeu_si256((__m256i *)dst, xoshiro_avx2(&a0, &a1, &a2, &a3));
+        _mm256_storeu_si256((__m256i *)(dst + 4), xoshiro_avx2(&b0, &b1, &b2, &b3));
+
+        if (dst == blk)
+            memcpy(out + i, blk, (size_t)(n - i) * sizeof(uint64_t));
+    }
+
+    _mm256_storeu_si256((__m256i *)l->s[0], a0);
+    _mm256_storeu_si256((__m256i *)l->s[1], a1);
+    _mm256_storeu_si256((__m256i *)l->s[2], a2);
+    _mm256_storeu_si256((__m256i *)l->s[3], a3);
+    _mm256_storeu_si256((__m256i *)(l->s[0] + 4), b0);
+    _mm256_storeu_si256((__m256i *)(l->s[1] + 4), b1);
+    _mm256_storeu_si256((__m256i *)(l->s[2] + 4), b2);
+    _mm256_storeu_si256((__m256i *)(l->s[3] + 4), b3);
+}
+
+__attribute__((target("avx2")))
+static void xor_words_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(dst + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(x, y));
+    }
+
+    for (; i < n; i++)
+        dst[i] ^= src[i];
+}
+
+/* AVX-512: tails use masked loads, mat_vec walks eight rows together and
+   turns their eight folded words into eight result bits at once, with a
+   single VPOPCNTQ when the CPU has it. */
+
+__attribute__((target("avx512f")))
+static inline uint64_t fold512(__m512i x) {
+    __m256i y = _mm256_xor_si256(_mm512_castsi512_si256(x), _mm512_extracti64x4_epi64(x, 1));
+    __m128i h = _mm_xor_si128(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+    return (uint64_t)_mm_cvtsi128_si64(h) ^ (uint64_t)_mm_extract_epi64(h, 1);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static uint64_t dot_avx512(const uint64_t *a, const uint64_t *b, int len) {
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+
+    for (; i + 8 <= len; i += 8)
+        acc = _mm512_xor_si512(acc, _mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+
+    if (i < len) {
+        __mmask8 tail = (__mmask8)((1U << (len - i)) - 1);
+        acc = _mm512_xor_si512(acc, _mm512_and_si512(_mm512_maskz_loadu_epi64(tail, a + i),
+                                                     _mm512_maskz_loadu_epi64(tail, b + i)));
+    }
+
+    return _mm_popcnt_u64(fold512(acc)) & 1ULL;
+}
+
+// Folded XOR accumulators of rows[0..7] against v
+__attribute__((target("avx512f")))
+static inline void rows8_avx512(uint64_t *const *rows, const uint64_t *v, int len, uint64_t *red) {
+    __m512i acc[8];
+    int w = 0;
+
+    for (int r = 0; r < 8; r++)
+        acc[r] = _mm512_setzero_si512();
+
+    for (; w + 8 <= len; w += 8) {
+        __m512i x = _mm512_loadu_si512(v + w);
+        for (int r = 0; r < 8; r++)
+            acc[r] = _mm512_xor_si512(acc[r], _mm512_and_si512(x, _mm512_loadu_si512(rows[r] + w)));
+    }
+
+    if (w < len) {
+        __mmask8 tail = (__mmask8)((1U << (len - w)) - 1);
+        __m512i x = _mm512_maskz_loadu_epi64(tail, v + w);
+        for (int r = 0; r < 8; r++)
+            acc[r] = _mm512_xor_si512(acc[r], _mm512_and_si512(x, _mm512_maskz_loadu_epi64(tail, rows[r] + w)));
+    }
+
+    for (int r = 0; r < 8; r++)
+        red[r] = fold512(acc[r]);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static void mat_vec_avx512(uint64_t *const *rows, int n, const uint64_t *v, int len, uint64_t *out) {
+    uint64_t red[8];
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        rows8_avx512(rows + i, v, len, red);
+
+        uint64_t bits = 0;
+        for (int r = 0; r < 8; r++)
+            bits |= (_mm_popcnt_u64(red[r]) & 1ULL) << r;
+
+        out[i / WORD_BITS] |= bits << (i % WORD_BITS);
+    }
+
+    for (; i < n; i++)
+        out[i / WORD_BITS] |= dot_avx512(rows[i], v, len) << (i % WORD_BITS);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static void mat_vec_avx512_vpopcnt(uint64_t *const *rows, int n, const uint64_t *v, int len, uint64_t *out) {
+    uint64_t red[8];
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        rows8_avx512(rows + i, v, len, red);
+
+        __m512i cnt = _mm512_popcnt_epi64(_mm512_loadu_si512(red));
+        uint64_t bits = _mm512_test_epi64_mask(cnt, _mm512_set1_epi64(1));
+
+        out[i / WORD_BITS] |= bits << (i % WORD_BITS);
+    }
+
+    for (; i < n; i++)
+        out[i / WORD_BITS] |= dot_avx512(rows[i], v, len) << (i % WORD_BITS);
+}
+
+/* Same as transpose64_avx2 with eight rows per step down to j = 8. */
+__attribute__((target("avx512f,avx2")))
+static void transpose64_avx512(uint64_t *blk) {
+    uint64_t m = 0x00000000FFFFFFFFULL;
+    int j;
+
+    for (j = 32; j >= 8; j >>= 1, m ^= m << j) {
+        __m512i mask = _mm512_set1_epi64((long long)m);
+
+        for (int k = 0; k < 64; k += 2 * j) {
+            for (int r = k; r < k + j; r += 8) {
+                __m512i x = _mm512_loadu_si512(blk + r);
+                __m512i y = _mm512_loadu_si512(blk + r + j);
+                __m512i t = _mm512_and_si512(_mm512_xor_si512(_mm512_srli_epi64(x, j), y), mask);
+
+                _mm512_storeu_si512(blk + r, _mm512_xor_si512(x, _mm512_slli_epi64(t, j)));
+                _mm512_storeu_si512(blk + r + j, _mm512_xor_si512(y, t));
+            }
+        }
+    }
+
+    for (; j != 0; j >>= 1, m ^= m << j)
+        transpose_step(blk, j, m);
+}
+
+// All eight lanes in one register set, rotations are single VPROLQ
+__attribute__((target("avx512f")))
+static void rand_fill_avx512(struct rng_lanes *l, uint64_t *out, int n) {
+    __m512i s0 = _mm512_loadu_si512(l->s[0]);
+    __m512i s1 = _mm512_loadu_si512(l->s[1]);
+    __m512i s2 = _mm512_loadu_si512(l->s[2]);
+    __m512i s3 = _mm512_loadu_si512(l->s[3]);
+    int i = 0;
+
+    for (; i < n; i += RNG_LANES) {
+        __m512i x = _mm512_add_epi64(_mm512_slli_epi64(s1, 2), s1);
+        x = _mm512_rol_epi64(x, 7);
+        x = _mm512_add_epi64(_mm512_slli_epi64(x, 3), x);
+
+        __m512i t = _mm512_slli_epi64(s1, 17);
+
+        s2 = _mm512_xor_si512(s2, s0);
+        s3 = _mm512_xor_si512(s3, s1);
+        s1 = _mm512_xor_si512(s1, s2);
+        s0 = _mm512_xor_si512(s0, s3);
+        s2 = _mm512_xor_si512(s2, t);
+        s3 = _mm512_rol_epi64(s3, 45);
+
+        __mmask8 k = n - i >= RNG_LANES ? 0xff : (__mmask8)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_epi64(out + i, k, x);
+    }
+
+    _mm512_storeu_si512(l->s[0], s0);
+    _mm512_storeu_si512(l->s[1], s1);
+    _mm512_storeu_si512(l->s[2], s2);
+    _mm512_storeu_si512(l->s[3], s3);
+}
+
+__attribute__((target("avx512f")))
+static void xor_words_avx512(uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_si512(dst + i, _mm512_xor_si512(_mm512_loadu_si512(dst + i), _mm512_loadu_si512(src + i)));
+
+    if (i < n) {
+        __mmask8 k = (__mmask8)((1u << (n - i)) - 1);
+        __m512i x = _mm512_maskz_loadu_epi64(k, dst + i);
+        __m512i y = _mm512_maskz_loadu_epi64(k, src + i);
+        _mm512_mask_storeu_epi64(dst + i, k, _mm512_xor_si512(x, y));
+    }
+}
+
+#endif
+
+struct kernel_set kernels = { "scalar", dot_scalar, mat_vec_scalar, transpose64_scalar, rand_fill_scalar, xor_words_scalar };
+
+struct kernel_set kernels_for(enum cpu_level level) {
+    switch (level) {
+#if defined(__x86_64__)
+        case CPU_AVX512_VPOPCNT:
+            return (struct kernel_set){ "avx512-vpopcnt", dot_avx512, mat_vec_avx512_vpopcnt, transpose64_avx512, rand_fill_avx512, xor_words_avx512 };
+        case CPU_AVX512:
+            return (struct kernel_set){ "avx512", dot_avx512, mat_vec_avx512, transpose64_avx512, rand_fill_avx512, xor_words_avx512 };
+        case CPU_AVX2:
+            return (struct kernel_set){ "avx2", dot_avx2, mat_vec_avx2, transpose64_avx2, rand_fill_avx2, xor_words_avx2 };
+#endif
+        default:
+            return (struct kernel_set){ "scalar", dot_scalar, mat_vec_scalar, transpose64_scalar, rand_fill_scalar, xor_words_scalar };
+    }
+}
+
+void select_kernels(void) {
+    kernels = kernels_for(cpu_level());
+}
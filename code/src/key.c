@@ -0,0 +1,383 @@
+#include "../include/key.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/backend.h"
+#include "../include/keyfile.h"
+
+/* Maps the key file in place, copying it in only if it cannot be mapped.
+   Headerless keys are still accepted, their layout and parameter set are
+   told by the shape, and a shape no set has stays with the active one. */
+int load_key(const char *path, struct key *k) {
+    struct key_info info;
+
+    k->m = NULL;
+    k->seed = NULL;
+    k->layout = KEY_ROW_MAJOR;
+    k->params = NULL;
+
+    if(is_seed_file(path)) {
+        k->seed = read_seed_file(path);
+        if(k->seed != NULL)
+            k->params = params_by_shape(k->seed->rows, k->seed->cols);
+    } else if(is_key_file(path)) {
+        k->m = map_key_file(path, &info);
+        if(k->m == NULL)
+            k->m = read_key_file(path, &info);
+        if(k->m != NULL) {
+            k->layout = info.layout;
+            k->params = params_by_id(info.params);
+        }
+    } else {
+        k->m = map_key(path);
+        if(k->m == NULL)
+            k->m = read_key(path);
+        if(k->m != NULL) {
+            k->params = params_by_shape(k->m->rows, k->m->cols);
+            if(k->params == NULL)
+                k->params = active_params;
+            if(k->m->rows == k->params->n && k->m->cols != k->params->n)
+                k->layout = KEY_COL_MAJOR;
+        }
+    }
+
+    if(k->params == NULL) {
+        free_key(k);
+        return -1;
+    }
+    return 0;
+}
+
+const struct params *key_params(const char *path) {
+    struct key_info info;
+
+    if(is_seed_file(path)) {
+        struct seed_mat *s = read_seed_file(path);
+        const struct params *p = s != NULL ? params_by_shape(s->rows, s->cols) : NULL;
+        free(s);
+        return p;
+    }
+
+    if(is_key_file(path))
+        return read_key_info(path, &info) == 0 ? params_by_id(info.params) : NULL;
+
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+
+    int dims[2];
+    int ok = fread(dims, sizeof(int), 2, file) == 2;
+    fclose(file);
+
+    return ok ? params_by_shape(dims[0], dims[1]) : NULL;
+}
+
+void free_key(struct key *k) {
+    free_mat(k->m);
+    free(k->seed);
+    k->m = NULL;
+    k->seed = NULL;
+}
+
+// Rows of the key as a matrix, whatever it is stored as
+static int key_rows(struct key *k) {
+    if(k->seed != NULL)
+        return k->seed->rows;
+    return k->layout == KEY_COL_MAJOR ? k->m->cols : k->m->rows;
+}
+
+struct arr *key_arr_mul(struct key *k, struct arr *a) {
+    return k->seed != NULL ? seed_mat_arr_mul(k->seed, a) : mat_arr_mul(k->m, a);
+}
+
+/* A column-major key only needs the columns picked by e, the others go
+   through the dense product. */
+struct arr *key_noise_mul(struct key *k, struct sparse *e) {
+    if(k->m != NULL && k->layout == KEY_COL_MAJOR)
+        return sparse_mat_mul(k->m, e);
+
+    struct arr *dense = sparse_to_arr(e);
+    if(dense == NULL)
+        return NULL;
+
+    struct arr *res = key_arr_mul(k, dense);
+
+    free_arr(dense);
+    return res;
+}
+
+struct mat *key_arr_mul_batch(struct key *k, struct mat *v) {
+    return k->seed != NULL ? seed_mat_arr_mul_batch(k->seed, v) : mat_arr_mul_batch(k->m, v);
+}
+
+struct mat *key_noise_mul_batch(struct key *k, struct sparse_mat *e) {
+    struct arena scratch;
+
+    if(e == NULL || arena_init(&scratch, key_batch_scratch_size(k->params, e->rows)) != 0)
+        return NULL;
+
+    struct mat *res = new_mat(e->rows, key_rows(k));
+    if(res != NULL && key_noise_mul_batch_into(res, k, e, &scratch) != 0) {
+        free_mat(res);
+        res = NULL;
+    }
+
+    arena_free(&scratch);
+    return res;
+}
+
+struct mat *key_mat_mul(struct key *k, struct mat *v) {
+    struct arena scratch;
+
+    if(v == NULL || arena_init(&scratch, key_batch_scratch_size(k->params, v->rows)) != 0)
+        return NULL;
+
+    struct mat *res = new_mat(v->rows, key_rows(k));
+    if(res != NULL && key_mat_mul_into(res, k, v, &scratch) != 0) {
+        free_mat(res);
+        res = NULL;
+    }
+
+    arena_free(&scratch);
+    return res;
+}
+
+/* Column-major copy of a stored row-major key, or the key itself */
+static struct key key_columns(struct key *k) {
+    struct key c = *k;
+
+    if(k->m != NULL && k->layout == KEY_ROW_MAJOR) {
+        struct mat *t = matrix_transpose(k->m);
+        if(t != NULL) {
+            c.m = t;
+            c.layout = KEY_COL_MAJOR;
+        }
+    }
+    return c;
+}
+
+/* Encrypts every row of msg with its own noise vector, passing over each key
+   once for the whole batch. Row i of *nnc and *word belongs to row i of msg.
+   From ENCRYPT_TRANSPOSE rows, dense keys are transposed for the batch. */
+int key_encrypt(struct key *a, struct key *y, struct mat *msg, struct rng *rng,
+                struct mat **nnc, struct mat **word) {
+    struct arena scratch;
+    int ret = -1;
+
+    if(msg == NULL || a->params != y->params)
+        return -1;
+
+    *nnc = new_mat(msg->rows, a->params->k);
+    *word = new_mat(msg->rows, a->params->l);
+
+    struct key ac = *a, yc = *y;
+    if(msg->rows >= ENCRYPT_TRANSPOSE) {
+        ac = key_columns(a);
+        yc = key_columns(y);
+    }
+
+    if(*nnc != NULL && *word != NULL && arena_init(&scratch, key_batch_scratch_size(a->params, msg->rows)) == 0) {
+        ret = key_encrypt_batch_into(&ac, &yc, msg, rng, &scratch, *nnc, *word);
+        arena_free(&scratch);
+    }
+
+    if(ac.m != a->m)
+        free_mat(ac.m);
+    if(yc.m != y->m)
+        free_mat(yc.m);
+    if(ret != 0) {
+        free_mat(*nnc);
+        free_mat(*word);
+    }
+    return ret;
+}
+
+/* Decrypts every row of word with the matching row of nnc: S * NNC for the
+   whole batch, then one XOR pass. *msg gets one row per ciphertext. */
+int key_decrypt(struct key *s, struct mat *nnc, struct mat *word, struct mat **msg) {
+    struct arena scratch;
+    int ret = -1;
+
+    if(nnc == NULL || word == NULL)
+        return -1;
+
+    *msg = new_mat(nnc->rows, s->params->l);
+
+    if(*msg != NULL && arena_init(&scratch, key_batch_scratch_size(s->params, nnc->rows)) == 0) {
+        ret = key_decrypt_batch_into(s, nnc, word, &scratch, *msg);
+        arena_free(&scratch);
+    }
+
+    if(ret != 0)
+        free_mat(*msg);
+    return ret;
+}
+
+size_t key_scratch_size(const struct params *p) {
+    size_t words = (size_t)(2 + SEED_BLOCK) * real_dim(p->n > p->k ? p->n : p->k);
+    return 4 * MAT_ALIGN + p->t * sizeof(int) + words * sizeof(uint64_t);
+}
+
+int key_arr_mul_into(struct arr *res, struct key *k, struct arr *a, struct arena *scratch) {
+    if(k->seed == NULL)
+        return mat_arr_mul_into(res, k->m, a);
+
+    size_t mark = arena_mark(scratch);
+    uint64_t *blk = arena_alloc(scratch, SEED_SCRATCH(k->seed->cols) * sizeof(uint64_t));
+    int ret = blk != NULL ? seed_mat_arr_mul_into(res, k->seed, a, blk) : -1;
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+int key_noise_mul_into(struct arr *res, struct key *k, struct sparse *e, struct arena *scratch) {
+    if(k->m != NULL && k->layout == KEY_COL_MAJOR)
+        return sparse_mat_mul_into(res, k->m, e);
+
+    size_t mark = arena_mark(scratch);
+    struct arr dense = arena_arr(scratch, e->len);
+    int ret = -1;
+
+    if(dense.data != NULL && sparse_to_arr_into(&dense, e) == 0)
+        ret = key_arr_mul_into(res, k, &dense, scratch);
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+/* Draws e the way key_encrypt does for a one-row batch, so both give the
+   same ciphertext from the same generator state. */
+int key_encrypt_into(struct key *a, struct key *y, struct arr *msg, struct rng *rng, struct arena *scratch,
+                     struct arr *nnc, struct arr *word) {
+    if(msg == NULL || msg->len != y->params->l || a->params != y->params)
+        return -1;
+
+    const struct params *p = a->params;
+    size_t mark = arena_mark(scratch);
+    struct arr bits = arena_arr(scratch, p->n);
+    struct sparse e = { p->n, p->t, arena_alloc(scratch, p->t * sizeof(int)) };
+    int ret = -1;
+
+    if(bits.data != NULL && e.pos != NULL && sample_weight_into(e.pos, 1, p->n, p->t, bits.data, rng) == 0
+       && key_noise_mul_into(nnc, a, &e, scratch) == 0 && key_noise_mul_into(word, y, &e, scratch) == 0)
+        ret = array_xor_into(word, word, msg);
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+int key_decrypt_into(struct key *s, struct arr *nnc, struct arr *word, struct arena *scratch, struct arr *msg) {
+    if(nnc == NULL || word == NULL || word->len != s->params->l)
+        return -1;
+
+    if(key_arr_mul_into(msg, s, nnc, scratch) != 0)
+        return -1;
+
+    return array_xor_into(msg, msg, word);
+}
+
+/* The noise and its dense form or bucket list when encrypting, V^T, S * V^T
+   and the M4RM table when decrypting, the seed block for either */
+size_t key_batch_scratch_size(const struct params *p, int rows) {
+    size_t noise = (size_t)real_dim(p->n) * sizeof(uint64_t) + (size_t)rows * p->t * sizeof(int);
+    size_t sparse = SPARSE_SCRATCH(rows, p->t) * sizeof(uint64_t);
+    size_t dense = arena_mat_size(rows, p->n);
+    size_t seed = SEED_SCRATCH(p->n > p->k ? p->n : p->k) * sizeof(uint64_t);
+    size_t m4rm = 0;
+
+    if(rows >= DECRYPT_M4RM)
+        m4rm = arena_mat_size(p->k, rows) + arena_mat_size(p->l, rows) + M4RM_SCRATCH(rows) * sizeof(uint64_t);
+
+    return 8 * MAT_ALIGN + noise + (sparse > dense ? sparse : dense) + seed + m4rm;
+}
+
+int key_arr_mul_batch_into(struct mat *res, struct key *k, struct mat *v, struct arena *scratch) {
+    if(k->seed == NULL)
+        return mat_arr_mul_batch_into(res, k->m, v);
+
+    size_t mark = arena_mark(scratch);
+    uint64_t *blk = arena_alloc(scratch, SEED_SCRATCH(k->seed->cols) * sizeof(uint64_t));
+    int ret = blk != NULL ? seed_mat_arr_mul_batch_into(res, k->seed, v, blk) : -1;
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+int key_noise_mul_batch_into(struct mat *res, struct key *k, struct sparse_mat *e, struct arena *scratch) {
+    size_t mark = arena_mark(scratch);
+    int ret = -1;
+
+    if(k->m != NULL && k->layout == KEY_COL_MAJOR) {
+        uint64_t *buf = arena_alloc(scratch, SPARSE_SCRATCH(e->rows, e->weight) * sizeof(uint64_t));
+        ret = buf != NULL ? sparse_mat_mul_batch_into(res, k->m, e, buf) : -1;
+    } else {
+        struct mat dense;
+        if(arena_mat(scratch, &dense, e->rows, e->cols) == 0 && sparse_mat_add(&dense, e) != NULL)
+            ret = key_arr_mul_batch_into(res, k, &dense, scratch);
+    }
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+/* S times every row of v. Small batches reuse blocks of S through the
+   matrix-vector kernel; past DECRYPT_M4RM rows, S goes through M4RM against
+   the K x B matrix V^T, one table lookup standing for eight columns. Seeds
+   stay on the block path, M4RM would need S expanded. */
+int key_mat_mul_into(struct mat *res, struct key *k, struct mat *v, struct arena *scratch) {
+    if(v->rows < DECRYPT_M4RM || k->seed != NULL)
+        return key_arr_mul_batch_into(res, k, v, scratch);
+
+    size_t mark = arena_mark(scratch);
+    struct mat vt, prod;
+    uint64_t *table = arena_alloc(scratch, M4RM_SCRATCH(v->rows) * sizeof(uint64_t));
+    int ret = -1;
+
+    if(table != NULL && arena_mat(scratch, &vt, v->cols, v->rows) == 0
+       && arena_mat(scratch, &prod, k->m->rows, v->rows) == 0 && matrix_transpose_into(&vt, v) == 0
+       && matrix_mul_m4rm_into(&prod, k->m, &vt, table) == 0)
+        ret = matrix_transpose_into(res, &prod);
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+/* Draws the noise of the whole batch the way key_encrypt_into does for one
+   message, then passes over each key once. A single message goes to
+   key_encrypt_into, which skips sorting the hits. */
+int key_encrypt_batch_into(struct key *a, struct key *y, struct mat *msg, struct rng *rng, struct arena *scratch,
+                           struct mat *nnc, struct mat *word) {
+    if(msg == NULL || msg->cols != y->params->l || a->params != y->params || nnc->rows != msg->rows
+       || word->rows != msg->rows)
+        return -1;
+
+    if(msg->rows == 1) {
+        struct arr m = { msg->cols, msg->data[0] }, n = { nnc->cols, nnc->data[0] }, w = { word->cols, word->data[0] };
+        return key_encrypt_into(a, y, &m, rng, scratch, &n, &w);
+    }
+
+    const struct params *p = a->params;
+    size_t mark = arena_mark(scratch);
+    struct arr bits = arena_arr(scratch, p->n);
+    struct sparse_mat e = { msg->rows, p->n, p->t, arena_alloc(scratch, (size_t)msg->rows * p->t * sizeof(int)) };
+    int ret = -1;
+
+    if(bits.data != NULL && e.pos != NULL && sample_weight_into(e.pos, e.rows, p->n, p->t, bits.data, rng) == 0
+       && key_noise_mul_batch_into(nnc, a, &e, scratch) == 0 && key_noise_mul_batch_into(word, y, &e, scratch) == 0
+       && matrix_add(word, msg) != NULL)
+        ret = 0;
+
+    arena_release(scratch, mark);
+    return ret;
+}
+
+int key_decrypt_batch_into(struct key *s, struct mat *nnc, struct mat *word, struct arena *scratch, struct mat *msg) {
+    if(nnc == NULL || word == NULL || nnc->rows != word->rows || word->cols != s->params->l || msg->rows != nnc->rows)
+        return -1;
+
+    if(key_mat_mul_into(msg, s, nnc, scratch) != 0 || matrix_add(msg, word) == NULL)
+        return -1;
+
+    return 0;
+}
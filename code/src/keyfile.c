@@ -0,0 +1,388 @@
+#include "../include/keyfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/backend.h"
+#include "../include/cpu.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define HEADER_SIZE 52
+
+// Reflected CRC32C (Castagnoli) polynomial
+#define CRC32C_POLY 0x82F63B78U
+
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    if (!crc_table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_table_ready = 1;
+    }
+
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+
+    while (len--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+
+    return (uint32_t)c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    if (cpu_has_crc32c())
+        return ~crc32c_hw(crc, buf, len);
+#endif
+
+    return ~crc32c_sw(crc, buf, len);
+}
+
+static int host_le(void) {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Payload words are little-endian on disk
+static void swap_words(uint64_t *w, size_t n) {
+    if (host_le())
+        return;
+
+    for (size_t i = 0; i < n; i++)
+        w[i] = __builtin_bswap64(w[i]);
+}
+
+static void encode_header(uint8_t *h, struct key_info *info, uint32_t payload_crc) {
+    memset(h, 0, HEADER_SIZE);
+    memcpy(h, KEY_MAGIC, sizeof(KEY_MAGIC));
+
+    put32(h + 8, KEY_VERSION);
+    put32(h + 12, KEY_PAGE);
+    put32(h + 16, info->rows);
+    put32(h + 20, info->cols);
+    put32(h + 24, info->stride);
+    put32(h + 28, info->layout);
+    put32(h + 32, info->params);
+    put32(h + 36, payload_crc);
+    put64(h + 40, (uint64_t)info->rows * info->stride * sizeof(uint64_t));
+    put32(h + 48, crc32c(0, h, 48));
+}
+
+/* Validates a header and fills info, the payload offset, size and CRC */
+static int decode_header(const uint8_t *h, struct key_info *info, size_t *offset, size_t *size, uint32_t *payload_crc) {
+    if (memcmp(h, KEY_MAGIC, sizeof(KEY_MAGIC)) != 0 || get32(h + 8) != KEY_VERSION)
+        return -1;
+
+    if (get32(h + 48) != crc32c(0, h, 48))
+        return -1;
+
+    info->rows = (int)get32(h + 16);
+    info->cols = (int)get32(h + 20);
+    info->stride = (int)get32(h + 24);
+    info->layout = (int)get32(h + 28);
+    info->params = (int)get32(h + 32);
+
+    *offset = get32(h + 12);
+    *size = get64(h + 40);
+    *payload_crc = get32(h + 36);
+
+    if (info->rows <= 0 || info->cols <= 0 || info->stride < real_dim(info->cols))
+        return -1;
+
+    if (*offset < HEADER_SIZE || *offset % KEY_PAGE != 0)
+        return -1;
+
+    if (*size != (size_t)info->rows * info->stride * sizeof(uint64_t))
+        return -1;
+
+    return 0;
+}
+
+int is_key_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    char magic[sizeof(KEY_MAGIC)];
+    int res = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, KEY_MAGIC, sizeof(magic)) == 0;
+
+    fclose(file);
+    return res;
+}
+
+/* The file is sized up front and filled through a shared mapping, so the
+   payload goes straight into the page cache. It is built under a temporary
+   name and renamed over path, so processes still mapping the old key keep
+   a consistent copy. */
+int write_key_file(const char *path, struct mat *m, int layout, int params) {
+    if (m == NULL)
+        return -1;
+
+    struct key_info info = { m->rows, m->cols, row_stride(m->cols), layout, params };
+    size_t words = (size_t)info.rows * info.stride;
+    size_t len = KEY_PAGE + words * sizeof(uint64_t);
+
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL)
+        return -1;
+    sprintf(tmp, "%s.tmp", path);
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+
+    uint8_t *map = MAP_FAILED;
+    if (ftruncate(fd, len) == 0)
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    uint64_t *payload = (uint64_t *)(map + KEY_PAGE);
+
+    for (int i = 0; i < m->rows; i++)
+        memcpy(payload + (size_t)i * info.stride, m->data[i], real_dim(m->cols) * sizeof(uint64_t));
+
+    swap_words(payload, words);
+    encode_header(map, &info, crc32c(0, payload, words * sizeof(uint64_t)));
+
+    munmap(map, len);
+
+    int res = rename(tmp, path);
+    if (res != 0)
+        unlink(tmp);
+
+    free(tmp);
+    return res == 0 ? 0 : -1;
+}
+
+int read_key_info(const char *path, struct key_info *info) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+
+    uint8_t h[HEADER_SIZE];
+    size_t offset, size;
+    uint32_t payload_crc;
+
+    int ret = fread(h, 1, HEADER_SIZE, file) == HEADER_SIZE ? decode_header(h, info, &offset, &size, &payload_crc) : -1;
+
+    fclose(file);
+    return ret;
+}
+
+struct mat *read_key_file(const char *path, struct key_info *info) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    uint8_t h[HEADER_SIZE];
+    struct key_info ki;
+    size_t offset, size;
+    uint32_t payload_crc;
+
+    if (fread(h, 1, HEADER_SIZE, file) != HEADER_SIZE || decode_header(h, &ki, &offset, &size, &payload_crc) != 0
+        || fseek(file, offset, SEEK_SET) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    struct mat *m = new_mat(ki.rows, ki.cols);
+    if (m == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t crc = 0;
+    int ok = 1;
+
+    if (m->stride == ki.stride) {
+        ok = fread(m->buf, 1, size, file) == size;
+        crc = crc32c(0, m->buf, size);
+    } else {
+        // Stored with another alignment: repack row by row
+        uint64_t *row = malloc(ki.stride * sizeof(uint64_t));
+        ok = row != NULL;
+
+        for (int i = 0; ok && i < ki.rows; i++) {
+            ok = fread(row, sizeof(uint64_t), ki.stride, file) == (size_t)ki.stride;
+            crc = crc32c(crc, row, ki.stride * sizeof(uint64_t));
+            memcpy(m->data[i], row, real_dim(ki.cols) * sizeof(uint64_t));
+        }
+
+        free(row);
+    }
+
+    fclose(file);
+
+    if (!ok || crc != payload_crc) {
+        free_mat(m);
+        return NULL;
+    }
+
+    for (int i = 0; i < m->rows; i++)
+        swap_words(m->data[i], real_dim(m->cols));
+
+    if (info != NULL)
+        *info = ki;
+
+    return m;
+}
+
+/* Zero-copy view of a container. Only the header and the bounds of the
+   payload are checked, so mapping touches no page of the payload and a
+   caller reads just the rows it needs; verify_key_file checks the rest.
+   Only possible on little-endian hosts. */
+struct mat *map_key_file(const char *path, struct key_info *info) {
+    if (!host_le())
+        return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct key_info ki;
+    size_t offset, size;
+    uint32_t payload_crc;
+
+    if (decode_header(map, &ki, &offset, &size, &payload_crc) != 0 || offset + size > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct mat *m = mat_view((uint64_t *)(map + offset), ki.rows, ki.cols, ki.stride);
+    if (m == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    m->map = map;
+    m->map_len = st.st_size;
+
+    if (info != NULL)
+        *info = ki;
+
+    return m;
+}
+
+/* The payload CRC of a container, read through in chunks without keeping
+   the key. Returns 0 if it matches */
+int verify_key_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+
+    uint8_t h[HEADER_SIZE];
+    struct key_info ki;
+    size_t offset, size;
+    uint32_t payload_crc, crc = 0;
+    uint8_t *buf = malloc(KEY_PAGE * 16);
+
+    int ok = buf != NULL && fread(h, 1, HEADER_SIZE, file) == HEADER_SIZE
+             && decode_header(h, &ki, &offset, &size, &payload_crc) == 0 && fseek(file, offset, SEEK_SET) == 0;
+
+    while (ok && size > 0) {
+        size_t n = size < KEY_PAGE * 16 ? size : KEY_PAGE * 16;
+        ok = fread(buf, 1, n, file) == n;
+        crc = crc32c(crc, buf, n);
+        size -= n;
+    }
+
+    free(buf);
+    fclose(file);
+    return ok && crc == payload_crc ? 0 : -1;
+}
+
+/* Rewrites a key from the headerless format. Its set is the one its shape
+   belongs to, whatever the active one, as load_key tells it for legacy
+   keys; within the set a column-major copy (N rows) is told from a key
+   (N columns). Fails for a shape of no set. */
+int convert_key_file(const char *legacy_path, const char *path) {
+    struct mat *m = read_key(legacy_path);
+    if (m == NULL)
+        return -1;
+
+    const struct params *p = params_by_shape(m->rows, m->cols);
+    if (p == NULL) {
+        free_mat(m);
+        return -1;
+    }
+
+    int layout = m->rows == p->n && m->cols != p->n ? KEY_COL_MAJOR : KEY_ROW_MAJOR;
+    int res = write_key_file(path, m, layout, p->id);
+
+    free_mat(m);
+    return res;
+}
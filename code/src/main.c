@@ -5,14 +5,25 @@
 #include <string.h>
 
 #include "../include/test.h"
+#include "../include/bench.h"
+#include "../include/difftest.h"
 #include "../include/api.h"
+#include "../include/backend.h"
+#include "../include/kernels.h"
+#include "../include/key.h"
+#include "../include/keyfile.h"
+#include "../include/params.h"
+#include "../include/server.h"
+#include "../include/stream.h"
 
 //Command enumeration
-typedef enum { GENERATE, ENCRYPT, DECRYPT, CORRECT, TEST, INVALID } Command;
+typedef enum { GENERATE, ENCRYPT, ENCRYPT_BATCH, ENCRYPT_STREAM, DECRYPT, DECRYPT_BATCH, DECRYPT_STREAM, CORRECT, SERVE, STATS, CONVERT, CHECK, TEST, BENCH, DIFFTEST, INVALID } Command;
 
 Command get_command(const char *);
 void print_err(const char *, const char *);
 int set_paths(const char *);
+int take_params(int *, char **);
+const char *key_arg(Command, int, char **);
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
@@ -20,23 +31,127 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    select_kernels();
+
     Command cmd = get_command(argv[1]);
 
+    // Without --params, commands working on keys take the set of their key
+    int given = take_params(&argc, argv);
+    if (given < 0)
+        return 2;
+    if (given == 0 && key_arg(cmd, argc, argv) != NULL) {
+        const struct params *p = key_params(key_arg(cmd, argc, argv));
+        if (p == NULL) {
+            fprintf(stderr, "Failed to tell the parameter set of %s\n", key_arg(cmd, argc, argv));
+            return 4;
+        }
+        select_params(p);
+    }
+
     switch(cmd) {
         case TEST:
             test(argc > 2 ? atoi(argv[2]) : 0);
             break;
 
-        case GENERATE:
-            generate_key();
+        case BENCH: {
+            int reps = BENCH_REPS, warmup = BENCH_WARMUP, bad = 0, first = argc;
+            const char *json = NULL;
+
+            // Options first, then the stages to run, all of them if none
+            for (int i = 2; i < argc && first == argc && !bad; i++) {
+                if (strcmp(argv[i], "--list") == 0) {
+                    bench_list();
+                    return 0;
+                } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+                    reps = atoi(argv[++i]);
+                } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+                    warmup = atoi(argv[++i]);
+                } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+                    json = argv[++i];
+                } else if (strncmp(argv[i], "--", 2) == 0) {
+                    bad = 1;
+                } else {
+                    first = i;
+                }
+            }
+            if (bad) {
+                print_err(argv[0], "bench [--reps <n>] [--warmup <n>] [--json <path|->] [--list] [<stage>...]\n");
+                return 2;
+            }
+            if (bench(reps, warmup, first < argc ? (const char *const *)argv + first : NULL, argc - first, json) != 0) {
+                fprintf(stderr, "Failed to run the benchmark\n");
+                return 4;
+            }
             break;
+        }
+
+        case DIFFTEST: {
+            struct diff_config cfg = { DIFF_ROUNDS, 1, DIFF_BASELINE, 0, DIFF_THRESHOLD };
+
+            for (int i = 2; i < argc; i++) {
+                if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+                    cfg.rounds = atoi(argv[++i]);
+                } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                    cfg.seed = strtoull(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+                    cfg.baseline = argv[++i];
+                } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+                    cfg.threshold = atof(argv[++i]);
+                } else if (strcmp(argv[i], "--update") == 0) {
+                    cfg.update = 1;
+                } else if (strcmp(argv[i], "--no-timing") == 0) {
+                    cfg.baseline = NULL;
+                } else {
+                    print_err(argv[0], "difftest [--rounds <n>] [--seed <n>] [--baseline <path>] [--threshold <pct>] "
+                                       "[--update] [--no-timing]\n");
+                    return 2;
+                }
+            }
+            if (difftest(&cfg) != 0) {
+                fprintf(stderr, "Differential test failed\n");
+                return 4;
+            }
+            break;
+        }
+
+        case GENERATE: {
+            int seeded = 0;
+
+            for (int i = 2; i < argc; i++) {
+                if (strcmp(argv[i], "seeded") == 0) {
+                    seeded = 1;
+                } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                    set_threads(atoi(argv[++i]));
+                } else {
+                    print_err(argv[0], "generate [seeded] [--threads <n>]\n");
+                    return 2;
+                }
+            }
+
+            if ((seeded ? generate_seeded_key(active_params) : generate_key(active_params)) != 0) {
+                fprintf(stderr, "Failed to generate the keys\n");
+                return 4;
+            }
+            break;
+        }
 
         case ENCRYPT:
             if (argc < 4) {
                 print_err(argv[0], "encrypt <message> <key_a_path> <key_y_path>\n");
                 return 2;
             }
-            encrypt(argv[2], argv[3], argv[4]);
+            encrypt(argv[2], argv[3], argv[4], NULL);
+            break;
+
+        case ENCRYPT_BATCH:
+            if (argc < 5) {
+                print_err(argv[0], "encrypt-batch <key_a_path> <key_y_path> <message> [<message> ...]\n");
+                return 2;
+            }
+            if (encrypt_batch((const char *const *)argv + 4, argc - 4, argv[2], argv[3], NULL) != 0) {
+                fprintf(stderr, "Failed to encrypt the batch\n");
+                return 4;
+            }
             break;
 
         case DECRYPT:
@@ -47,14 +162,170 @@ int main(int argc, char *argv[]) {
             decrypt(argv[2], argv[3], argv[4]);
             break;
 
-        case CORRECT:
-            if (argc < 4) {
+        case DECRYPT_BATCH: {
+            if (argc < 5 || (argc - 3) % 2 != 0) {
+                print_err(argv[0], "decrypt-batch <key_path> <nnc_path> <word_path> [<nnc_path> <word_path> ...]\n");
+                return 2;
+            }
+
+            int count = (argc - 3) / 2;
+            const char **fnnc = malloc(count * sizeof(char *));
+            const char **fword = malloc(count * sizeof(char *));
+            if (fnnc == NULL || fword == NULL)
+                return 4;
+
+            for (int i = 0; i < count; i++) {
+                fnnc[i] = argv[3 + 2 * i];
+                fword[i] = argv[4 + 2 * i];
+            }
+
+            int ret = decrypt_batch(fnnc, fword, count, argv[2]);
+            free(fnnc);
+            free(fword);
+            if (ret != 0) {
+                fprintf(stderr, "Failed to decrypt the batch\n");
+                return 4;
+            }
+            break;
+        }
+
+        case ENCRYPT_STREAM:
+        case DECRYPT_STREAM: {
+            int keys = cmd == ENCRYPT_STREAM ? 2 : 1;
+            int threads = 0;
+
+            if (argc == 6 + keys && strcmp(argv[argc - 2], "--threads") == 0) {
+                threads = atoi(argv[argc - 1]);
+                argc -= 2;
+            }
+            if (argc != 4 + keys) {
+                print_err(argv[0], cmd == ENCRYPT_STREAM
+                          ? "encrypt-stream <input|-> <output|-> <key_a_path> <key_y_path> [--threads <n>]\n"
+                          : "decrypt-stream <input|-> <output|-> <key_path> [--threads <n>]\n");
+                return 2;
+            }
+
+            FILE *in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "rb");
+            FILE *out = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+            if (in == NULL || out == NULL) {
+                fprintf(stderr, "Failed to open %s\n", in == NULL ? argv[2] : argv[3]);
+                return 4;
+            }
+
+            int ret = cmd == ENCRYPT_STREAM
+                      ? encrypt_stream(in, out, argv[4], argv[5], threads)
+                      : decrypt_stream(in, out, argv[4], threads);
+
+            if (in != stdin)
+                fclose(in);
+            if (out != stdout && fclose(out) != 0)
+                ret = -1;
+
+            if (ret != 0) {
+                fprintf(stderr, "Failed to %s the stream\n", cmd == ENCRYPT_STREAM ? "encrypt" : "decrypt");
+                return 4;
+            }
+            break;
+        }
+
+        case CORRECT: {
+            if (argc < 5) {
                 print_err(argv[0], "correct <input_path> <input_path> <input_path> ...\n");
                 return 2;
             }
-            correct(argv[2], argv[3], argv[4]);
+
+            // Without --params, the set whose messages have the length of the first copy
+            const struct params *p = active_params;
+            struct arr *first = given == 0 ? read_packet(argv[2]) : NULL;
+            if (first != NULL) {
+                int count;
+                const struct params *sets = params_list(&count);
+                for (int i = 0; i < count; i++) {
+                    if (sets[i].l == first->len)
+                        p = &sets[i];
+                }
+                free_arr(first);
+            }
+
+            correct(p, argv[2], argv[3], argv[4]);
+            break;
+        }
+
+        case SERVE: {
+            int threads = 0, keys = 3;
+            struct mask_config masks = { 0, -1, 0 };
+
+            // Key paths three per set, then options in pairs
+            while (keys < argc && strncmp(argv[keys], "--", 2) != 0)
+                keys++;
+            int bad = keys == 3 || (keys - 3) % 3 != 0;
+
+            for (int i = keys; i < argc && !bad; i += 2) {
+                if (i + 1 >= argc)
+                    bad = 1;
+                else if (strcmp(argv[i], "--threads") == 0)
+                    threads = atoi(argv[i + 1]);
+                else if (strcmp(argv[i], "--masks") == 0)
+                    masks.capacity = atoi(argv[i + 1]);
+                else if (strcmp(argv[i], "--low-water") == 0)
+                    masks.low_water = atoi(argv[i + 1]);
+                else if (strcmp(argv[i], "--refill-rate") == 0)
+                    masks.rate = atof(argv[i + 1]);
+                else
+                    bad = 1;
+            }
+            if (bad) {
+                print_err(argv[0], "serve <socket_path> <key_a_path|-> <key_y_path|-> <key_s_path|-> "
+                                   "[<key_a_path|-> <key_y_path|-> <key_s_path|-> ...] [--threads <n>] "
+                                   "[--masks <n> [--low-water <n>] [--refill-rate <masks/s>]]\n");
+                return 2;
+            }
+            if (serve(argv[2], (const char *const *)argv + 3, (keys - 3) / 3, threads,
+                      masks.capacity > 0 ? &masks : NULL) != 0) {
+                fprintf(stderr, "Failed to serve on %s\n", argv[2]);
+                return 4;
+            }
+            break;
+        }
+
+        case STATS:
+            if (argc < 3) {
+                print_err(argv[0], "stats <socket_path>\n");
+                return 2;
+            }
+            if (serve_stats(argv[2]) != 0) {
+                fprintf(stderr, "Failed to query %s\n", argv[2]);
+                return 4;
+            }
+            break;
+
+        case CONVERT:
+            if (argc < 4) {
+                print_err(argv[0], "convert <legacy_key_path> <output_path>\n");
+                return 2;
+            }
+            if (convert_key_file(argv[2], argv[3]) != 0) {
+                fprintf(stderr, "Failed to convert %s\n", argv[2]);
+                return 4;
+            }
             break;
 
+        case CHECK: {
+            if (argc < 3) {
+                print_err(argv[0], "check <key_path>...\n");
+                return 2;
+            }
+            int bad = 0;
+            for (int i = 2; i < argc; i++) {
+                int ok = verify_key_file(argv[i]) == 0;
+                printf("%s: %s\n", argv[i], ok ? "OK" : "corrupt or not a key container");
+                bad += !ok;
+            }
+            if (bad > 0)
+                return 4;
+            break;
+        }
+
         default:
             printf("Invalid command: %s\n", argv[1]);
             return 3;
@@ -63,6 +334,58 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+/* Takes "--params <name>" out of argv and selects that set. Returns 1 if
+   it was there, 0 if not and -1 for an unknown name. */
+int take_params(int *argc, char **argv) {
+    for (int i = 2; i < *argc; i++) {
+        if (strcmp(argv[i], "--params") != 0)
+            continue;
+
+        const struct params *p = i + 1 < *argc ? params_by_name(argv[i + 1]) : NULL;
+        if (p == NULL) {
+            int count;
+            const struct params *sets = params_list(&count);
+
+            fprintf(stderr, "Unknown parameter set, one of:\n");
+            for (int j = 0; j < count; j++)
+                fprintf(stderr, "  %-10s L=%d K=%d N=%d T=%d\n", sets[j].name, sets[j].l, sets[j].k, sets[j].n, sets[j].t);
+            return -1;
+        }
+
+        select_params(p);
+        for (int j = i; j + 2 <= *argc; j++)
+            argv[j] = argv[j + 2];
+        *argc -= 2;
+        return 1;
+    }
+
+    return 0;
+}
+
+// First key path of a command, NULL for the commands without keys
+const char *key_arg(Command cmd, int argc, char **argv) {
+    switch(cmd) {
+        case ENCRYPT:
+            return argc > 3 ? argv[3] : NULL;
+        case DECRYPT:
+            return argc > 4 ? argv[4] : NULL;
+        case ENCRYPT_BATCH:
+        case DECRYPT_BATCH:
+            return argc > 2 ? argv[2] : NULL;
+        case ENCRYPT_STREAM:
+        case DECRYPT_STREAM:
+            return argc > 4 ? argv[4] : NULL;
+        case SERVE:
+            for (int i = 3; i < 6 && i < argc; i++) {
+                if (strcmp(argv[i], "-") != 0)
+                    return argv[i];
+            }
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
 void print_err(const char* name, const char* msg) {
     fprintf(stderr, "Usage: %s %s", name, msg);
 }
@@ -70,13 +393,33 @@ void print_err(const char* name, const char* msg) {
 Command get_command(const char* command) {
     if (strcmp(command, "test") == 0)
         return TEST;
+    if (strcmp(command, "bench") == 0)
+        return BENCH;
+    if (strcmp(command, "difftest") == 0)
+        return DIFFTEST;
     if (strcmp(command, "generate") == 0)
         return GENERATE;
     if (strcmp(command, "encrypt") == 0)
         return ENCRYPT;
+    if (strcmp(command, "encrypt-batch") == 0)
+        return ENCRYPT_BATCH;
+    if (strcmp(command, "encrypt-stream") == 0)
+        return ENCRYPT_STREAM;
     if (strcmp(command, "decrypt") == 0)
         return DECRYPT;
+    if (strcmp(command, "decrypt-batch") == 0)
+        return DECRYPT_BATCH;
+    if (strcmp(command, "decrypt-stream") == 0)
+        return DECRYPT_STREAM;
     if (strcmp(command, "correct") == 0)
         return CORRECT;
+    if (strcmp(command, "serve") == 0)
+        return SERVE;
+    if (strcmp(command, "stats") == 0)
+        return STATS;
+    if (strcmp(command, "convert") == 0)
+        return CONVERT;
+    if (strcmp(command, "check") == 0)
+        return CHECK;
     return INVALID;
 }
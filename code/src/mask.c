@@ -0,0 +1,271 @@
+#include "../include/mask.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/backend.h"
+#include "../include/seed.h"
+
+struct mask_pool {
+    struct key *a;
+    struct key *y;
+    struct mask_config cfg;
+    struct rng rng;
+
+    // Ring of masks, the fill rows from head on are ready
+    struct mat *nnc;
+    struct mat *word;
+    int head;
+    int fill;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refilled;
+    double busy;
+    struct timespec started;
+    int fill_min;
+};
+
+static double seconds_since(struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// n fresh masks, drawn from rng
+static int compute_masks(struct mask_pool *p, int n, struct rng *rng, struct mat **nnc, struct mat **word) {
+    struct sparse_mat *e = weight_sparse_mat(n, p->a->params->n, p->a->params->t, rng);
+
+    *nnc = e != NULL ? key_noise_mul_batch(p->a, e) : NULL;
+    *word = e != NULL ? key_noise_mul_batch(p->y, e) : NULL;
+
+    free_sparse_mat(e);
+
+    if (*nnc == NULL || *word == NULL) {
+        free_mat(*nnc);
+        free_mat(*word);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void copy_rows(struct mat *dst, int d, struct mat *src, int s, int n) {
+    for (int i = 0; i < n; i++)
+        memcpy(dst->data[d + i], src->data[s + i], real_dim(src->cols) * sizeof(uint64_t));
+}
+
+/* Waits for the fill to drop to the low-water mark, then tops the ring up
+   one MASK_BATCH at a time. The ring is only filled here, so the free rows
+   found before computing a batch are still free after. */
+static void *refill(void *arg) {
+    struct mask_pool *p = arg;
+    int refilling = 1;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        if (!refilling && p->fill > p->cfg.low_water) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+
+        int room = p->cfg.capacity - p->fill;
+        if (room == 0) {
+            refilling = 0;
+            continue;
+        }
+        refilling = 1;
+
+        int n = room < MASK_BATCH ? room : MASK_BATCH;
+        pthread_mutex_unlock(&p->lock);
+
+        struct timespec t0;
+        struct mat *nnc, *word;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int ret = compute_masks(p, n, &p->rng, &nnc, &word);
+        double took = seconds_since(&t0);
+
+        // On failure every later request is computed on the spot
+        pthread_mutex_lock(&p->lock);
+        if (ret != 0)
+            break;
+
+        // Filled from the slot after the last ready one, wrapping at most once
+        int tail = (p->head + p->fill) % p->cfg.capacity;
+        int first = n < p->cfg.capacity - tail ? n : p->cfg.capacity - tail;
+        copy_rows(p->nnc, tail, nnc, 0, first);
+        copy_rows(p->word, tail, word, 0, first);
+        copy_rows(p->nnc, 0, nnc, first, n - first);
+        copy_rows(p->word, 0, word, first, n - first);
+
+        p->fill += n;
+        p->refilled += n;
+        p->busy += took;
+
+        // Full again: idle until a take brings the fill down to low water
+        if (p->fill == p->cfg.capacity)
+            refilling = 0;
+        pthread_mutex_unlock(&p->lock);
+
+        free_mat(nnc);
+        free_mat(word);
+
+        /* Sleeps off whatever the batch took below its share of the rate,
+           on the condition so that mask_pool_free cuts the pause short */
+        double pause = p->cfg.rate > 0 ? n / p->cfg.rate - took : 0;
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t)pause;
+        until.tv_nsec += (long)((pause - (time_t)pause) * 1e9);
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (pause > 0 && !p->stop && pthread_cond_timedwait(&p->cond, &p->lock, &until) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+struct mask_pool *mask_pool_new(struct key *a, struct key *y, const struct mask_config *cfg) {
+    if (a == NULL || y == NULL || cfg == NULL || cfg->capacity <= 0 || cfg->rate < 0 || a->params != y->params)
+        return NULL;
+
+    struct mask_pool *p = calloc(1, sizeof(struct mask_pool));
+    if (p == NULL)
+        return NULL;
+
+    p->a = a;
+    p->y = y;
+    p->cfg = *cfg;
+    if (p->cfg.low_water < 0 || p->cfg.low_water >= p->cfg.capacity)
+        p->cfg.low_water = p->cfg.capacity / 2;
+    p->fill_min = p->cfg.capacity;
+    clock_gettime(CLOCK_MONOTONIC, &p->started);
+    rng_seed(&p->rng);
+
+    p->nnc = new_mat(p->cfg.capacity, a->params->k);
+    p->word = new_mat(p->cfg.capacity, a->params->l);
+    if (p->nnc == NULL || p->word == NULL) {
+        free_mat(p->nnc);
+        free_mat(p->word);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if (pthread_create(&p->thread, NULL, refill, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        free_mat(p->nnc);
+        free_mat(p->word);
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+void mask_pool_free(struct mask_pool *p) {
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free_mat(p->nnc);
+    free_mat(p->word);
+    free(p);
+}
+
+int mask_encrypt(struct mask_pool *p, struct mat *msg, struct mat **nnc, struct mat **word) {
+    struct arena scratch;
+    int ret = -1;
+
+    if (msg == NULL)
+        return -1;
+
+    *nnc = new_mat(msg->rows, p->nnc->cols);
+    *word = new_mat(msg->rows, p->word->cols);
+
+    if (*nnc != NULL && *word != NULL
+        && arena_init(&scratch, key_batch_scratch_size(p->a->params, msg->rows)) == 0) {
+        ret = mask_encrypt_batch_into(p, msg, &scratch, *nnc, *word);
+        arena_free(&scratch);
+    }
+
+    if (ret != 0) {
+        free_mat(*nnc);
+        free_mat(*word);
+    }
+    return ret;
+}
+
+int mask_encrypt_batch_into(struct mask_pool *p, struct mat *msg, struct arena *scratch, struct mat *nnc,
+                            struct mat *word) {
+    if (msg == NULL || msg->cols != p->word->cols || nnc->rows != msg->rows || word->rows != msg->rows)
+        return -1;
+
+    pthread_mutex_lock(&p->lock);
+    int taken = p->fill < msg->rows ? p->fill : msg->rows;
+    for (int i = 0; i < taken; i++) {
+        int slot = (p->head + i) % p->cfg.capacity;
+        copy_rows(nnc, i, p->nnc, slot, 1);
+        copy_rows(word, i, p->word, slot, 1);
+    }
+
+    p->head = (p->head + taken) % p->cfg.capacity;
+    p->fill -= taken;
+    p->hits += taken;
+    p->misses += msg->rows - taken;
+    if (p->fill < p->fill_min)
+        p->fill_min = p->fill;
+    if (p->fill <= p->cfg.low_water)
+        pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    // The misses go through the keys as one batch of their own
+    int miss = msg->rows - taken;
+    struct mat m = mat_slice(msg, taken, miss, msg->cols);
+    struct mat n = mat_slice(nnc, taken, miss, nnc->cols), w = mat_slice(word, taken, miss, word->cols);
+    if (miss > 0 && key_encrypt_batch_into(p->a, p->y, &m, NULL, scratch, &n, &w) != 0)
+        return -1;
+
+    m = mat_slice(msg, 0, taken, msg->cols);
+    w = mat_slice(word, 0, taken, word->cols);
+    return matrix_add(&w, &m) != NULL ? 0 : -1;
+}
+
+void mask_pool_stats(struct mask_pool *p, struct mask_stats *st) {
+    pthread_mutex_lock(&p->lock);
+    st->capacity = p->cfg.capacity;
+    st->low_water = p->cfg.low_water;
+    st->fill = p->fill;
+    st->fill_min = p->fill_min;
+    st->hits = p->hits;
+    st->misses = p->misses;
+    st->refilled = p->refilled;
+    double up = seconds_since(&p->started);
+    st->refill_rate = up > 0 ? p->refilled / up : 0.0;
+    st->compute_rate = p->busy > 0 ? p->refilled / p->busy : 0.0;
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,202 @@
+#include "../include/packet.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+static int host_le(void) {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void swap_le(uint64_t *w, size_t n) {
+    if (host_le())
+        return;
+
+    for (size_t i = 0; i < n; i++)
+        w[i] = __builtin_bswap64(w[i]);
+}
+
+size_t packet_size(int len) {
+    return PACKET_HEADER + (size_t)real_dim(len) * sizeof(uint64_t);
+}
+
+size_t cipher_size(int nnc_len, int word_len) {
+    return packet_size(nnc_len) + packet_size(word_len);
+}
+
+size_t packet_encode(const struct arr *a, void *buf, size_t size) {
+    if (a == NULL || a->data == NULL || a->len < 0 || size < packet_size(a->len))
+        return 0;
+
+    size_t words = (size_t)real_dim(a->len);
+    uint8_t *p = buf;
+    put32(p, (uint32_t)a->len);
+    memcpy(p + PACKET_HEADER, a->data, words * sizeof(uint64_t));
+    swap_le((uint64_t *)(p + PACKET_HEADER), words);
+
+    return packet_size(a->len);
+}
+
+int packet_peek(const void *buf, size_t size) {
+    if (size < PACKET_HEADER)
+        return -1;
+
+    uint32_t len = get32(buf);
+    return len > INT_MAX ? -1 : (int)len;
+}
+
+size_t packet_decode(struct arr *a, const void *buf, size_t size) {
+    int len = packet_peek(buf, size);
+
+    if (a == NULL || a->data == NULL || len < 0 || real_dim(len) > real_dim(a->len) || size < packet_size(len))
+        return 0;
+
+    a->len = len;
+    memcpy(a->data, (const uint8_t *)buf + PACKET_HEADER, (size_t)real_dim(len) * sizeof(uint64_t));
+    swap_le(a->data, real_dim(len));
+
+    return packet_size(len);
+}
+
+size_t cipher_encode(const struct arr *nnc, const struct arr *word, void *buf, size_t size) {
+    size_t n = packet_encode(nnc, buf, size);
+    size_t w = n > 0 ? packet_encode(word, (unsigned char *)buf + n, size - n) : 0;
+
+    return w > 0 ? n + w : 0;
+}
+
+size_t cipher_decode(struct arr *nnc, struct arr *word, const void *buf, size_t size) {
+    size_t n = packet_decode(nnc, buf, size);
+    size_t w = n > 0 ? packet_decode(word, (const unsigned char *)buf + n, size - n) : 0;
+
+    return w > 0 ? n + w : 0;
+}
+
+// Drops done bytes from the front of the iovec list
+static void advance(struct iovec **iov, int *n, size_t done) {
+    while (*n > 0 && done >= (*iov)->iov_len) {
+        done -= (*iov)->iov_len;
+        (*iov)++;
+        (*n)--;
+    }
+
+    if (*n > 0) {
+        (*iov)->iov_base = (unsigned char *)(*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
+    }
+}
+
+/* Sockets are told apart once, up front: they go through sendmsg for
+   MSG_NOSIGNAL, anything else through writev */
+int write_iov(int fd, struct iovec *iov, int n) {
+    struct stat st;
+    int sock = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+
+    for (advance(&iov, &n, 0); n > 0;) {
+        ssize_t put;
+
+        if (sock) {
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+            put = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        } else {
+            put = writev(fd, iov, n);
+        }
+
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return -1;
+        advance(&iov, &n, put);
+    }
+
+    return 0;
+}
+
+int read_iov(int fd, struct iovec *iov, int n) {
+    for (advance(&iov, &n, 0); n > 0;) {
+        ssize_t got = readv(fd, iov, n);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        advance(&iov, &n, got);
+    }
+
+    return 0;
+}
+
+/* The words go out of a as they are on little-endian hosts. Big-endian
+   ones swap them in place for the call and back, leaving a unchanged. */
+int packets_writev(int fd, const struct arr *a, int count) {
+    struct iovec iov[2 * PACKET_CHUNK];
+    uint8_t len[PACKET_CHUNK][PACKET_HEADER];
+
+    for (int i0 = 0; i0 < count; i0 += PACKET_CHUNK) {
+        int n = count - i0 < PACKET_CHUNK ? count - i0 : PACKET_CHUNK;
+
+        for (int i = 0; i < n; i++) {
+            const struct arr *p = &a[i0 + i];
+            if (p->data == NULL || p->len < 0)
+                return -1;
+
+            put32(len[i], (uint32_t)p->len);
+            iov[2 * i] = (struct iovec){ len[i], PACKET_HEADER };
+            iov[2 * i + 1] = (struct iovec){ p->data, (size_t)real_dim(p->len) * sizeof(uint64_t) };
+        }
+
+        for (int i = 0; i < n; i++)
+            swap_le(a[i0 + i].data, real_dim(a[i0 + i].len));
+        int ret = write_iov(fd, iov, 2 * n);
+        for (int i = 0; i < n; i++)
+            swap_le(a[i0 + i].data, real_dim(a[i0 + i].len));
+
+        if (ret != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int packets_readv(int fd, struct arr *a, int count) {
+    struct iovec iov[2 * PACKET_CHUNK];
+    uint8_t len[PACKET_CHUNK][PACKET_HEADER];
+
+    for (int i0 = 0; i0 < count; i0 += PACKET_CHUNK) {
+        int n = count - i0 < PACKET_CHUNK ? count - i0 : PACKET_CHUNK;
+
+        for (int i = 0; i < n; i++) {
+            struct arr *p = &a[i0 + i];
+            if (p->data == NULL || p->len < 0)
+                return -1;
+
+            iov[2 * i] = (struct iovec){ len[i], PACKET_HEADER };
+            iov[2 * i + 1] = (struct iovec){ p->data, (size_t)real_dim(p->len) * sizeof(uint64_t) };
+        }
+
+        if (read_iov(fd, iov, 2 * n) != 0)
+            return -1;
+
+        for (int i = 0; i < n; i++) {
+            if (get32(len[i]) != (uint32_t)a[i0 + i].len)
+                return -1;
+            swap_le(a[i0 + i].data, real_dim(a[i0 + i].len));
+        }
+    }
+
+    return 0;
+}
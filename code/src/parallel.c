@@ -0,0 +1,144 @@
+#include "../include/parallel.h"
+
+#include <stdlib.h>
+
+#include "../include/xoshiro.h"
+
+/* One context per task, each 2^192 draws past the previous one, leaving
+   room for the jump()-separated lanes of rand_rows inside every task. rng
+   ends up past the last task, where the next matrix starts. */
+static struct rng *task_states(struct rng *rng, int tasks) {
+    struct rng *st = malloc((size_t)tasks * sizeof(*st));
+    if (st == NULL)
+        return NULL;
+
+    for (int t = 0; t < tasks; t++) {
+        st[t] = *rng;
+        rng_long_jump(rng);
+    }
+
+    return st;
+}
+
+struct row_job {
+    struct mat *m;
+    struct sparse_mat *e;
+    struct rng *st;
+    int failed;
+};
+
+static void rand_task(void *ctx, int task, int worker) {
+    struct row_job *job = ctx;
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < job->m->rows ? begin + ROW_BLOCK : job->m->rows;
+
+    (void)worker;
+    rand_rows(job->m, begin, end, &job->st[task]);
+}
+
+static void sparse_task(void *ctx, int task, int worker) {
+    struct row_job *job = ctx;
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < job->e->rows ? begin + ROW_BLOCK : job->e->rows;
+
+    (void)worker;
+    if (sparse_rows(job->e, begin, end, &job->st[task]) != 0)
+        job->failed = 1;
+}
+
+struct mat *rand_mat_mt(int rows, int cols, struct pool *pool, struct rng *rng) {
+    struct mat *m = new_mat(rows, cols);
+    if (m == NULL)
+        return NULL;
+
+    int tasks = (rows + ROW_BLOCK - 1) / ROW_BLOCK;
+    struct row_job job = { m, NULL, task_states(rng, tasks), 0 };
+    if (job.st == NULL) {
+        free_mat(m);
+        return NULL;
+    }
+
+    pool_run(pool, rand_task, &job, tasks);
+
+    free(job.st);
+    return m;
+}
+
+struct sparse_mat *weight_sparse_mat_mt(int rows, int cols, int weight, struct pool *pool, struct rng *rng) {
+    if (rows <= 0 || cols <= 0 || weight <= 0 || weight > cols)
+        return NULL;
+
+    struct sparse_mat *e = calloc(1, sizeof(struct sparse_mat));
+    if (e == NULL)
+        return NULL;
+
+    e->rows = rows;
+    e->cols = cols;
+    e->weight = weight;
+    e->pos = calloc((size_t)rows * weight, sizeof(int));
+
+    int tasks = (rows + ROW_BLOCK - 1) / ROW_BLOCK;
+    struct row_job job = { NULL, e, e->pos != NULL ? task_states(rng, tasks) : NULL, 0 };
+    if (job.st == NULL) {
+        free_sparse_mat(e);
+        return NULL;
+    }
+
+    pool_run(pool, sparse_task, &job, tasks);
+
+    free(job.st);
+    if (job.failed) {
+        free_sparse_mat(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+struct mul_job {
+    struct mat *a;
+    struct mat *b;
+    struct mat *c;
+    int words;
+    int tasks;
+    int failed;
+};
+
+static void mul_task(void *ctx, int task, int worker) {
+    struct mul_job *job = ctx;
+    int w0 = (int)((long)job->words * task / job->tasks);
+    int w1 = (int)((long)job->words * (task + 1) / job->tasks);
+
+    (void)worker;
+    if (w0 < w1 && matrix_mul_m4rm_cols(job->a, job->b, job->c, w0, w1) != 0)
+        job->failed = 1;
+}
+
+/* Workers take disjoint column slices of c, each with its own narrow table,
+   so there is no duplicated table work and no write sharing between them. */
+struct mat *matrix_mul_m4rm_mt(struct mat *a, struct mat *b, struct pool *pool) {
+    if (a == NULL || b == NULL || a->cols != b->rows)
+        return NULL;
+
+    struct mat *c = new_mat(a->rows, b->cols);
+    if (c == NULL)
+        return NULL;
+
+    struct mul_job job = { a, b, c, real_dim(b->cols), 0, 0 };
+
+    // A few slices per worker for balance, never narrower than one cache line
+    job.tasks = pool_size(pool) * 4;
+    if (job.tasks > job.words / 8)
+        job.tasks = job.words / 8;
+    if (job.tasks < 1)
+        job.tasks = 1;
+
+    pool_run(pool, mul_task, &job, job.tasks);
+
+    if (job.failed) {
+        free_mat(c);
+        return NULL;
+    }
+
+    return c;
+}
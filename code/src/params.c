@@ -0,0 +1,58 @@
+#include "../include/params.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static const struct params sets[] = {
+    { 1, "standard", 13000, 1300, 16000, 144 },
+    { 2, "test", 1300, 130, 1600, 14 },
+    { 3, "large", 26000, 2600, 32000, 288 },
+};
+
+#define SETS ((int)(sizeof(sets) / sizeof(sets[0])))
+
+const struct params *active_params = &sets[0];
+
+const struct params *params_list(int *count) {
+    *count = SETS;
+    return sets;
+}
+
+const struct params *params_by_name(const char *name) {
+    for (int i = 0; i < SETS; i++) {
+        if (strcmp(sets[i].name, name) == 0)
+            return &sets[i];
+    }
+    return NULL;
+}
+
+const struct params *params_by_id(int id) {
+    for (int i = 0; i < SETS; i++) {
+        if (sets[i].id == id)
+            return &sets[i];
+    }
+    return NULL;
+}
+
+static int has_shape(const struct params *p, int rows, int cols) {
+    int dims[3][2] = { { p->k, p->n }, { p->l, p->k }, { p->l, p->n } };
+
+    for (int i = 0; i < 3; i++) {
+        if ((rows == dims[i][0] && cols == dims[i][1]) || (rows == dims[i][1] && cols == dims[i][0]))
+            return 1;
+    }
+    return 0;
+}
+
+const struct params *params_by_shape(int rows, int cols) {
+    for (int i = 0; i < SETS; i++) {
+        if (has_shape(&sets[i], rows, cols))
+            return &sets[i];
+    }
+    return NULL;
+}
+
+void select_params(const struct params *p) {
+    if (p != NULL)
+        active_params = p;
+}
@@ -0,0 +1,142 @@
+#include "../include/pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct pool {
+    int threads;
+    pthread_t *tid;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+
+    pool_fn fn;
+    void *ctx;
+    int tasks;
+    int next;
+    int pending;
+    int stop;
+};
+
+struct worker_arg {
+    struct pool *pool;
+    int id;
+};
+
+static void *worker(void *arg) {
+    struct pool *p = ((struct worker_arg *)arg)->pool;
+    int id = ((struct worker_arg *)arg)->id;
+    free(arg);
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        while (!p->stop && p->next >= p->tasks)
+            pthread_cond_wait(&p->work, &p->lock);
+
+        if (p->stop)
+            break;
+
+        int task = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        p->fn(p->ctx, task, id);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+            pthread_cond_signal(&p->done);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct pool *pool_new(int threads) {
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    struct pool *p = calloc(1, sizeof(struct pool));
+    if (p == NULL)
+        return NULL;
+
+    p->tid = calloc(threads, sizeof(pthread_t));
+    if (p->tid == NULL) {
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (; p->threads < threads; p->threads++) {
+        struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+        if (arg == NULL)
+            break;
+
+        arg->pool = p;
+        arg->id = p->threads;
+
+        if (pthread_create(&p->tid[p->threads], NULL, worker, arg) != 0) {
+            free(arg);
+            break;
+        }
+    }
+
+    if (p->threads == 0) {
+        pool_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int pool_size(struct pool *p) {
+    return p->threads;
+}
+
+void pool_run(struct pool *p, pool_fn fn, void *ctx, int tasks) {
+    if (tasks <= 0)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+
+    p->fn = fn;
+    p->ctx = ctx;
+    p->tasks = tasks;
+    p->next = 0;
+    p->pending = tasks;
+    pthread_cond_broadcast(&p->work);
+
+    while (p->pending > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+
+    p->tasks = 0;
+    p->next = 0;
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(struct pool *p) {
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->threads; i++)
+        pthread_join(p->tid[i], NULL);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+
+    free(p->tid);
+    free(p);
+}
@@ -12,16 +12,34 @@ void reset_seed() {
     s[3] = 0;
 }
 
-void init_seed(){
-
-    reset_seed();
-
+void rng_seed(struct rng *r) {
     for(int i = 0; i < 4; i++){
         unsigned char seed[SEED];
         randombytes(seed, SEED);
 
+        r->s[i] = 0;
         for(int j = 0; j < SEED; j++){
-            s[i] = (s[i] << 8) | seed[j];
+            r->s[i] = (r->s[i] << 8) | seed[j];
         }
     }
 }
+
+void init_seed(){
+    struct rng r;
+
+    rng_seed(&r);
+    for(int i = 0; i < 4; i++)
+        s[i] = r.s[i];
+}
+
+struct rng *thread_rng(void) {
+    static __thread struct rng r;
+    static __thread int seeded = 0;
+
+    if(!seeded){
+        rng_seed(&r);
+        seeded = 1;
+    }
+
+    return &r;
+}
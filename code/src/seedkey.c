@@ -0,0 +1,241 @@
+#include "../include/seedkey.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <randombytes.h>
+
+#include "../include/xoshiro.h"
+#include "../include/kernels.h"
+#include "../include/keyfile.h"
+
+#define SEED_MAGIC "ALEKSEED"
+#define SEED_VERSION 1
+
+// magic, version, rows, cols, seed, CRC32C of everything before it
+#define SEED_FILE (8 + 3 * 4 + SEED_BYTES + 4)
+
+struct seed_mat *seed_mat_new(int rows, int cols) {
+    if (rows <= 0 || cols <= 0)
+        return NULL;
+
+    struct seed_mat *m = calloc(1, sizeof(struct seed_mat));
+    if (m == NULL)
+        return NULL;
+
+    m->rows = rows;
+    m->cols = cols;
+    randombytes(m->seed, SEED_BYTES);
+
+    return m;
+}
+
+/* Row i comes from a xoshiro256** state obtained by running splitmix64 over
+   the seed words and i, so any row can be produced without the previous ones.
+   Bits past cols are cleared. */
+void seed_mat_row(const struct seed_mat *m, int i, uint64_t *row) {
+    uint64_t st[4];
+    uint64_t x = (uint64_t)i;
+
+    for (int k = 0; k < 4; k++) {
+        uint64_t w = 0;
+        for (int b = 7; b >= 0; b--)
+            w = (w << 8) | m->seed[8 * k + b];
+
+        x ^= w;
+        st[k] = splitmix64(&x);
+    }
+
+    int words = real_dim(m->cols);
+    for (int j = 0; j < words; j++)
+        row[j] = next_state(st);
+
+    if (m->cols % SIZE)
+        row[words - 1] &= (1ULL << (m->cols % SIZE)) - 1;
+}
+
+struct mat *seed_mat_expand(const struct seed_mat *m) {
+    if (m == NULL)
+        return NULL;
+
+    struct mat *res = new_mat(m->rows, m->cols);
+    if (res == NULL)
+        return NULL;
+
+    for (int i = 0; i < m->rows; i++)
+        seed_mat_row(m, i, res->data[i]);
+
+    return res;
+}
+
+/* mat_arr_mul without the matrix: rows are expanded SEED_BLOCK at a time into
+   a small buffer that stays in cache and fed to the matrix-vector kernel. */
+struct arr *seed_mat_arr_mul(const struct seed_mat *m, struct arr *a) {
+    if (m == NULL || a == NULL || m->cols != a->len)
+        return NULL;
+
+    struct arr *res = calloc(1, sizeof(struct arr));
+    if (res == NULL)
+        return NULL;
+
+    res->data = calloc(real_dim(m->rows), sizeof(uint64_t));
+    uint64_t *blk = malloc(SEED_SCRATCH(m->cols) * sizeof(uint64_t));
+
+    if (res->data == NULL || blk == NULL || seed_mat_arr_mul_into(res, m, a, blk) != 0) {
+        free(blk);
+        free_arr(res);
+        return NULL;
+    }
+
+    free(blk);
+    return res;
+}
+
+int seed_mat_arr_mul_into(struct arr *res, const struct seed_mat *m, struct arr *a, uint64_t *blk) {
+    if (res == NULL || res->data == NULL || m == NULL || a == NULL || blk == NULL || m->cols != a->len)
+        return -1;
+
+    int words = real_dim(m->cols);
+    uint64_t *rows[SEED_BLOCK];
+
+    for (int r = 0; r < SEED_BLOCK; r++)
+        rows[r] = blk + (size_t)r * words;
+
+    res->len = m->rows;
+    memset(res->data, 0, real_dim(res->len) * sizeof(uint64_t));
+
+    for (int i0 = 0; i0 < m->rows; i0 += SEED_BLOCK) {
+        int n = m->rows - i0 < SEED_BLOCK ? m->rows - i0 : SEED_BLOCK;
+
+        for (int r = 0; r < n; r++)
+            seed_mat_row(m, i0 + r, rows[r]);
+
+        uint64_t bits = 0;
+        kernels.mat_vec(rows, n, a->data, words, &bits);
+
+        // SEED_BLOCK divides SIZE, so a block never straddles two words
+        res->data[i0 / SIZE] |= bits << (i0 % SIZE);
+    }
+
+    return 0;
+}
+
+/* Same for a batch held in the rows of v: every block is expanded once and
+   multiplied by all the vectors before the next one. */
+struct mat *seed_mat_arr_mul_batch(const struct seed_mat *m, struct mat *v) {
+    if (m == NULL || v == NULL || m->cols != v->cols)
+        return NULL;
+
+    struct mat *res = new_mat(v->rows, m->rows);
+    uint64_t *blk = malloc(SEED_SCRATCH(m->cols) * sizeof(uint64_t));
+
+    if (res == NULL || blk == NULL || seed_mat_arr_mul_batch_into(res, m, v, blk) != 0) {
+        free_mat(res);
+        res = NULL;
+    }
+
+    free(blk);
+    return res;
+}
+
+int seed_mat_arr_mul_batch_into(struct mat *res, const struct seed_mat *m, struct mat *v, uint64_t *blk) {
+    if (res == NULL || m == NULL || v == NULL || blk == NULL || m->cols != v->cols || res->rows != v->rows
+        || res->cols != m->rows)
+        return -1;
+
+    int words = real_dim(m->cols);
+    uint64_t *rows[SEED_BLOCK];
+
+    for (int r = 0; r < SEED_BLOCK; r++)
+        rows[r] = blk + (size_t)r * words;
+
+    for (int b = 0; b < res->rows; b++)
+        memset(res->data[b], 0, real_dim(res->cols) * sizeof(uint64_t));
+
+    for (int i0 = 0; i0 < m->rows; i0 += SEED_BLOCK) {
+        int n = m->rows - i0 < SEED_BLOCK ? m->rows - i0 : SEED_BLOCK;
+
+        for (int r = 0; r < n; r++)
+            seed_mat_row(m, i0 + r, rows[r]);
+
+        for (int b = 0; b < v->rows; b++) {
+            uint64_t bits = 0;
+            kernels.mat_vec(rows, n, v->data[b], words, &bits);
+
+            res->data[b][i0 / SIZE] |= bits << (i0 % SIZE);
+        }
+    }
+
+    return 0;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int write_seed_file(const char *path, const struct seed_mat *m) {
+    if (m == NULL)
+        return -1;
+
+    uint8_t buf[SEED_FILE];
+
+    memcpy(buf, SEED_MAGIC, 8);
+    put32(buf + 8, SEED_VERSION);
+    put32(buf + 12, m->rows);
+    put32(buf + 16, m->cols);
+    memcpy(buf + 20, m->seed, SEED_BYTES);
+    put32(buf + 20 + SEED_BYTES, crc32c(0, buf, 20 + SEED_BYTES));
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+
+    int ok = fwrite(buf, 1, SEED_FILE, file) == SEED_FILE;
+    return fclose(file) == 0 && ok ? 0 : -1;
+}
+
+struct seed_mat *read_seed_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    uint8_t buf[SEED_FILE];
+    int ok = fread(buf, 1, SEED_FILE, file) == SEED_FILE;
+    fclose(file);
+
+    if (!ok || memcmp(buf, SEED_MAGIC, 8) != 0 || get32(buf + 8) != SEED_VERSION
+        || get32(buf + 20 + SEED_BYTES) != crc32c(0, buf, 20 + SEED_BYTES))
+        return NULL;
+
+    struct seed_mat *m = calloc(1, sizeof(struct seed_mat));
+    if (m == NULL)
+        return NULL;
+
+    m->rows = (int)get32(buf + 12);
+    m->cols = (int)get32(buf + 16);
+    memcpy(m->seed, buf + 20, SEED_BYTES);
+
+    if (m->rows <= 0 || m->cols <= 0) {
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+int is_seed_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    char magic[8];
+    int res = fread(magic, 1, 8, file) == 8 && memcmp(magic, SEED_MAGIC, 8) == 0;
+
+    fclose(file);
+    return res;
+}
@@ -0,0 +1,783 @@
+#include "../include/server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/arena.h"
+#include "../include/backend.h"
+#include "../include/key.h"
+#include "../include/packet.h"
+#include "../include/pool.h"
+
+#define HEADER_SIZE 12
+#define MSG_BYTES(p) (real_dim((p)->l) * sizeof(uint64_t))
+#define NNC_BYTES(p) (real_dim((p)->k) * sizeof(uint64_t))
+
+// Indices of the loaded keys, and how often the acceptor checks for a stop
+enum { KEY_A, KEY_Y, KEY_S };
+#define POLL_MS 200
+
+struct server;
+
+// Keys of one parameter set, and its mask pool when there is one
+struct keyset {
+    const struct params *p;
+    struct key keys[3];
+    int loaded[3];
+    struct mask_pool *masks;
+};
+
+/* An open client. The reader thread holds one reference and every queued
+   request another, so the socket outlives its last pending response. */
+struct conn {
+    int fd;
+    int refs;
+    pthread_mutex_t wlock;
+    struct server *srv;
+    struct conn *prev;
+    struct conn *next;
+};
+
+/* A request, taken from the server's pool with its payload buffer of
+   max_payload bytes and put back once answered */
+struct job {
+    struct conn *c;
+    int op;
+    struct keyset *set;
+    int set_id;
+    uint32_t id;
+    uint32_t len;
+    uint8_t *payload;
+    struct timespec start;
+    struct job *next;
+};
+
+/* Buffers of one worker, allocated before serving: row tables over the
+   payloads of a batch, the results of a batch of any loaded set and the
+   scratch of its keys */
+struct worker {
+    struct arena scratch;
+    uint64_t **in;
+    uint64_t **aux;
+    struct mat nnc;
+    struct mat out;
+};
+
+struct server {
+    struct keyset *sets;
+    int nsets;
+    size_t max_payload;
+    int fd;
+
+    // SERVE_QUEUE jobs and their payloads, the unused ones on free_jobs
+    struct job *jobs;
+    uint8_t *payloads;
+    struct job *free_jobs;
+    struct worker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    pthread_cond_t idle;
+    struct job *head;
+    struct job *tail;
+    struct conn *conns;
+    int readers;
+    int stop;
+
+    // Counters, under lock
+    struct timespec started;
+    uint64_t done[SERVE_STATS];
+    uint64_t errors;
+    double latency_sum;
+    double latency_max;
+    int depth;
+    int depth_max;
+};
+
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_signal(int sig) {
+    stop_signal = sig;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static double seconds_since(struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// One buffer through read_iov
+static int read_buf(int fd, void *buf, size_t len) {
+    struct iovec iov = { buf, len };
+    return read_iov(fd, &iov, 1);
+}
+
+/* Sends one response made of up to two payload parts with a single
+   vectored write; writes from different workers to the same client never
+   interleave. The set id is echoed as the request gave it. */
+static void reply(struct conn *c, int op, int set_id, int status, uint32_t id, const void *p1, size_t n1,
+                  const void *p2, size_t n2) {
+    uint8_t h[HEADER_SIZE] = { (uint8_t)op, (uint8_t)status, (uint8_t)set_id, (uint8_t)(set_id >> 8) };
+    put32(h + 4, id);
+    put32(h + 8, (uint32_t)(n1 + n2));
+
+    struct iovec iov[3] = { { h, sizeof(h) }, { (void *)p1, n1 }, { (void *)p2, n2 } };
+
+    pthread_mutex_lock(&c->wlock);
+    write_iov(c->fd, iov, 3);
+    pthread_mutex_unlock(&c->wlock);
+}
+
+// Called with the server lock held
+static void release(struct conn *c) {
+    if (--c->refs > 0)
+        return;
+
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        c->srv->conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+
+    close(c->fd);
+    pthread_mutex_destroy(&c->wlock);
+    free(c);
+}
+
+// Called with the server lock held
+static void put_job(struct server *srv, struct job *j) {
+    j->next = srv->free_jobs;
+    srv->free_jobs = j;
+    pthread_cond_signal(&srv->room);
+}
+
+/* A free job, waiting for one while every job is in flight. NULL once the
+   server stops. */
+static struct job *take_job(struct server *srv) {
+    pthread_mutex_lock(&srv->lock);
+    while (!srv->stop && srv->free_jobs == NULL)
+        pthread_cond_wait(&srv->room, &srv->lock);
+
+    struct job *j = srv->stop ? NULL : srv->free_jobs;
+    if (j != NULL)
+        srv->free_jobs = j->next;
+    pthread_mutex_unlock(&srv->lock);
+    return j;
+}
+
+static void drop_job(struct server *srv, struct job *j) {
+    pthread_mutex_lock(&srv->lock);
+    put_job(srv, j);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void finish(struct server *srv, struct job *j, int status) {
+    double latency = seconds_since(&j->start);
+
+    pthread_mutex_lock(&srv->lock);
+    srv->done[j->op - 1]++;
+    if (status != SERVE_OK)
+        srv->errors++;
+    srv->latency_sum += latency;
+    if (latency > srv->latency_max)
+        srv->latency_max = latency;
+    release(j->c);
+    put_job(srv, j);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void fail_job(struct server *srv, struct job *j, int status) {
+    reply(j->c, j->op, j->set_id, status, j->id, NULL, 0, NULL, 0);
+    finish(srv, j, status);
+}
+
+// The job pool bounds the queue, so this never waits
+static int enqueue(struct server *srv, struct job *j) {
+    pthread_mutex_lock(&srv->lock);
+    if (srv->stop) {
+        pthread_mutex_unlock(&srv->lock);
+        return -1;
+    }
+
+    j->c->refs++;
+    if (srv->tail != NULL)
+        srv->tail->next = j;
+    else
+        srv->head = j;
+    srv->tail = j;
+
+    if (++srv->depth > srv->depth_max)
+        srv->depth_max = srv->depth;
+
+    pthread_cond_signal(&srv->ready);
+    pthread_mutex_unlock(&srv->lock);
+    return 0;
+}
+
+/* Takes the head request and the ones of the same op and set queued right
+   behind it, up to SERVE_BATCH, so that a worker takes the lock once per
+   batch and passes over the keys once for all of it. Returns 0 once the server stops and the queue is drained. */
+static int dequeue(struct server *srv, struct job **batch) {
+    int n = 0;
+
+    pthread_mutex_lock(&srv->lock);
+    while (!srv->stop && srv->head == NULL)
+        pthread_cond_wait(&srv->ready, &srv->lock);
+
+    // Corrections have nothing to share and go one at a time
+    while (srv->head != NULL && n < SERVE_BATCH
+           && (n == 0 || (srv->head->op == batch[0]->op && srv->head->set == batch[0]->set))) {
+        batch[n++] = srv->head;
+        srv->head = srv->head->next;
+        if (batch[0]->op == SERVE_CORRECT)
+            break;
+    }
+    if (srv->head == NULL)
+        srv->tail = NULL;
+
+    srv->depth -= n;
+    pthread_mutex_unlock(&srv->lock);
+    return n;
+}
+
+static void stats(struct server *srv, struct conn *c, uint32_t id) {
+    char text[1024];
+
+    pthread_mutex_lock(&srv->lock);
+    double uptime = seconds_since(&srv->started);
+    uint64_t total = srv->done[0] + srv->done[1] + srv->done[2];
+    int len = snprintf(text, sizeof(text),
+                       "uptime_s %.3f\nrequests %llu\nencrypt %llu\ndecrypt %llu\ncorrect %llu\nerrors %llu\n"
+                       "rate_per_s %.1f\nlatency_avg_us %.1f\nlatency_max_us %.1f\nqueue_depth %d\nqueue_max %d\n",
+                       uptime, (unsigned long long)total, (unsigned long long)srv->done[0],
+                       (unsigned long long)srv->done[1], (unsigned long long)srv->done[2],
+                       (unsigned long long)srv->errors, uptime > 0 ? total / uptime : 0.0,
+                       total > 0 ? srv->latency_sum / total * 1e6 : 0.0, srv->latency_max * 1e6,
+                       srv->depth, srv->depth_max);
+    pthread_mutex_unlock(&srv->lock);
+
+    // One block per pool, headed by the name of its set
+    for (int i = 0; i < srv->nsets && len < (int)sizeof(text); i++) {
+        struct mask_stats ms;
+        if (srv->sets[i].masks == NULL)
+            continue;
+
+        mask_pool_stats(srv->sets[i].masks, &ms);
+        len += snprintf(text + len, sizeof(text) - len,
+                        "mask_set %s\nmask_capacity %d\nmask_low_water %d\nmask_fill %d\nmask_fill_min %d\n"
+                        "mask_hits %llu\nmask_misses %llu\nmask_refilled %llu\nmask_refill_per_s %.1f\n"
+                        "mask_compute_per_s %.1f\n",
+                        srv->sets[i].p->name, ms.capacity, ms.low_water, ms.fill, ms.fill_min,
+                        (unsigned long long)ms.hits, (unsigned long long)ms.misses, (unsigned long long)ms.refilled,
+                        ms.refill_rate, ms.compute_rate);
+    }
+
+    reply(c, SERVE_STATS, 0, SERVE_OK, id, text, len < (int)sizeof(text) ? (size_t)len : sizeof(text) - 1, NULL, 0);
+}
+
+/* The batch goes through the keys in one call, its payloads read in place
+   through the worker's row tables and the results left in its matrices. A
+   failure fails every request of the batch. */
+static void encrypt_jobs(struct server *srv, struct worker *w, struct job **jobs, int n) {
+    struct keyset *ks = jobs[0]->set;
+    const struct params *p = ks->p;
+
+    for (int i = 0; i < n; i++)
+        w->in[i] = (uint64_t *)jobs[i]->payload;
+
+    struct mat msg = { n, p->l, 0, w->in, NULL, NULL, 0 };
+    struct mat nnc = mat_slice(&w->nnc, 0, n, p->k), word = mat_slice(&w->out, 0, n, p->l);
+    int ret = ks->masks != NULL
+                  ? mask_encrypt_batch_into(ks->masks, &msg, &w->scratch, &nnc, &word)
+                  : key_encrypt_batch_into(&ks->keys[KEY_A], &ks->keys[KEY_Y], &msg, NULL, &w->scratch, &nnc, &word);
+
+    for (int i = 0; i < n; i++) {
+        if (ret != 0) {
+            fail_job(srv, jobs[i], SERVE_FAILED);
+            continue;
+        }
+        swap_le(nnc.data[i], real_dim(p->k));
+        swap_le(word.data[i], real_dim(p->l));
+        reply(jobs[i]->c, SERVE_ENCRYPT, jobs[i]->set_id, SERVE_OK, jobs[i]->id, nnc.data[i], NNC_BYTES(p),
+              word.data[i], MSG_BYTES(p));
+        finish(srv, jobs[i], SERVE_OK);
+    }
+}
+
+static void decrypt_jobs(struct server *srv, struct worker *w, struct job **jobs, int n) {
+    struct keyset *ks = jobs[0]->set;
+    const struct params *p = ks->p;
+
+    for (int i = 0; i < n; i++) {
+        w->in[i] = (uint64_t *)jobs[i]->payload;
+        w->aux[i] = w->in[i] + real_dim(p->k);
+    }
+
+    struct mat nnc = { n, p->k, 0, w->in, NULL, NULL, 0 }, word = { n, p->l, 0, w->aux, NULL, NULL, 0 };
+    struct mat msg = mat_slice(&w->out, 0, n, p->l);
+    int ret = key_decrypt_batch_into(&ks->keys[KEY_S], &nnc, &word, &w->scratch, &msg);
+
+    for (int i = 0; i < n; i++) {
+        if (ret != 0) {
+            fail_job(srv, jobs[i], SERVE_FAILED);
+            continue;
+        }
+        swap_le(msg.data[i], real_dim(p->l));
+        reply(jobs[i]->c, SERVE_DECRYPT, jobs[i]->set_id, SERVE_OK, jobs[i]->id, msg.data[i], MSG_BYTES(p), NULL,
+              0);
+        finish(srv, jobs[i], SERVE_OK);
+    }
+}
+
+static void correct_job(struct server *srv, struct worker *w, struct job *j) {
+    int l = j->set->p->l;
+    uint64_t *words = (uint64_t *)j->payload;
+    struct arr a = { l, words }, b = { l, words + real_dim(l) }, c = { l, words + 2 * real_dim(l) };
+    struct arr res = { l, w->out.data[0] };
+
+    if (correct_errors_into(&res, &a, &b, &c) != 0) {
+        fail_job(srv, j, SERVE_FAILED);
+        return;
+    }
+    swap_le(res.data, real_dim(l));
+    reply(j->c, SERVE_CORRECT, j->set_id, SERVE_OK, j->id, res.data, MSG_BYTES(j->set->p), NULL, 0);
+    finish(srv, j, SERVE_OK);
+}
+
+static size_t payload_size(const struct params *p, int op) {
+    switch (op) {
+        case SERVE_ENCRYPT:
+            return MSG_BYTES(p);
+        case SERVE_DECRYPT:
+            return NNC_BYTES(p) + MSG_BYTES(p);
+        default:
+            return 3 * MSG_BYTES(p);
+    }
+}
+
+// Set 0 is the first one loaded, NULL for a set the server has no keys of
+static struct keyset *find_set(struct server *srv, int id) {
+    if (id == 0)
+        return &srv->sets[0];
+
+    for (int i = 0; i < srv->nsets; i++) {
+        if (srv->sets[i].p->id == id)
+            return &srv->sets[i];
+    }
+    return NULL;
+}
+
+static void work_task(void *ctx, int task, int worker) {
+    struct server *srv = ctx;
+    struct worker *w = &srv->workers[worker];
+    struct job *batch[SERVE_BATCH];
+    int n;
+
+    (void)task;
+
+    while ((n = dequeue(srv, batch)) > 0) {
+        int op = batch[0]->op;
+
+        if (op == SERVE_ENCRYPT)
+            encrypt_jobs(srv, w, batch, n);
+        else if (op == SERVE_DECRYPT)
+            decrypt_jobs(srv, w, batch, n);
+        else
+            correct_job(srv, w, batch[0]);
+    }
+}
+
+static void *conn_reader(void *arg) {
+    struct conn *c = arg;
+    struct server *srv = c->srv;
+    uint8_t h[HEADER_SIZE];
+
+    while (read_buf(c->fd, h, sizeof(h)) == 0) {
+        int op = h[0];
+        int set_id = h[2] | h[3] << 8;
+        uint32_t id = get32(h + 4);
+        uint32_t len = get32(h + 8);
+
+        if (len > srv->max_payload) {
+            reply(c, op, set_id, SERVE_BAD_REQUEST, id, NULL, 0, NULL, 0);
+            break;
+        }
+
+        if (op == SERVE_STATS && len == 0) {
+            stats(srv, c, id);
+            continue;
+        }
+
+        // The payload is read straight into the job that will carry it
+        struct job *j = take_job(srv);
+        if (j == NULL)
+            break;
+        if (len > 0 && read_buf(c->fd, j->payload, len) != 0) {
+            drop_job(srv, j);
+            break;
+        }
+        swap_le((uint64_t *)j->payload, len / sizeof(uint64_t));
+
+        if (op == SERVE_STATS) {
+            drop_job(srv, j);
+            stats(srv, c, id);
+            continue;
+        }
+
+        struct keyset *ks = find_set(srv, set_id);
+        int status = SERVE_OK;
+        if (op < SERVE_ENCRYPT || op > SERVE_CORRECT)
+            status = SERVE_BAD_REQUEST;
+        else if (ks == NULL)
+            status = SERVE_NO_KEY;
+        else if (len != payload_size(ks->p, op))
+            status = SERVE_BAD_REQUEST;
+        else if ((op == SERVE_ENCRYPT && (!ks->loaded[KEY_A] || !ks->loaded[KEY_Y]))
+                 || (op == SERVE_DECRYPT && !ks->loaded[KEY_S]))
+            status = SERVE_NO_KEY;
+
+        if (status != SERVE_OK) {
+            drop_job(srv, j);
+            reply(c, op, set_id, status, id, NULL, 0, NULL, 0);
+            continue;
+        }
+
+        *j = (struct job){ c, op, ks, set_id, id, len, j->payload, { 0, 0 }, NULL };
+        clock_gettime(CLOCK_MONOTONIC, &j->start);
+
+        if (enqueue(srv, j) != 0) {
+            drop_job(srv, j);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&srv->lock);
+    release(c);
+    if (--srv->readers == 0)
+        pthread_cond_signal(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}
+
+static void accept_conn(struct server *srv) {
+    int fd = accept(srv->fd, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->refs = 1;
+    c->srv = srv;
+    pthread_mutex_init(&c->wlock, NULL);
+
+    pthread_mutex_lock(&srv->lock);
+    c->next = srv->conns;
+    if (srv->conns != NULL)
+        srv->conns->prev = c;
+    srv->conns = c;
+    srv->readers++;
+    pthread_mutex_unlock(&srv->lock);
+
+    pthread_attr_t attr;
+    pthread_t tid;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&tid, &attr, conn_reader, c) != 0) {
+        pthread_mutex_lock(&srv->lock);
+        release(c);
+        srv->readers--;
+        pthread_mutex_unlock(&srv->lock);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/* Accepts clients until a stop signal, then wakes every reader and worker:
+   queued requests are still answered, new ones are refused. */
+static void *acceptor(void *arg) {
+    struct server *srv = arg;
+    struct pollfd p = { srv->fd, POLLIN, 0 };
+
+    while (!stop_signal) {
+        if (poll(&p, 1, POLL_MS) > 0 && (p.revents & POLLIN))
+            accept_conn(srv);
+    }
+
+    pthread_mutex_lock(&srv->lock);
+    srv->stop = 1;
+    for (struct conn *c = srv->conns; c != NULL; c = c->next)
+        shutdown(c->fd, SHUT_RD);
+    pthread_cond_broadcast(&srv->ready);
+    pthread_cond_broadcast(&srv->room);
+    pthread_mutex_unlock(&srv->lock);
+
+    return NULL;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void free_buffers(struct server *srv, int workers) {
+    for (int i = 0; srv->workers != NULL && i < workers; i++)
+        arena_free(&srv->workers[i].scratch);
+    free(srv->workers);
+    free(srv->jobs);
+    free(srv->payloads);
+}
+
+/* Everything a request needs from reading to answering, sized for the
+   largest of the loaded sets, so that serving allocates nothing */
+static int alloc_buffers(struct server *srv, int workers) {
+    size_t scratch = 0;
+    int k = 0, l = 0;
+
+    for (int i = 0; i < srv->nsets; i++) {
+        const struct params *p = srv->sets[i].p;
+        if (key_batch_scratch_size(p, SERVE_BATCH) > scratch)
+            scratch = key_batch_scratch_size(p, SERVE_BATCH);
+        k = p->k > k ? p->k : k;
+        l = p->l > l ? p->l : l;
+    }
+
+    srv->jobs = calloc(SERVE_QUEUE, sizeof(struct job));
+    srv->payloads = malloc(SERVE_QUEUE * srv->max_payload);
+    srv->workers = calloc(workers, sizeof(struct worker));
+    if (srv->jobs == NULL || srv->payloads == NULL || srv->workers == NULL)
+        return -1;
+
+    for (int i = 0; i < SERVE_QUEUE; i++) {
+        srv->jobs[i].payload = srv->payloads + i * srv->max_payload;
+        srv->jobs[i].next = srv->free_jobs;
+        srv->free_jobs = &srv->jobs[i];
+    }
+
+    // The tables and results are carved first and stay, the scratch is what follows
+    size_t tables = 2 * SERVE_BATCH * sizeof(uint64_t *);
+    size_t out = arena_mat_size(SERVE_BATCH, k) + arena_mat_size(SERVE_BATCH, l);
+
+    for (int i = 0; i < workers; i++) {
+        struct worker *w = &srv->workers[i];
+
+        if (arena_init(&w->scratch, scratch + tables + out + 2 * MAT_ALIGN) != 0)
+            return -1;
+        w->in = arena_alloc(&w->scratch, SERVE_BATCH * sizeof(uint64_t *));
+        w->aux = arena_alloc(&w->scratch, SERVE_BATCH * sizeof(uint64_t *));
+        if (arena_mat(&w->scratch, &w->nnc, SERVE_BATCH, k) != 0
+            || arena_mat(&w->scratch, &w->out, SERVE_BATCH, l) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Listens on path and runs the workers until a stop signal
+static int run(struct server *srv, const char *path, int threads) {
+    struct pool *pool = pool_new(threads);
+    if (pool == NULL)
+        return -1;
+
+    int workers = pool_size(pool);
+    if (alloc_buffers(srv, workers) != 0) {
+        free_buffers(srv, workers);
+        pool_free(pool);
+        return -1;
+    }
+
+    srv->fd = listen_on(path);
+    if (srv->fd < 0) {
+        free_buffers(srv, workers);
+        pool_free(pool);
+        return -1;
+    }
+
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->ready, NULL);
+    pthread_cond_init(&srv->room, NULL);
+    pthread_cond_init(&srv->idle, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &srv->started);
+
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    stop_signal = 0;
+
+    pthread_t tid;
+    int ret = -1;
+
+    if (pthread_create(&tid, NULL, acceptor, srv) == 0) {
+        fprintf(stderr, "Serving on %s with %d workers\n", path, workers);
+
+        pool_run(pool, work_task, srv, workers);
+        pthread_join(tid, NULL);
+
+        pthread_mutex_lock(&srv->lock);
+        while (srv->readers > 0)
+            pthread_cond_wait(&srv->idle, &srv->lock);
+        pthread_mutex_unlock(&srv->lock);
+        ret = 0;
+    }
+
+    close(srv->fd);
+    unlink(path);
+    pool_free(pool);
+    free_buffers(srv, workers);
+
+    pthread_cond_destroy(&srv->idle);
+    pthread_cond_destroy(&srv->room);
+    pthread_cond_destroy(&srv->ready);
+    pthread_mutex_destroy(&srv->lock);
+    return ret;
+}
+
+// Loads the keys of one set, which must all be of the same parameter set
+static int load_set(struct keyset *ks, const char *const *paths) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(paths[i], "-") == 0)
+            continue;
+
+        if (load_key(paths[i], &ks->keys[i]) != 0) {
+            fprintf(stderr, "Failed to load %s\n", paths[i]);
+            return -1;
+        }
+        ks->loaded[i] = 1;
+
+        if (ks->p == NULL)
+            ks->p = ks->keys[i].params;
+        if (ks->keys[i].params != ks->p) {
+            fprintf(stderr, "Failed to load %s: not a %s key\n", paths[i], ks->p->name);
+            return -1;
+        }
+    }
+
+    if (ks->p == NULL) {
+        fprintf(stderr, "No key given for a set\n");
+        return -1;
+    }
+    return 0;
+}
+
+int serve(const char *path, const char *const *key_paths, int sets, int threads, const struct mask_config *masks) {
+    if (sets <= 0)
+        return -1;
+
+    struct server *srv = calloc(1, sizeof(struct server));
+    if (srv == NULL)
+        return -1;
+
+    srv->sets = calloc(sets, sizeof(struct keyset));
+    int ret = srv->sets != NULL ? 0 : -1;
+
+    for (int i = 0; i < sets && ret == 0; i++) {
+        struct keyset *ks = &srv->sets[i];
+        srv->nsets++;
+        ret = load_set(ks, key_paths + 3 * i);
+
+        for (int j = 0; j < i && ret == 0; j++) {
+            if (srv->sets[j].p == ks->p) {
+                fprintf(stderr, "Set %s given twice\n", ks->p->name);
+                ret = -1;
+            }
+        }
+
+        // Corrections carry the largest payload of a set
+        if (ret == 0 && 3 * MSG_BYTES(ks->p) > srv->max_payload)
+            srv->max_payload = 3 * MSG_BYTES(ks->p);
+
+        if (ret == 0 && masks != NULL) {
+            if (!ks->loaded[KEY_A] || !ks->loaded[KEY_Y])
+                ret = -1;
+            else if ((ks->masks = mask_pool_new(&ks->keys[KEY_A], &ks->keys[KEY_Y], masks)) == NULL)
+                ret = -1;
+        }
+    }
+
+    if (ret == 0)
+        ret = run(srv, path, threads);
+
+    for (int i = 0; i < srv->nsets; i++) {
+        struct keyset *ks = &srv->sets[i];
+
+        mask_pool_free(ks->masks);
+        for (int j = 0; j < 3; j++) {
+            if (ks->loaded[j])
+                free_key(&ks->keys[j]);
+        }
+    }
+    free(srv->sets);
+    free(srv);
+    return ret;
+}
+
+int serve_stats(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    uint8_t h[HEADER_SIZE] = { SERVE_STATS };
+    char text[1024];
+    int ret = -1;
+
+    struct iovec iov = { h, sizeof(h) };
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && write_iov(fd, &iov, 1) == 0
+        && read_buf(fd, h, sizeof(h)) == 0 && h[1] == SERVE_OK) {
+        uint32_t len = get32(h + 8);
+
+        if (len < sizeof(text) && read_buf(fd, text, len) == 0) {
+            fwrite(text, 1, len, stdout);
+            ret = 0;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,473 @@
+#include "../include/stream.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../include/arena.h"
+#include "../include/backend.h"
+#include "../include/key.h"
+#include "../include/pool.h"
+
+// Plaintext bytes carried by one block of set p
+#define BLOCK_BYTES(p) ((uint32_t)(p)->l / 8)
+
+#define HEADER_SIZE 16
+
+// One frame: plaintext length, then the nnc and word words of every copy
+#define FRAME_SIZE(p) (4 + STREAM_COPIES * (real_dim((p)->k) + real_dim((p)->l)) * 8)
+
+enum slot_state { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+/* One batch on its way through the pipeline. in holds the messages when
+   encrypting and the nnc rows when decrypting, with the words in aux; out
+   and out2 take the results of the worker. Copy c of block i is row
+   STREAM_COPIES * i + c of the ciphertext matrices, and copies lists the
+   message row of each. All are allocated with the slot and reused by
+   every batch going through it. */
+struct slot {
+    enum slot_state state;
+    int blocks;
+    int len[STREAM_BATCH];
+    struct mat *in;
+    struct mat *aux;
+    struct mat *out;
+    struct mat *out2;
+    uint64_t **copies;
+};
+
+struct stream {
+    FILE *in;
+    FILE *out;
+    struct key *keys;
+    const struct params *p;
+
+    int (*read)(struct stream *st, struct slot *s);
+    int (*work)(struct stream *st, struct slot *s, struct arena *scratch);
+    int (*write)(struct stream *st, struct slot *s);
+
+    struct slot *slots;
+    int depth;
+
+    // Scratch of each pool worker, for the keys' batch forms
+    struct arena *scratch;
+
+    // Slots are read, handed to workers and written strictly in this order
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long read_seq;
+    long work_seq;
+    long write_seq;
+    int eof;
+    int failed;
+
+    // Set by read_frames once the closing frame has gone by
+    int closed;
+
+    // FRAME_SIZE(p) bytes, used by the frame reader or writer only
+    uint8_t *frame;
+};
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Words are stored little-endian whatever the host order
+static uint8_t *put_words(uint8_t *p, const uint64_t *w, int n) {
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 8; j++)
+            *p++ = (uint8_t)(w[i] >> (8 * j));
+    }
+    return p;
+}
+
+static const uint8_t *get_words(const uint8_t *p, uint64_t *w, int n) {
+    for (int i = 0; i < n; i++) {
+        w[i] = 0;
+        for (int j = 0; j < 8; j++)
+            w[i] |= (uint64_t)*p++ << (8 * j);
+    }
+    return p;
+}
+
+static void fail(struct stream *st) {
+    pthread_mutex_lock(&st->lock);
+    st->failed = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void *reader(void *arg) {
+    struct stream *st = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        struct slot *s = &st->slots[st->read_seq % st->depth];
+        while (!st->failed && s->state != SLOT_FREE)
+            pthread_cond_wait(&st->cond, &st->lock);
+        int failed = st->failed;
+        pthread_mutex_unlock(&st->lock);
+
+        if (failed)
+            break;
+
+        int n = st->read(st, s);
+        if (n < 0) {
+            fail(st);
+            break;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        if (n == 0) {
+            st->eof = 1;
+        } else {
+            s->blocks = n;
+            s->state = SLOT_READ;
+            st->read_seq++;
+        }
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+
+        if (n == 0)
+            break;
+    }
+
+    return NULL;
+}
+
+// Every pool worker stays in here until the input is drained
+static void work_task(void *ctx, int task, int worker) {
+    struct stream *st = ctx;
+
+    (void)task;
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        while (!st->failed && !st->eof && st->work_seq == st->read_seq)
+            pthread_cond_wait(&st->cond, &st->lock);
+
+        if (st->failed || st->work_seq == st->read_seq) {
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+
+        struct slot *s = &st->slots[st->work_seq++ % st->depth];
+        pthread_mutex_unlock(&st->lock);
+
+        if (st->work(st, s, &st->scratch[worker]) != 0) {
+            fail(st);
+            return;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+static void *writer(void *arg) {
+    struct stream *st = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+        struct slot *s = &st->slots[st->write_seq % st->depth];
+        while (!st->failed && s->state != SLOT_DONE && !(st->eof && st->write_seq == st->read_seq))
+            pthread_cond_wait(&st->cond, &st->lock);
+        int stop = st->failed || s->state != SLOT_DONE;
+        pthread_mutex_unlock(&st->lock);
+
+        if (stop)
+            break;
+
+        if (st->write(st, s) != 0) {
+            fail(st);
+            break;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        s->state = SLOT_FREE;
+        st->write_seq++;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    return NULL;
+}
+
+static void free_slots(struct stream *st, int workers) {
+    for (int i = 0; st->slots != NULL && i < st->depth; i++) {
+        free_mat(st->slots[i].in);
+        free_mat(st->slots[i].aux);
+        free_mat(st->slots[i].out);
+        free_mat(st->slots[i].out2);
+        free(st->slots[i].copies);
+    }
+    free(st->slots);
+
+    for (int i = 0; st->scratch != NULL && i < workers; i++)
+        arena_free(&st->scratch[i]);
+    free(st->scratch);
+}
+
+// A slot matrix of rows blocks of cols columns, none when cols is 0
+static struct mat *slot_mat(int rows, int cols) {
+    return cols > 0 ? new_mat(rows * STREAM_BATCH, cols) : NULL;
+}
+
+/* Runs the reader and writer threads around the pool workers, with
+   STREAM_DEPTH slots per worker in flight. rows and cols give the shapes
+   of in, aux, out and out2, rows in STREAM_BATCH units; every buffer is
+   allocated here, before the first batch. */
+static int run_stream(struct stream *st, const int rows[4], const int cols[4], int threads) {
+    struct pool *pool = pool_new(threads);
+    if (pool == NULL)
+        return -1;
+
+    int workers = pool_size(pool);
+    st->depth = STREAM_DEPTH * workers;
+    st->slots = calloc(st->depth, sizeof(struct slot));
+    st->scratch = calloc(workers, sizeof(struct arena));
+    int ok = st->slots != NULL && st->scratch != NULL;
+
+    for (int i = 0; ok && i < st->depth; i++) {
+        struct slot *s = &st->slots[i];
+        s->in = slot_mat(rows[0], cols[0]);
+        s->aux = slot_mat(rows[1], cols[1]);
+        s->out = slot_mat(rows[2], cols[2]);
+        s->out2 = slot_mat(rows[3], cols[3]);
+        s->copies = calloc(STREAM_COPIES * STREAM_BATCH, sizeof(uint64_t *));
+
+        ok = s->in != NULL && (cols[1] == 0 || s->aux != NULL) && s->out != NULL && (cols[3] == 0 || s->out2 != NULL)
+             && s->copies != NULL;
+    }
+
+    for (int i = 0; ok && i < workers; i++)
+        ok = arena_init(&st->scratch[i], key_batch_scratch_size(st->p, STREAM_COPIES * STREAM_BATCH)) == 0;
+
+    if (!ok) {
+        free_slots(st, workers);
+        pool_free(pool);
+        return -1;
+    }
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+
+    pthread_t rt, wt;
+    int ret = -1;
+
+    if (pthread_create(&rt, NULL, reader, st) == 0) {
+        if (pthread_create(&wt, NULL, writer, st) == 0) {
+            pool_run(pool, work_task, st, workers);
+            pthread_join(wt, NULL);
+            ret = 0;
+        } else {
+            fail(st);
+        }
+        pthread_join(rt, NULL);
+    }
+
+    if (st->failed)
+        ret = -1;
+
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->lock);
+    free_slots(st, workers);
+    pool_free(pool);
+    return ret;
+}
+
+static int read_plain(struct stream *st, struct slot *s) {
+    size_t block = BLOCK_BYTES(st->p);
+    int n = 0;
+
+    while (n < STREAM_BATCH) {
+        uint8_t *row = (uint8_t *)s->in->data[n];
+
+        memset(row, 0, real_dim(st->p->l) * sizeof(uint64_t));
+        size_t got = fread(row, 1, block, st->in);
+        if (got == 0)
+            break;
+
+        s->len[n++] = (int)got;
+        if (got < block)
+            break;
+    }
+
+    if (ferror(st->in))
+        return -1;
+
+    return n;
+}
+
+// Every copy of every block of a slot goes through the keys as one batch
+static int encrypt_slot(struct stream *st, struct slot *s, struct arena *scratch) {
+    const struct params *p = st->p;
+    int rows = STREAM_COPIES * s->blocks;
+
+    for (int r = 0; r < rows; r++)
+        s->copies[r] = s->in->data[r / STREAM_COPIES];
+
+    struct mat msg = { rows, p->l, 0, s->copies, NULL, NULL, 0 };
+    struct mat nnc = mat_slice(s->out, 0, rows, p->k), word = mat_slice(s->out2, 0, rows, p->l);
+
+    return key_encrypt_batch_into(&st->keys[0], &st->keys[1], &msg, NULL, scratch, &nnc, &word);
+}
+
+static int write_frames(struct stream *st, struct slot *s) {
+    const struct params *p = st->p;
+
+    for (int i = 0; i < s->blocks; i++) {
+        uint8_t *f = st->frame + 4;
+
+        put32(st->frame, (uint32_t)s->len[i]);
+        for (int r = STREAM_COPIES * i; r < STREAM_COPIES * (i + 1); r++)
+            f = put_words(put_words(f, s->out->data[r], real_dim(p->k)), s->out2->data[r], real_dim(p->l));
+
+        if (fwrite(st->frame, FRAME_SIZE(p), 1, st->out) != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+// A missing closing frame means a truncated stream
+static int read_frames(struct stream *st, struct slot *s) {
+    const struct params *p = st->p;
+    int n = 0;
+
+    while (!st->closed && n < STREAM_BATCH) {
+        uint8_t len[4];
+
+        if (fread(len, sizeof(len), 1, st->in) != 1)
+            return -1;
+
+        uint32_t bytes = get32(len);
+        if (bytes == 0) {
+            st->closed = 1;
+            break;
+        }
+        if (bytes > BLOCK_BYTES(p))
+            return -1;
+
+        if (fread(st->frame + 4, FRAME_SIZE(p) - 4, 1, st->in) != 1)
+            return -1;
+
+        const uint8_t *f = st->frame + 4;
+        for (int r = STREAM_COPIES * n; r < STREAM_COPIES * (n + 1); r++)
+            f = get_words(get_words(f, s->in->data[r], real_dim(p->k)), s->aux->data[r], real_dim(p->l));
+
+        s->len[n++] = (int)bytes;
+    }
+
+    return n;
+}
+
+/* Decrypts every copy in one batch, then takes the bitwise majority of the
+   copies of each block into out2, as correct does */
+static int decrypt_slot(struct stream *st, struct slot *s, struct arena *scratch) {
+    const struct params *p = st->p;
+    int rows = STREAM_COPIES * s->blocks;
+    struct mat nnc = mat_slice(s->in, 0, rows, p->k), word = mat_slice(s->aux, 0, rows, p->l);
+    struct mat msg = mat_slice(s->out, 0, rows, p->l);
+
+    if (key_decrypt_batch_into(&st->keys[0], &nnc, &word, scratch, &msg) != 0)
+        return -1;
+
+    for (int i = 0; i < s->blocks; i++) {
+        uint64_t **c = msg.data + STREAM_COPIES * i;
+        struct arr a = { p->l, c[0] }, b = { p->l, c[1] }, d = { p->l, c[2] }, res = { p->l, s->out2->data[i] };
+
+        if (correct_errors_into(&res, &a, &b, &d) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int write_plain(struct stream *st, struct slot *s) {
+    for (int i = 0; i < s->blocks; i++) {
+        if (fwrite(s->out2->data[i], 1, s->len[i], st->out) != (size_t)s->len[i])
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Blocks and frames take the sizes of the keys' set, which the header
+   records as the bytes per block */
+int encrypt_stream(FILE *in, FILE *out, const char *a_path, const char *y_path, int threads) {
+    struct key keys[2];
+
+    if (in == NULL || out == NULL || load_key(a_path, &keys[0]) != 0)
+        return -1;
+    if (load_key(y_path, &keys[1]) != 0 || keys[0].params != keys[1].params) {
+        free_key(&keys[0]);
+        free_key(&keys[1]);
+        return -1;
+    }
+
+    const struct params *p = keys[0].params;
+    uint8_t h[HEADER_SIZE];
+    memcpy(h, STREAM_MAGIC, 8);
+    put32(h + 8, STREAM_VERSION);
+    put32(h + 12, BLOCK_BYTES(p));
+
+    struct stream st = { .in = in, .out = out, .keys = keys, .p = p,
+                         .read = read_plain, .work = encrypt_slot, .write = write_frames };
+    st.frame = malloc(FRAME_SIZE(p));
+    int ret = -1;
+    if (st.frame != NULL && fwrite(h, sizeof(h), 1, out) == 1)
+        ret = run_stream(&st, (const int[4]){ 1, 0, STREAM_COPIES, STREAM_COPIES },
+                         (const int[4]){ p->l, 0, p->k, p->l }, threads);
+
+    uint8_t end[4] = { 0 };
+    if (ret == 0 && (fwrite(end, sizeof(end), 1, out) != 1 || fflush(out) != 0))
+        ret = -1;
+
+    free(st.frame);
+    free_key(&keys[0]);
+    free_key(&keys[1]);
+    return ret;
+}
+
+int decrypt_stream(FILE *in, FILE *out, const char *key_path, int threads) {
+    struct key s;
+    uint8_t h[HEADER_SIZE];
+
+    if (in == NULL || out == NULL || fread(h, sizeof(h), 1, in) != 1)
+        return -1;
+
+    if (memcmp(h, STREAM_MAGIC, 8) != 0 || get32(h + 8) != STREAM_VERSION)
+        return -1;
+
+    if (load_key(key_path, &s) != 0)
+        return -1;
+
+    // A stream of another set has blocks of another size
+    const struct params *p = s.params;
+    if (get32(h + 12) != BLOCK_BYTES(p)) {
+        free_key(&s);
+        return -1;
+    }
+
+    struct stream st = { .in = in, .out = out, .keys = &s, .p = p,
+                         .read = read_frames, .work = decrypt_slot, .write = write_plain };
+    st.frame = malloc(FRAME_SIZE(p));
+    int ret = st.frame != NULL ? run_stream(&st, (const int[4]){ STREAM_COPIES, STREAM_COPIES, STREAM_COPIES, 1 },
+                                            (const int[4]){ p->k, p->l, p->l, p->l }, threads) : -1;
+
+    if (ret == 0 && fflush(out) != 0)
+        ret = -1;
+
+    free(st.frame);
+    free_key(&s);
+    return ret;
+}
@@ -4,64 +4,152 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
-
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/api.h"
 #include "../include/backend.h"
+#include "../include/kernels.h"
+#include "../include/bitop.h"
+#include "../include/keyfile.h"
+#include "../include/seedkey.h"
+#include "../include/parallel.h"
+#include "../include/seed.h"
+#include "../include/key.h"
+#include "../include/mask.h"
+#include "../include/packet.h"
+#include "../include/params.h"
+#include "../include/server.h"
+#include "../include/stream.h"
+#include "../include/xoshiro.h"
 
 #define TEST1 "target/test1.bin"
 #define TEST2 "target/test2.bin"
 #define TEST3 "target/test3.bin"
+#define TESTK "target/testk.bin"
+#define TESTA "target/testa.bin"
+#define TESTY "target/testy.bin"
+#define TESTA2 "target/testa2.bin"
+#define TESTY2 "target/testy2.bin"
+#define TESTP "target/testp.bin"
+#define TESTC "target/testc.bin"
+#define TESTD "target/testd.bin"
+#define TESTSOCK "target/test.sock"
 
 void shortcut( );
+void bench_transpose( );
 
 void handle_error(const char *);
 void free_resources(struct mat *, struct mat *, struct mat *, struct mat *, struct arr *, struct arr *, struct arr *);
 
 struct arr* generate_random_message(int );
-void generate_matrices(struct mat **, struct mat **, struct mat **);
+void generate_matrices(struct mat **, struct mat **, struct sparse_mat **);
+void check_sparse_add(int, int, int);
 void check_key_reading(struct mat *, struct mat *, struct mat *);
 void encryption_decryption_process(struct mat *, struct mat *, struct mat *, struct arr *);
 void encrypt_decrypt_shortcut(struct mat *, struct mat *, struct mat *, struct arr *, const char *);
 void print_hamming_distance(struct arr *, struct arr *);
+void check_matrix_mul(int, int, int);
+void check_mat_arr_mul(int, int);
+void check_sparse_mul(const char *, struct mat *);
+void check_batch_mul(const char *, struct mat *, int);
+void check_batch_decrypt(struct mat *, int);
+void check_stream(struct mat *, struct mat *, struct mat *, size_t);
+double stream_file_round_trip(struct mat *, struct mat *, struct mat *, uint8_t *, size_t);
+void check_masks(struct mat *, struct mat *, int, int);
+void check_into(struct mat *, struct mat *, struct mat *, int);
+void check_packets(int);
+void check_server(struct mat *, struct mat *, struct mat *, int);
+void check_correct_errors(int);
+void check_params(void);
+void check_seed_mat(int, int);
+void check_rng(int, int);
+void check_rand_fill(int);
+void check_sample_weight(int, int, int);
+void check_parallel(int, int, int);
+void compare_transpose(const char *, int, int);
+double elapsed_ms(struct timespec *, struct timespec *);
 
 int check_mat(struct mat *, struct mat *);
 int check_arr(struct arr *, struct arr *);
 int delta_arr(struct arr *, struct arr *);
 
 void test(int mod) {
-    if(mod){
-        shortcut();
-        return;
+    switch(mod){
+        case 0:
+            break;
+        case 2:
+            bench_transpose();
+            return;
+        default:
+            shortcut();
+            return;
     }
     fprintf(stdout, "Starting the testing process...\n");
 
-    struct mat *aw = NULL, *sw = NULL, *ew = NULL, *yw = NULL;
+    fprintf(stdout, "Using %s kernels.\n\n", kernels.name);
+
+    check_mat_arr_mul(37, 1001);
+    check_mat_arr_mul(L, N);
+    check_matrix_mul(77, 130, 200);
+    check_matrix_mul(L / 100, K / 10, N / 100);
+
+    check_sparse_add(L / 10, N / 10 + 3, T);
+    check_seed_mat(77, 1001);
+    check_seed_mat(L, K);
+    check_rng(100, 1000);
+    check_rand_fill(13);
+    check_rand_fill(K * real_dim(N));
+    check_sample_weight(4000, 200, 150);
+    check_sample_weight(L, N, T);
+    check_parallel(L / 10, K, N / 10 + 5);
+    check_params();
+    check_packets(100);
+    check_correct_errors(1000);
+
+    struct mat *aw = NULL, *sw = NULL, *yw = NULL;
+    struct sparse_mat *ew = NULL;
 
     generate_matrices(&aw, &sw, &ew);
 
     fprintf(stdout, "Computing matrix y...\n");
-    struct mat *tmp_mat = matrix_mul(sw, aw);
-    if (tmp_mat == NULL) {
-        handle_error("Failed to multiply matrices.");
-        free_resources(aw, sw, ew, NULL, NULL, NULL, NULL);
+    yw = matrix_mul_m4rm(sw, aw);
+    if (yw == NULL || sparse_mat_add(yw, ew) == NULL) {
+        handle_error("Failed to compute matrix y.");
+        free_sparse_mat(ew);
+        free_resources(aw, sw, yw, NULL, NULL, NULL, NULL);
         return;
     }
-
-    yw = matrix_sum(tmp_mat, ew);
-    free_mat(tmp_mat);
+    free_sparse_mat(ew);
 
     write_key(A_PUB, aw);
-    write_key(Y_PUB, yw);
+    write_key_mapped(Y_PUB, yw);
     write_key(PRIVA, sw);
 
     fprintf(stdout, "Matrices generated successfully.\n\n");
 
     check_key_reading(aw, yw, sw);
 
+    check_sparse_mul("A", aw);
+    check_sparse_mul("Y", yw);
+    check_batch_mul("A", aw, 64);
+    check_batch_mul("Y", yw, 64);
+    check_batch_decrypt(sw, 5);
+    check_batch_decrypt(sw, 1000);
+    check_stream(aw, yw, sw, 5 * STREAM_BATCH * (L / 8) + 777);
+    check_masks(aw, sw, 200, 50);
+    check_into(aw, yw, sw, 100);
+    check_server(aw, yw, sw, 3 * SERVE_BATCH + 5);
+
     fprintf(stdout, "Starting encryption and decryption check...\n");
     struct arr *msg = generate_random_message(L);
     encryption_decryption_process(aw, yw, sw, msg);
 
-    free_resources(aw, sw, ew, yw, msg, NULL, NULL);
+    free_resources(aw, sw, yw, NULL, msg, NULL, NULL);
 }
 
 // Error handling function
@@ -111,16 +199,17 @@ struct arr* generate_random_message(int length) {
     return msg;
 }
 
-void generate_matrices(struct mat **aw, struct mat **sw, struct mat **ew) {
+void generate_matrices(struct mat **aw, struct mat **sw, struct sparse_mat **ew) {
     fprintf(stdout, "Generating matrices...\n");
 
-    *aw = rand_mat(K, N);
-    *sw = rand_mat(L, K);
-    *ew = weight_matrix(L, N, T);
+    *aw = rand_mat(K, N, NULL);
+    *sw = rand_mat(L, K, NULL);
+    *ew = weight_sparse_mat(L, N, T, NULL);
 
     if (*aw == NULL || *sw == NULL || *ew == NULL) {
         handle_error("Failed to generate matrices.");
-        free_resources(*aw, *sw, *ew, NULL, NULL, NULL, NULL);
+        free_sparse_mat(*ew);
+        free_resources(*aw, *sw, NULL, NULL, NULL, NULL, NULL);
         exit(EXIT_FAILURE);
     }
 }
@@ -144,6 +233,56 @@ void check_key_reading(struct mat *aw, struct mat *yw, struct mat *sw) {
         exit(EXIT_FAILURE);
     }
 
+    free_resources(ar, yr, sr, NULL, NULL, NULL, NULL);
+
+    ar = map_key(A_PUB);
+    yr = map_key(Y_PUB);
+    sr = map_key(PRIVA);
+
+    if (ar == NULL || yr == NULL || sr == NULL || !check_mat(aw, ar) || !check_mat(yw, yr) || !check_mat(sw, sr)) {
+        handle_error("Mapped keys do not match expected values.");
+        free_resources(aw, sw, NULL, yw, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    // Versioned container: copied and mapped reads, then the legacy converter
+    struct key_info info;
+    struct mat *kr = NULL, *km = NULL, *kc = NULL;
+
+    if (write_key_file(TESTK, yw, KEY_ROW_MAJOR, KEY_PARAMS) == 0) {
+        kr = read_key_file(TESTK, &info);
+        km = map_key_file(TESTK, NULL);
+    }
+    if (convert_key_file(PRIVA, TESTK) == 0)
+        kc = read_key_file(TESTK, NULL);
+
+    if (kr == NULL || km == NULL || kc == NULL || !check_mat(yw, kr) || !check_mat(yw, km) || !check_mat(sw, kc)
+        || info.layout != KEY_ROW_MAJOR || info.params != KEY_PARAMS) {
+        handle_error("Key container round trip failed.");
+        free_resources(aw, sw, NULL, yw, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    free_resources(kr, km, kc, NULL, NULL, NULL, NULL);
+
+    // A flipped payload bit is left to verify_key_file and the copied read
+    int caught = write_key_file(TESTK, yw, KEY_ROW_MAJOR, KEY_PARAMS) == 0 && verify_key_file(TESTK) == 0;
+    FILE *f = caught ? fopen(TESTK, "r+b") : NULL;
+    int byte = f != NULL && fseek(f, KEY_PAGE, SEEK_SET) == 0 ? fgetc(f) : EOF;
+    caught = byte != EOF && fseek(f, KEY_PAGE, SEEK_SET) == 0 && fputc(byte ^ 1, f) != EOF;
+    if (f != NULL)
+        fclose(f);
+    km = caught ? map_key_file(TESTK, NULL) : NULL;
+    kr = km != NULL ? read_key_file(TESTK, NULL) : NULL;
+    caught = km != NULL && kr == NULL && verify_key_file(TESTK) != 0;
+    free_resources(km, kr, NULL, NULL, NULL, NULL, NULL);
+
+    if (!caught) {
+        handle_error("A corrupted key payload went unnoticed.");
+        free_resources(aw, sw, NULL, yw, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+
     fprintf(stdout, "Keys read correctly.\n\n");
 
     free_resources(ar, yr, sr, NULL, NULL, NULL, NULL);
@@ -156,7 +295,7 @@ void encryption_decryption_process(struct mat *ar, struct mat *yr, struct mat *s
         return;
     }
     e->len = N;
-    e->data = weight_array(N, T);
+    e->data = weight_array(N, T, NULL);
     if (e->data == NULL) {
         handle_error("Memory allocation failed for e data.");
         free_resources(NULL, NULL, NULL, NULL, msg, e, NULL);
@@ -240,6 +379,1140 @@ void encryption_decryption_process(struct mat *ar, struct mat *yr, struct mat *s
     free_resources(NULL, NULL, NULL, NULL, e, dec_key, dec_msg);
 }
 
+// Cross-checks the Four Russians and tiled products against matrix_mul_naive
+void check_matrix_mul(int rows, int inner, int cols) {
+    fprintf(stdout, "Checking matrix multiplication %dx%d * %dx%d...\n", rows, inner, inner, cols);
+
+    struct mat *a = rand_mat(rows, inner, NULL);
+    struct mat *b = rand_mat(inner, cols, NULL);
+    if (a == NULL || b == NULL) {
+        handle_error("Failed to generate matrices.");
+        free_resources(a, b, NULL, NULL, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    struct mat *ref = matrix_mul_naive(a, b);
+    struct mat *fast = matrix_mul_m4rm(a, b);
+
+    if (ref == NULL || fast == NULL || !check_mat(ref, fast)) {
+        handle_error("Four Russians product does not match the reference.");
+        free_resources(a, b, ref, fast, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+    free_mat(fast);
+
+    // Odd tile sizes exercise the partial tiles on every edge
+    set_tile_sizes(7, 100, 3);
+    fast = matrix_mul(a, b);
+    set_tile_sizes(0, 0, 0);
+
+    if (fast == NULL || !check_mat(ref, fast)) {
+        handle_error("Tiled product does not match the reference.");
+        free_resources(a, b, ref, fast, NULL, NULL, NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Matrix multiplication verified.\n\n");
+
+    free_resources(a, b, ref, fast, NULL, NULL, NULL);
+}
+
+// Checks the dispatched matrix-vector kernel against a word-by-word parity
+void check_mat_arr_mul(int rows, int cols) {
+    fprintf(stdout, "Checking matrix-vector multiplication %dx%d...\n", rows, cols);
+
+    struct mat *m = rand_mat(rows, cols, NULL);
+    struct arr v = { cols, weight_array(cols, cols / 3, NULL) };
+    if (m == NULL || v.data == NULL) {
+        handle_error("Failed to generate operands.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct arr *res = mat_arr_mul(m, &v);
+    if (res == NULL) {
+        handle_error("Failed to multiply matrix with array.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < rows; i++) {
+        uint64_t acc = 0;
+        for (int j = 0; j < real_dim(cols); j++)
+            acc ^= m->data[i][j] & v.data[j];
+
+        if (fetch_bit(res->data[i / SIZE], i % SIZE) != (int)(count_ones(acc) & 1)) {
+            handle_error("Matrix-vector kernel does not match the reference.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(stdout, "Matrix-vector multiplication verified.\n\n");
+
+    free(v.data);
+    free_resources(m, NULL, NULL, NULL, res, NULL, NULL);
+}
+
+// Checks the in-place sparse noise addition against matrix_sum on a dense copy
+void check_sparse_add(int rows, int cols, int weight) {
+    fprintf(stdout, "Checking sparse noise addition %dx%d...\n", rows, cols);
+
+    struct mat *m = rand_mat(rows, cols, NULL);
+    struct mat *dense = rand_mat(rows, cols, NULL);
+    struct sparse_mat *e = weight_sparse_mat(rows, cols, weight, NULL);
+    if (m == NULL || dense == NULL || e == NULL) {
+        handle_error("Failed to generate operands.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < real_dim(cols); j++)
+            dense->data[i][j] = 0;
+        for (int j = 0; j < weight; j++) {
+            int p = e->pos[i * weight + j];
+            dense->data[i][p / SIZE] |= 1ULL << (p % SIZE);
+        }
+    }
+
+    struct mat *ref = matrix_sum(m, dense);
+
+    if (ref == NULL || sparse_mat_add(m, e) == NULL || !check_mat(ref, m)) {
+        handle_error("Sparse noise addition does not match matrix_sum.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Sparse noise addition verified.\n\n");
+
+    free_sparse_mat(e);
+    free_resources(m, dense, ref, NULL, NULL, NULL, NULL);
+}
+
+// Checks the fused seeded product and the seed file against an expanded copy
+void check_seed_mat(int rows, int cols) {
+    fprintf(stdout, "Checking seeded matrix %dx%d...\n", rows, cols);
+
+    struct seed_mat *m = seed_mat_new(rows, cols);
+    struct arr v = { cols, weight_array(cols, cols / 3, NULL) };
+    if (m == NULL || v.data == NULL || write_seed_file(TESTK, m) != 0) {
+        handle_error("Failed to generate seeded matrix.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct seed_mat *r = read_seed_file(TESTK);
+    struct mat *full = seed_mat_expand(m);
+    struct mat *again = r != NULL ? seed_mat_expand(r) : NULL;
+    struct arr *ref = full != NULL ? mat_arr_mul(full, &v) : NULL;
+    struct arr *fused = seed_mat_arr_mul(m, &v);
+
+    struct mat *vs = new_mat(1, cols);
+    if (vs != NULL)
+        memcpy(vs->data[0], v.data, real_dim(cols) * sizeof(uint64_t));
+    struct mat *batch = vs != NULL ? seed_mat_arr_mul_batch(m, vs) : NULL;
+
+    if (again == NULL || ref == NULL || fused == NULL || batch == NULL || !check_mat(full, again)
+        || !check_arr(ref, fused) || memcmp(batch->data[0], ref->data, real_dim(rows) * sizeof(uint64_t)) != 0) {
+        handle_error("Seeded matrix does not match its expansion.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Seeded matrix verified.\n\n");
+
+    free(m);
+    free(r);
+    free(v.data);
+    free_resources(full, again, vs, batch, ref, fused, NULL);
+}
+
+// Checks that draws from a context are not disturbed by other contexts
+void check_rng(int rows, int cols) {
+    fprintf(stdout, "Checking generator contexts...\n");
+
+    struct rng ra, rb;
+    rng_seed(&ra);
+    rb = ra;
+
+    struct mat *a1 = rand_mat(rows, cols, &ra);
+    struct mat *other = rand_mat(rows, cols, NULL);
+    struct sparse *e1 = weight_sparse(cols, T, &ra);
+
+    struct mat *a2 = rand_mat(rows, cols, &rb);
+    struct sparse *e2 = weight_sparse(cols, T, &rb);
+
+    if (a1 == NULL || a2 == NULL || other == NULL || e1 == NULL || e2 == NULL || !check_mat(a1, a2)
+        || check_mat(a1, other) || memcmp(e1->pos, e2->pos, T * sizeof(int)) != 0) {
+        handle_error("Generator contexts share state.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Generator contexts verified.\n\n");
+
+    free_sparse(e1);
+    free_sparse(e2);
+    free_resources(a1, a2, other, NULL, NULL, NULL, NULL);
+}
+
+/* Every row must hold weight distinct positions below len, and every
+   position must come up within six standard deviations of its mean. */
+void check_sample_weight(int rows, int len, int weight) {
+    fprintf(stdout, "Checking %d samples of weight %d below %d...\n", rows, weight, len);
+
+    int *pos = malloc((size_t)rows * weight * sizeof(int));
+    long *count = calloc(len, sizeof(long));
+    uint64_t *seen = calloc(real_dim(len), sizeof(uint64_t));
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = pos != NULL && count != NULL && seen != NULL ? sample_weight(pos, rows, len, weight, NULL) : -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int i = 0; i < rows && ret == 0; i++) {
+        int *row = pos + (size_t)i * weight;
+
+        memset(seen, 0, real_dim(len) * sizeof(uint64_t));
+        for (int j = 0; j < weight && ret == 0; j++) {
+            if (row[j] < 0 || row[j] >= len || seen[row[j] / SIZE] & (1ULL << (row[j] % SIZE))) {
+                ret = -1;
+            } else {
+                seen[row[j] / SIZE] |= 1ULL << (row[j] % SIZE);
+                count[row[j]]++;
+            }
+        }
+    }
+
+    double mean = (double)rows * weight / len;
+    for (int i = 0; i < len && ret == 0; i++) {
+        if ((count[i] - mean) * (count[i] - mean) > 36 * mean)
+            ret = -1;
+    }
+
+    if (ret != 0) {
+        handle_error("Fixed-weight samples are not uniform sets.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Samples verified: %.2f ns per position.\n\n", elapsed_ms(&t0, &t1) * 1e6 / ((double)rows * weight));
+
+    free(pos);
+    free(count);
+    free(seen);
+}
+
+// Checks the bulk lane generator against one scalar stream per lane
+void check_rand_fill(int n) {
+    fprintf(stdout, "Checking bulk generator on %d words...\n", n);
+
+    struct rng r, ref[RNG_LANES];
+    struct rng_lanes lanes;
+
+    rng_seed(&r);
+    for (int i = 0; i < RNG_LANES; i++) {
+        ref[i] = r;
+        rng_jump(&r);
+    }
+    r = ref[0];
+    rng_lanes_init(&lanes, &r);
+
+    uint64_t *out = malloc((size_t)n * sizeof(uint64_t));
+    uint64_t *again = malloc((size_t)n * sizeof(uint64_t));
+    if (out == NULL || again == NULL) {
+        handle_error("Failed to allocate buffers.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec t0, t1, t2;
+
+    // Two calls, so that a partial round is followed by a full fill
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    kernels.rand_fill(&lanes, out, n);
+    kernels.rand_fill(&lanes, again, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int rounds = (n + RNG_LANES - 1) / RNG_LANES;
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t *got = pass == 0 ? out : again;
+
+        for (int j = 0; j < rounds * RNG_LANES; j++) {
+            uint64_t x = rng_next(&ref[j % RNG_LANES]);
+
+            if (j < n && got[j] != x) {
+                handle_error("Bulk generator does not match the reference.");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    fprintf(stdout, "Bulk generator verified: %.2f ms, scalar %.2f ms.\n\n",
+            elapsed_ms(&t0, &t1), elapsed_ms(&t1, &t2));
+
+    free(out);
+    free(again);
+}
+
+// Checks that threaded generation is independent of the thread count
+void check_parallel(int rows, int inner, int cols) {
+    fprintf(stdout, "Checking threaded key generation steps...\n");
+
+    struct pool *one = pool_new(1);
+    struct pool *many = pool_new(3);
+    if (one == NULL || many == NULL) {
+        handle_error("Failed to start thread pools.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct rng r1, r3;
+    rng_seed(&r1);
+    r3 = r1;
+
+    struct mat *a1 = rand_mat_mt(rows, inner, one, &r1);
+    struct sparse_mat *e1 = weight_sparse_mat_mt(rows, cols, T, one, &r1);
+
+    struct mat *a3 = rand_mat_mt(rows, inner, many, &r3);
+    struct sparse_mat *e3 = weight_sparse_mat_mt(rows, cols, T, many, &r3);
+    struct mat *b = rand_mat_mt(inner, cols, many, &r3);
+
+    if (a1 == NULL || a3 == NULL || e1 == NULL || e3 == NULL || b == NULL || !check_mat(a1, a3)
+        || memcmp(e1->pos, e3->pos, (size_t)rows * T * sizeof(int)) != 0) {
+        handle_error("Threaded generation depends on the thread count.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct mat *ref = matrix_mul_m4rm(a1, b);
+    struct mat *par = matrix_mul_m4rm_mt(a1, b, many);
+
+    if (ref == NULL || par == NULL || !check_mat(ref, par)) {
+        handle_error("Threaded product does not match the serial one.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Threaded key generation verified.\n\n");
+
+    free_sparse_mat(e1);
+    free_sparse_mat(e3);
+    free_resources(a1, a3, b, ref, NULL, NULL, NULL);
+    free_mat(par);
+    pool_free(one);
+    pool_free(many);
+}
+
+// Checks the column-XOR product used by encrypt against the dense one
+void check_sparse_mul(const char *name, struct mat *m) {
+    fprintf(stdout, "Checking sparse noise product with %s...\n", name);
+
+    struct mat *cols = matrix_transpose(m);
+    struct sparse *e = weight_sparse(N, T, NULL);
+    struct arr *dense = sparse_to_arr(e);
+    if (cols == NULL || e == NULL || dense == NULL) {
+        handle_error("Failed to build sparse operands.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct arr *ref = mat_arr_mul(m, dense);
+    struct arr *fast = sparse_mat_mul(cols, e);
+
+    if (ref == NULL || fast == NULL || !check_arr(ref, fast)) {
+        handle_error("Sparse product does not match the dense one.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Sparse product verified.\n\n");
+
+    free_sparse(e);
+    free_resources(cols, NULL, NULL, NULL, dense, ref, fast);
+}
+
+// Checks the batched noise products row by row and times them per message
+void check_batch_mul(const char *name, struct mat *m, int count) {
+    fprintf(stdout, "Checking batch of %d noise products with %s...\n", count, name);
+
+    struct mat *cols = matrix_transpose(m);
+    struct sparse_mat *e = weight_sparse_mat(count, N, T, NULL);
+    struct mat *dense = sparse_mat_to_mat(e);
+    if (cols == NULL || e == NULL || dense == NULL) {
+        handle_error("Failed to build batch operands.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec t0, t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct mat *sparse = sparse_mat_mul_batch(cols, e);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    struct mat *batch = mat_arr_mul_batch(m, dense);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    if (sparse == NULL || batch == NULL || !check_mat(sparse, batch)) {
+        handle_error("Batched products do not agree.");
+        exit(EXIT_FAILURE);
+    }
+
+    double single = 0;
+    for (int b = 0; b < count; b++) {
+        struct sparse v = { N, T, e->pos + (size_t)b * T };
+        struct arr row = { N, dense->data[b] };
+        struct timespec s0, s1;
+
+        clock_gettime(CLOCK_MONOTONIC, &s0);
+        struct arr *ref = mat_arr_mul(m, &row);
+        clock_gettime(CLOCK_MONOTONIC, &s1);
+        struct arr *fast = sparse_mat_mul(cols, &v);
+
+        if (ref == NULL || fast == NULL || memcmp(ref->data, batch->data[b], real_dim(m->rows) * sizeof(uint64_t)) != 0
+            || !check_arr(ref, fast)) {
+            handle_error("Batched product does not match the single one.");
+            exit(EXIT_FAILURE);
+        }
+
+        single += elapsed_ms(&s0, &s1);
+        free_resources(NULL, NULL, NULL, NULL, ref, fast, NULL);
+    }
+
+    fprintf(stdout, "Batch verified: dense %.0f msg/s batched vs %.0f msg/s single, sparse %.0f msg/s.\n\n",
+            count / (elapsed_ms(&t1, &t2) / 1e3), count / (single / 1e3), count / (elapsed_ms(&t0, &t1) / 1e3));
+
+    free_sparse_mat(e);
+    free_resources(cols, dense, sparse, batch, NULL, NULL, NULL);
+}
+
+// Checks batched decryption against one S * nnc product per ciphertext
+void check_batch_decrypt(struct mat *s, int count) {
+    fprintf(stdout, "Checking batch decryption of %d ciphertexts...\n", count);
+
+    struct mat *nnc = rand_mat(count, K, NULL);
+    struct mat *word = rand_mat(count, L, NULL);
+    struct mat *msg = NULL;
+    if (nnc == NULL || word == NULL || write_key_file(TESTK, s, KEY_ROW_MAJOR, KEY_PARAMS) != 0) {
+        handle_error("Failed to build batch operands.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Real nnc vectors have no bits past K
+    for (int b = 0; b < count; b++)
+        nnc->data[b][K / SIZE] &= (1ULL << (K % SIZE)) - 1;
+
+    struct timespec t0, t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (decrypt_mat(nnc, word, TESTK, &msg) != 0) {
+        handle_error("Batch decryption failed.");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int b = 0; b < count; b++) {
+        struct arr n = { K, nnc->data[b] };
+        struct arr w = { L, word->data[b] };
+        struct arr *key = mat_arr_mul(s, &n);
+        struct arr *ref = key != NULL ? array_xor(&w, key) : NULL;
+
+        if (ref == NULL || memcmp(ref->data, msg->data[b], real_dim(L) * sizeof(uint64_t)) != 0) {
+            handle_error("Batch decryption does not match the single one.");
+            exit(EXIT_FAILURE);
+        }
+
+        free_resources(NULL, NULL, NULL, NULL, key, ref, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    fprintf(stdout, "Batch decryption verified: %.0f msg/s batched vs %.0f msg/s single.\n\n",
+            count / (elapsed_ms(&t0, &t1) / 1e3), count / (elapsed_ms(&t1, &t2) / 1e3));
+
+    free_resources(nnc, word, msg, NULL, NULL, NULL, NULL);
+}
+
+/* Encrypts the file TESTP to TESTC under a and y, then decrypts it to
+   TESTD under s and reads it back, returning the encryption time in ms */
+double stream_file_round_trip(struct mat *a, struct mat *y, struct mat *s, uint8_t *back, size_t bytes) {
+    if (write_key_file(TESTA, a, KEY_ROW_MAJOR, KEY_PARAMS) != 0
+        || write_key_file(TESTY, y, KEY_ROW_MAJOR, KEY_PARAMS) != 0
+        || write_key_file(TESTK, s, KEY_ROW_MAJOR, KEY_PARAMS) != 0) {
+        handle_error("Failed to set up the stream check.");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *plain = fopen(TESTP, "rb"), *cipher = fopen(TESTC, "wb");
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int enc = plain != NULL && cipher != NULL ? encrypt_stream(plain, cipher, TESTA, TESTY, 3) : -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (plain != NULL)
+        fclose(plain);
+    if (cipher != NULL && fclose(cipher) != 0)
+        enc = -1;
+
+    cipher = fopen(TESTC, "rb");
+    FILE *out = fopen(TESTD, "wb");
+    int dec = enc == 0 && cipher != NULL && out != NULL ? decrypt_stream(cipher, out, TESTK, 3) : -1;
+    if (cipher != NULL)
+        fclose(cipher);
+    if (out != NULL && fclose(out) != 0)
+        dec = -1;
+
+    out = fopen(TESTD, "rb");
+    if (enc != 0 || dec != 0 || out == NULL || fread(back, 1, bytes + 1, out) != bytes) {
+        handle_error("Stream round trip does not give back as many bytes as the input.");
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(out);
+    return elapsed_ms(&t0, &t1);
+}
+
+/* Round trip of a file spanning several slots and a partial block. Under a
+   Y of S * A with no noise every copy decrypts exactly, so the file must
+   come back as it was. Through the real keys a copy flips each bit with
+   probability p = (1 - (1 - 2T/N)^T) / 2, about what two sparse rows of
+   weight T in N agree on an odd number of times, and the majority of the
+   STREAM_COPIES copies leaves 3p^2 - 2p^3 of the bits flipped. */
+void check_stream(struct mat *a, struct mat *y, struct mat *s, size_t bytes) {
+    fprintf(stdout, "Checking stream encryption of %zu bytes...\n", bytes);
+
+    uint8_t *data = malloc(bytes);
+    uint8_t *back = malloc(bytes + 1);
+    struct mat *clean = matrix_mul_m4rm(s, a);
+    FILE *plain = fopen(TESTP, "wb");
+
+    if (data == NULL || back == NULL || clean == NULL || plain == NULL) {
+        handle_error("Failed to set up the stream check.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < bytes; i++)
+        data[i] = (uint8_t)rand();
+    if (fwrite(data, 1, bytes, plain) != bytes || fclose(plain) != 0) {
+        handle_error("Failed to write the stream check input.");
+        exit(EXIT_FAILURE);
+    }
+
+    stream_file_round_trip(a, clean, s, back, bytes);
+    if (memcmp(data, back, bytes) != 0) {
+        handle_error("Stream round trip without noise does not give the file back.");
+        exit(EXIT_FAILURE);
+    }
+
+    double ms = stream_file_round_trip(a, y, s, back, bytes);
+
+    double keep = 1;
+    for (int i = 0; i < T; i++)
+        keep *= 1 - 2.0 * T / N;
+
+    size_t flips = 0;
+    for (size_t i = 0; i < bytes; i++)
+        flips += __builtin_popcount(data[i] ^ back[i]);
+
+    double p = (1 - keep) / 2, expect = 3 * p * p - 2 * p * p * p, rate = (double)flips / (8.0 * bytes);
+    if (rate < expect - 0.02 || rate > expect + 0.02) {
+        fprintf(stderr, "Error: stream noise at %.2f%% of the bits, expected %.2f%%.\n", rate * 100, expect * 100);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Stream verified: exact without noise, %.2f%% of the bits flipped with it (expected %.2f%%), "
+            "encryption at %.1f MB/s.\n\n", rate * 100, expect * 100, bytes / (ms * 1e3));
+
+    free_mat(clean);
+    free(data);
+    free(back);
+}
+
+/* Bit by bit majority of three random copies, at lengths around the word
+   boundary */
+void check_correct_errors(int rounds) {
+    fprintf(stdout, "Checking error correction over %d lengths...\n", rounds);
+
+    for (int r = 0; r < rounds; r++) {
+        int len = 1 + r % 200;
+        struct mat *m = rand_mat(3, len, NULL);
+        struct arr a = { len, m != NULL ? m->data[0] : NULL };
+        struct arr b = { len, m != NULL ? m->data[1] : NULL };
+        struct arr c = { len, m != NULL ? m->data[2] : NULL };
+        struct arr *res = m != NULL ? correct_errors(&a, &b, &c) : NULL;
+        int ok = res != NULL && res->len == len;
+
+        for (int i = 0; i < len && ok; i++) {
+            int w = i / SIZE, pos = i % SIZE;
+            int votes = fetch_bit(a.data[w], pos) + fetch_bit(b.data[w], pos) + fetch_bit(c.data[w], pos);
+            ok = fetch_bit(res->data[w], pos) == (votes >= 2);
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Error: correct_errors is wrong at length %d.\n", len);
+            exit(EXIT_FAILURE);
+        }
+
+        free_resources(m, NULL, NULL, NULL, res, NULL, NULL);
+    }
+
+    fprintf(stdout, "Error correction verified.\n\n");
+}
+
+struct serve_args {
+    const char *const *paths;
+    int sets;
+    int ret;
+};
+
+static void *serve_thread(void *arg) {
+    struct serve_args *args = arg;
+    args->ret = serve(TESTSOCK, args->paths, args->sets, 2, NULL);
+    return NULL;
+}
+
+// Waits for the server to listen, -1 after about five seconds
+static int serve_connect(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct timespec wait = { 0, 10000000 };
+    strcpy(addr.sun_path, TESTSOCK);
+
+    for (int i = 0; i < 500; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        if (fd >= 0)
+            close(fd);
+        nanosleep(&wait, NULL);
+    }
+    return -1;
+}
+
+static int serve_send(int fd, int op, int set, uint32_t id, const void *p1, size_t n1, const void *p2, size_t n2) {
+    uint8_t h[12] = { (uint8_t)op, 0, (uint8_t)set, (uint8_t)(set >> 8) };
+    for (int i = 0; i < 4; i++) {
+        h[4 + i] = (uint8_t)(id >> (8 * i));
+        h[8 + i] = (uint8_t)((n1 + n2) >> (8 * i));
+    }
+
+    struct iovec iov[3] = { { h, sizeof(h) }, { (void *)p1, n1 }, { (void *)p2, n2 } };
+    return write_iov(fd, iov, 3);
+}
+
+/* Reads one response into h and buf. Returns the payload length, -1 on
+   EOF or when it does not fit in size */
+static int serve_recv(int fd, uint8_t *h, void *buf, size_t size) {
+    struct iovec iov = { h, 12 };
+    if (read_iov(fd, &iov, 1) != 0)
+        return -1;
+
+    uint32_t len = (uint32_t)h[8] | (uint32_t)h[9] << 8 | (uint32_t)h[10] << 16 | (uint32_t)h[11] << 24;
+    iov = (struct iovec){ buf, len };
+    return len <= size && read_iov(fd, &iov, 1) == 0 ? (int)len : -1;
+}
+
+static uint32_t serve_id(const uint8_t *h) {
+    return (uint32_t)h[4] | (uint32_t)h[5] << 8 | (uint32_t)h[6] << 16 | (uint32_t)h[7] << 24;
+}
+
+/* Starts serve on TESTSOCK, stopping it with a SIGTERM once the caller is
+   done: the signal can only come after the first answer, when the
+   handler is in place. */
+static pthread_t serve_start(struct serve_args *args) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve_thread, args) != 0) {
+        handle_error("Failed to start the server.");
+        exit(EXIT_FAILURE);
+    }
+    return tid;
+}
+
+/* Runs the server protocol end to end: count encryptions sent in one go
+   under descending ids, so that they are batched and may come back in any
+   order, their decryptions, a correction, malformed requests, STATS, a
+   server holding two sets without S, and the shutdown. Encryptions must
+   carry the noise of E*e and decryptions must be word ^ S*nnc. */
+void check_server(struct mat *a, struct mat *y, struct mat *s, int count) {
+    fprintf(stdout, "Checking the server protocol over %d requests...\n", count);
+
+    size_t msg_bytes = real_dim(L) * sizeof(uint64_t), nnc_bytes = real_dim(K) * sizeof(uint64_t);
+    struct mat *msg = rand_mat(count, L, NULL);
+    struct mat *nnc = new_mat(count, K), *word = new_mat(count, L), *dec = new_mat(count, L);
+    uint8_t *buf = malloc(3 * msg_bytes + 1), h[12];
+    int seen[3] = { 0 }, ok = 1;
+
+    if (msg == NULL || nnc == NULL || word == NULL || dec == NULL || buf == NULL
+        || write_key_file(TESTA, a, KEY_ROW_MAJOR, KEY_PARAMS) != 0
+        || write_key_file(TESTY, y, KEY_ROW_MAJOR, KEY_PARAMS) != 0
+        || write_key_file(TESTK, s, KEY_ROW_MAJOR, KEY_PARAMS) != 0) {
+        handle_error("Failed to set up the server check.");
+        exit(EXIT_FAILURE);
+    }
+
+    // The smallest other set, with random public keys
+    int sets;
+    const struct params *list = params_list(&sets), *other = NULL;
+    for (int i = 0; i < sets; i++) {
+        if (&list[i] != active_params && (other == NULL || list[i].l < other->l))
+            other = &list[i];
+    }
+
+    struct mat *a2 = rand_mat(other->k, other->n, NULL), *y2 = rand_mat(other->l, other->n, NULL);
+    if (a2 == NULL || y2 == NULL || write_key_file(TESTA2, a2, KEY_ROW_MAJOR, other->id) != 0
+        || write_key_file(TESTY2, y2, KEY_ROW_MAJOR, other->id) != 0) {
+        handle_error("Failed to set up the server check.");
+        exit(EXIT_FAILURE);
+    }
+    free_resources(a2, y2, NULL, NULL, NULL, NULL, NULL);
+
+    const char *one[] = { TESTA, TESTY, TESTK }, *two[] = { TESTA, TESTY, "-", TESTA2, TESTY2, "-" };
+    struct serve_args args = { one, 1, -1 };
+    pthread_t tid = serve_start(&args);
+    int fd = serve_connect();
+    ok = fd >= 0;
+
+    for (int i = 0; i < count && ok; i++)
+        ok = serve_send(fd, SERVE_ENCRYPT, 0, count - i, msg->data[i], msg_bytes, NULL, 0) == 0;
+
+    for (int i = 0; i < count && ok; i++) {
+        ok = serve_recv(fd, h, buf, 3 * msg_bytes) == (int)(nnc_bytes + msg_bytes) && h[0] == SERVE_ENCRYPT
+             && h[1] == SERVE_OK;
+        int r = ok ? count - (int)serve_id(h) : -1;
+        ok = ok && r >= 0 && r < count;
+        if (ok) {
+            memcpy(nnc->data[r], buf, nnc_bytes);
+            memcpy(word->data[r], buf + nnc_bytes, msg_bytes);
+            seen[0]++;
+        }
+    }
+
+    for (int i = 0; i < count && ok; i++)
+        ok = serve_send(fd, SERVE_DECRYPT, 0, i, nnc->data[i], nnc_bytes, word->data[i], msg_bytes) == 0;
+
+    for (int i = 0; i < count && ok; i++) {
+        ok = serve_recv(fd, h, buf, 3 * msg_bytes) == (int)msg_bytes && h[0] == SERVE_DECRYPT && h[1] == SERVE_OK
+             && serve_id(h) < (uint32_t)count;
+        if (ok) {
+            memcpy(dec->data[serve_id(h)], buf, msg_bytes);
+            seen[1]++;
+        }
+    }
+
+    // Decryption is word ^ S*nnc, which is msg up to the noise E*e
+    double keep = 1;
+    for (int i = 0; i < T; i++)
+        keep *= 1 - 2.0 * T / N;
+
+    long flips = 0;
+    for (int i = 0; i < count && ok; i++) {
+        struct arr n = { K, nnc->data[i] }, w = { L, word->data[i] }, d = { L, dec->data[i] }, m = { L, msg->data[i] };
+        struct arr *sn = mat_arr_mul(s, &n);
+        struct arr *want = sn != NULL ? array_xor(sn, &w) : NULL;
+
+        ok = want != NULL && delta_arr(want, &d) == 0;
+        flips += ok ? delta_arr(&m, &d) : 0;
+        free_resources(NULL, NULL, NULL, NULL, sn, want, NULL);
+    }
+
+    double rate = (double)flips / ((double)count * L), expect = (1 - keep) / 2;
+    ok = ok && rate > expect - 0.03 && rate < expect + 0.03;
+
+    // The majority of two equal copies and a third one is the copy
+    if (ok) {
+        memcpy(buf, msg->data[0], msg_bytes);
+        memcpy(buf + msg_bytes, dec->data[0], msg_bytes);
+        memcpy(buf + 2 * msg_bytes, msg->data[0], msg_bytes);
+        struct arr back = { L, (uint64_t *)buf };
+        struct arr m = { L, msg->data[0] };
+
+        ok = serve_send(fd, SERVE_CORRECT, 0, 7, buf, 3 * msg_bytes, NULL, 0) == 0
+             && serve_recv(fd, h, buf, 3 * msg_bytes) == (int)msg_bytes && h[1] == SERVE_OK && serve_id(h) == 7
+             && delta_arr(&m, &back) == 0;
+        seen[2] += ok;
+    }
+
+    // Wrong lengths and unknown ops are refused, and the connection stays up
+    ok = ok && serve_send(fd, SERVE_ENCRYPT, 0, 11, buf, msg_bytes - 8, NULL, 0) == 0
+         && serve_recv(fd, h, buf, 3 * msg_bytes) == 0 && h[1] == SERVE_BAD_REQUEST && serve_id(h) == 11;
+    ok = ok && serve_send(fd, 9, 0, 12, NULL, 0, NULL, 0) == 0 && serve_recv(fd, h, buf, 3 * msg_bytes) == 0
+         && h[1] == SERVE_BAD_REQUEST && serve_id(h) == 12;
+
+    int len = ok && serve_send(fd, SERVE_STATS, 0, 13, NULL, 0, NULL, 0) == 0 ? serve_recv(fd, h, buf, 3 * msg_bytes) : -1;
+    if (len >= 0)
+        buf[len] = 0;
+    ok = ok && len > 0 && h[1] == SERVE_OK && serve_id(h) == 13 && strstr((char *)buf, "errors 0\n") != NULL;
+
+    // An oversized payload is refused before it is read, and the connection closed
+    ok = ok && serve_send(fd, SERVE_DECRYPT, 0, 14, NULL, 0, NULL, 0) == 0;
+    if (ok) {
+        uint8_t big[12] = { SERVE_ENCRYPT, 0, 0, 0, 15, 0, 0, 0, 0xff, 0xff, 0xff, 0x7f };
+        ok = write(fd, big, sizeof(big)) == sizeof(big) && serve_recv(fd, h, buf, 3 * msg_bytes) == 0
+             && h[1] == SERVE_BAD_REQUEST && serve_id(h) == 14 && serve_recv(fd, h, buf, 3 * msg_bytes) == 0
+             && h[1] == SERVE_BAD_REQUEST && serve_id(h) == 15 && serve_recv(fd, h, buf, 3 * msg_bytes) < 0;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    raise(SIGTERM);
+    pthread_join(tid, NULL);
+    ok = ok && args.ret == 0 && access(TESTSOCK, F_OK) != 0;
+
+    /* Without S decryptions get SERVE_NO_KEY and encryptions still work,
+       in either set at its own sizes; a set not loaded gets SERVE_NO_KEY */
+    size_t msg2 = real_dim(other->l) * sizeof(uint64_t), nnc2 = real_dim(other->k) * sizeof(uint64_t);
+    uint8_t *big = calloc(1, msg2 + nnc2 > 3 * msg_bytes ? msg2 + nnc2 : 3 * msg_bytes);
+
+    args = (struct serve_args){ two, 2, -1 };
+    tid = serve_start(&args);
+    fd = serve_connect();
+    ok = ok && big != NULL && fd >= 0
+         && serve_send(fd, SERVE_DECRYPT, 0, 21, nnc->data[0], nnc_bytes, word->data[0], msg_bytes) == 0
+         && serve_recv(fd, h, big, 3 * msg_bytes) == 0 && h[1] == SERVE_NO_KEY && serve_id(h) == 21
+         && serve_send(fd, SERVE_ENCRYPT, 0, 22, msg->data[0], msg_bytes, NULL, 0) == 0
+         && serve_recv(fd, h, big, 3 * msg_bytes) == (int)(nnc_bytes + msg_bytes) && h[1] == SERVE_OK
+         && serve_send(fd, SERVE_ENCRYPT, other->id, 23, big, msg2, NULL, 0) == 0
+         && serve_recv(fd, h, big, msg2 + nnc2) == (int)(nnc2 + msg2) && h[1] == SERVE_OK && serve_id(h) == 23
+         && (h[2] | h[3] << 8) == other->id
+         && serve_send(fd, SERVE_ENCRYPT, other->id, 24, big, msg2 - 8, NULL, 0) == 0
+         && serve_recv(fd, h, big, msg2 + nnc2) == 0 && h[1] == SERVE_BAD_REQUEST && serve_id(h) == 24
+         && serve_send(fd, SERVE_CORRECT, 999, 25, big, 3 * msg_bytes, NULL, 0) == 0
+         && serve_recv(fd, h, big, msg2 + nnc2) == 0 && h[1] == SERVE_NO_KEY && serve_id(h) == 25;
+
+    // Shutdown closes the clients still connected
+    raise(SIGTERM);
+    ok = ok && serve_recv(fd, h, buf, 3 * msg_bytes) < 0;
+    free(big);
+    if (fd >= 0)
+        close(fd);
+    pthread_join(tid, NULL);
+    ok = ok && args.ret == 0;
+
+    if (!ok) {
+        fprintf(stderr, "Error: server protocol is wrong after %d encryptions, %d decryptions, %d corrections.\n",
+                seen[0], seen[1], seen[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Server verified: %.2f%% of the bits flipped (expected %.2f%%).\n\n", rate * 100, expect * 100);
+
+    free(buf);
+    free_resources(msg, nnc, word, dec, NULL, NULL, NULL);
+}
+
+/* Keys must name the set they were written in, and headerless ones must be
+   matched to a set by their shape, when loaded as when converted. The
+   active set is left as it was. */
+void check_params(void) {
+    fprintf(stdout, "Checking the parameter sets...\n");
+
+    const struct params *active = active_params;
+    const struct params *small = params_by_name("test");
+    int count, ok = small != NULL;
+    const struct params *sets = params_list(&count);
+
+    for (int i = 0; i < count && ok; i++)
+        ok = params_by_id(sets[i].id) == &sets[i] && params_by_name(sets[i].name) == &sets[i]
+             && params_by_shape(sets[i].n, sets[i].k) == &sets[i];
+
+    select_params(small);
+    struct mat *a = ok ? rand_mat(K, N, NULL) : NULL;
+    ok = a != NULL && write_key_file(TESTA, a, KEY_ROW_MAJOR, KEY_PARAMS) == 0;
+    select_params(active);
+
+    struct key k;
+    ok = ok && key_params(TESTA) == small && load_key(TESTA, &k) == 0;
+    if (ok) {
+        ok = k.params == small && k.m->rows == small->k && k.m->cols == small->n;
+        free_key(&k);
+    }
+
+    write_key(TESTA, a);
+    ok = ok && key_params(TESTA) == small;
+
+    // Converting takes set and layout from the shape, not the active set
+    const struct params *other = active == small ? params_by_name("standard") : small;
+    struct mat *ct = ok ? rand_mat(other->n, other->k, NULL) : NULL, *odd = rand_mat(3, 5, NULL);
+    struct key_info info;
+    ok = ct != NULL && odd != NULL;
+    if (ok) {
+        write_key(TESTA, ct);
+        ok = convert_key_file(TESTA, TESTK) == 0 && read_key_info(TESTK, &info) == 0 && info.params == other->id
+             && info.layout == KEY_COL_MAJOR;
+        write_key(TESTA, odd);
+        ok = ok && convert_key_file(TESTA, TESTK) != 0;
+    }
+    free_resources(ct, odd, NULL, NULL, NULL, NULL, NULL);
+
+    if (!ok) {
+        handle_error("Keys do not carry their parameter set.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Parameter sets verified.\n\n");
+    free_mat(a);
+}
+
+/* Rows whose word ^ S*nnc is not the message, -1 if S*nnc fails. With
+   Y = S*A the two halves of a mask cancel exactly. */
+static int mask_mismatches(struct mat *s, struct mat *msg, struct mat *nnc, struct mat *word) {
+    int bad = 0;
+
+    for (int i = 0; i < msg->rows; i++) {
+        struct arr n = { K, nnc->data[i] }, w = { L, word->data[i] }, m = { L, msg->data[i] };
+        struct arr *sn = mat_arr_mul(s, &n);
+        struct arr *back = sn != NULL ? array_xor(sn, &w) : NULL;
+
+        if (back == NULL) {
+            free_resources(NULL, NULL, NULL, NULL, sn, NULL, NULL);
+            return -1;
+        }
+        bad += delta_arr(back, &m) != 0;
+        free_resources(NULL, NULL, NULL, NULL, sn, back, NULL);
+    }
+
+    return bad;
+}
+
+/* Every mask must come from one e for both halves, whether it was pooled
+   or computed on a miss; a noiseless Y = S*A makes that checkable. */
+void check_masks(struct mat *a, struct mat *s, int capacity, int low_water) {
+    fprintf(stdout, "Checking a pool of %d masks...\n", capacity);
+
+    struct key ka = { a, NULL, KEY_ROW_MAJOR, active_params };
+    struct key ky = { matrix_mul_m4rm(s, a), NULL, KEY_ROW_MAJOR, active_params };
+    struct mat *msg = rand_mat(capacity + capacity / 2, L, NULL);
+    struct mask_config cfg = { capacity, low_water, 0 };
+    struct mask_pool *p = ky.m != NULL && msg != NULL ? mask_pool_new(&ka, &ky, &cfg) : NULL;
+
+    if (p == NULL) {
+        handle_error("Failed to set up the mask check.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct mask_stats st;
+    struct timespec wait = { 0, 10000000 };
+    do {
+        nanosleep(&wait, NULL);
+        mask_pool_stats(p, &st);
+    } while (st.fill < capacity);
+
+    // One message alone through the allocation-free form, as the server sees it
+    struct mat *one = rand_mat(1, L, NULL), *n1 = new_mat(1, K), *w1 = new_mat(1, L);
+    struct mat *n2 = new_mat(1, K), *w2 = new_mat(1, L);
+    struct mat *nnc = NULL, *word = NULL;
+    struct arena scratch = { 0 };
+    struct timespec t0, t1;
+    int ret = one != NULL && n1 != NULL && w1 != NULL && n2 != NULL && w2 != NULL
+                  && arena_init(&scratch, key_batch_scratch_size(active_params, 1)) == 0 ? 0 : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (ret == 0)
+        ret = mask_encrypt_batch_into(p, one, &scratch, n1, w1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // The rest of the ring, then misses
+    if (ret == 0)
+        ret = mask_encrypt(p, msg, &nnc, &word);
+    mask_pool_stats(p, &st);
+
+    // The refill may have begun, so this one is a hit or a miss
+    if (ret == 0)
+        ret = mask_encrypt_batch_into(p, one, &scratch, n2, w2);
+
+    if (ret != 0 || mask_mismatches(s, one, n1, w1) != 0 || mask_mismatches(s, one, n2, w2) != 0
+        || mask_mismatches(s, msg, nnc, word) != 0 || st.hits != (uint64_t)capacity
+        || st.misses != (uint64_t)msg->rows + 1 - capacity) {
+        handle_error("Mask pool encryption is wrong.");
+        exit(EXIT_FAILURE);
+    }
+
+    mask_pool_free(p);
+
+    // A throttled pool pauses for seconds per batch, which a stop must cut short
+    struct mask_config slow = { capacity, low_water, 1 };
+    struct timespec t2, t3;
+    p = mask_pool_new(&ka, &ky, &slow);
+    nanosleep(&wait, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    mask_pool_free(p);
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+
+    if (p == NULL || elapsed_ms(&t2, &t3) > 500) {
+        handle_error("A throttled mask pool does not stop promptly.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Masks verified: one message in %.1f us, refill computed at %.0f masks/s, stop in %.1f ms.\n\n",
+            elapsed_ms(&t0, &t1) * 1e3, st.compute_rate, elapsed_ms(&t2, &t3));
+
+    arena_free(&scratch);
+    free_resources(ky.m, msg, one, n2, NULL, NULL, NULL);
+    free_resources(n1, w1, w2, nnc, NULL, NULL, NULL);
+    free_mat(word);
+}
+
+/* The allocation-free path against key_encrypt and key_decrypt from the
+   same generator state, through every key form: row-major, column-major
+   and seed, for A as for S. The scratch must be handed back whole after
+   every call. */
+void check_into(struct mat *a, struct mat *y, struct mat *s, int rounds) {
+    fprintf(stdout, "Checking allocation-free encryption over %d messages...\n", rounds);
+
+    struct key ka = { a, NULL, KEY_ROW_MAJOR, active_params };
+    struct key kc = { matrix_transpose(a), NULL, KEY_COL_MAJOR, active_params };
+    struct key ky = { matrix_transpose(y), NULL, KEY_COL_MAJOR, active_params };
+    struct key ks = { s, NULL, KEY_ROW_MAJOR, active_params };
+    struct key kz = { NULL, seed_mat_new(L, K), KEY_ROW_MAJOR, active_params };
+    struct key kx = { NULL, seed_mat_new(a->rows, a->cols), KEY_ROW_MAJOR, active_params };
+    struct mat *msg = rand_mat(1, L, NULL);
+    struct arr m = { L, msg != NULL ? msg->data[0] : NULL };
+    struct arr nnc = { K, calloc(real_dim(K), sizeof(uint64_t)) };
+    struct arr word = { L, calloc(real_dim(L), sizeof(uint64_t)) };
+    struct arr dec = { L, calloc(real_dim(L), sizeof(uint64_t)) };
+    struct arena scratch;
+    struct rng r1, r2;
+
+    if (kc.m == NULL || ky.m == NULL || kz.seed == NULL || kx.seed == NULL || msg == NULL || nnc.data == NULL || word.data == NULL
+        || dec.data == NULL || arena_init(&scratch, key_scratch_size(active_params)) != 0) {
+        handle_error("Failed to set up the allocation-free check.");
+        exit(EXIT_FAILURE);
+    }
+
+    rng_seed(&r1);
+    r2 = r1;
+
+    int ok = 1;
+    double fast = 0, slow = 0;
+
+    for (int i = 0; i < rounds && ok; i++) {
+        struct mat *n1 = NULL, *w1 = NULL, *d1 = NULL;
+        struct key *kn = i % 3 == 0 ? &kc : i % 3 == 1 ? &ka : &kx, *kd = i % 2 ? &ks : &kz;
+        struct timespec t0, t1, t2;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ok = key_encrypt(kn, &ky, msg, &r1, &n1, &w1) == 0 && key_decrypt(kd, n1, w1, &d1) == 0;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ok = ok && key_encrypt_into(kn, &ky, &m, &r2, &scratch, &nnc, &word) == 0
+             && key_decrypt_into(kd, &nnc, &word, &scratch, &dec) == 0;
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+
+        ok = ok && arena_mark(&scratch) == 0 && memcmp(nnc.data, n1->data[0], real_dim(K) * sizeof(uint64_t)) == 0
+             && memcmp(word.data, w1->data[0], real_dim(L) * sizeof(uint64_t)) == 0
+             && memcmp(dec.data, d1->data[0], real_dim(L) * sizeof(uint64_t)) == 0;
+
+        slow += elapsed_ms(&t0, &t1);
+        fast += elapsed_ms(&t1, &t2);
+        free_resources(n1, w1, d1, NULL, NULL, NULL, NULL);
+    }
+
+    if (!ok) {
+        handle_error("Allocation-free encryption does not match.");
+        exit(EXIT_FAILURE);
+    }
+
+    // From ENCRYPT_TRANSPOSE rows dense keys take the column path, with the same result
+    struct key kr = { y, NULL, KEY_ROW_MAJOR, active_params };
+    struct mat *many = rand_mat(ENCRYPT_TRANSPOSE, L, NULL);
+    struct mat *n1 = NULL, *w1 = NULL, *n2 = NULL, *w2 = NULL;
+
+    r2 = r1;
+    if (many == NULL || key_encrypt(&ka, &kr, many, &r1, &n1, &w1) != 0
+        || key_encrypt(&kc, &ky, many, &r2, &n2, &w2) != 0 || !check_mat(n1, n2) || !check_mat(w1, w2)) {
+        handle_error("Dense batch encryption does not match the column path.");
+        exit(EXIT_FAILURE);
+    }
+    free_resources(many, n1, w1, n2, NULL, NULL, NULL);
+    free_mat(w2);
+
+    fprintf(stdout, "Allocation-free path verified: %.1f us per round trip vs %.1f us, %zu of %zu scratch bytes.\n\n",
+            fast * 1e3 / rounds, slow * 1e3 / rounds, scratch.peak, scratch.size);
+
+    arena_free(&scratch);
+    free_key(&kc);
+    free_key(&ky);
+    free_key(&kz);
+    free_key(&kx);
+    free_resources(msg, NULL, NULL, NULL, NULL, NULL, NULL);
+    free(nnc.data);
+    free(word.data);
+    free(dec.data);
+}
+
+/* The memory codecs must produce the bytes of write_packet, and the
+   vectored paths must carry count ciphertexts through a file, and a few
+   through a socket, unchanged. */
+void check_packets(int count) {
+    fprintf(stdout, "Checking packet codecs over %d ciphertexts...\n", count);
+
+    struct mat *nnc = rand_mat(count, K, NULL), *word = rand_mat(count, L, NULL);
+    struct mat *back = new_mat(2 * count, L);
+    size_t size = cipher_size(K, L);
+    unsigned char *buf = malloc(size), *file = malloc(size);
+    struct arr *a = calloc(2 * count, sizeof(struct arr)), *b = calloc(2 * count, sizeof(struct arr));
+    int fds[2] = { -1, -1 };
+
+    if (nnc == NULL || word == NULL || back == NULL || buf == NULL || file == NULL || a == NULL || b == NULL
+        || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        handle_error("Failed to set up the packet check.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        a[2 * i] = (struct arr){ K, nnc->data[i] };
+        a[2 * i + 1] = (struct arr){ L, word->data[i] };
+        b[2 * i] = (struct arr){ K, back->data[2 * i] };
+        b[2 * i + 1] = (struct arr){ L, back->data[2 * i + 1] };
+    }
+
+    // One ciphertext through memory, then as two packet files
+    struct arr n1 = b[0], w1 = b[1];
+    int ok = cipher_encode(&a[0], &a[1], buf, size) == size && cipher_decode(&n1, &w1, buf, size) == size
+             && n1.len == K && w1.len == L && check_arr(&a[0], &n1) && check_arr(&a[1], &w1)
+             && cipher_encode(&a[0], &a[1], buf, size - 1) == 0 && cipher_decode(&n1, &w1, buf, size - 1) == 0;
+
+    // Whatever the host, the length and the words are little-endian
+    cipher_encode(&a[0], &a[1], buf, size);
+    for (int j = 0; j < 8 && ok; j++) {
+        ok = buf[PACKET_HEADER + j] == (unsigned char)(a[0].data[0] >> (8 * j))
+             && (j >= PACKET_HEADER || buf[j] == (unsigned char)((uint32_t)K >> (8 * j)));
+    }
+
+    write_packet(TEST1, &a[0]);
+    write_packet(TEST2, &a[1]);
+    FILE *f1 = fopen(TEST1, "rb"), *f2 = fopen(TEST2, "rb");
+    ok = ok && f1 != NULL && f2 != NULL && fread(file, 1, size, f1) == packet_size(K)
+         && fread(file + packet_size(K), 1, size, f2) == packet_size(L) && memcmp(buf, file, size) == 0;
+    if (f1 != NULL)
+        fclose(f1);
+    if (f2 != NULL)
+        fclose(f2);
+
+    struct arr *r1 = read_packet(TEST1);
+    ok = ok && r1 != NULL && check_arr(&a[0], r1);
+    free_arr(r1);
+
+    // All of them through a file, both ends vectored
+    struct timespec t0, t1;
+    FILE *f3 = fopen(TEST3, "w+b");
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ok = ok && f3 != NULL && packets_writev(fileno(f3), a, 2 * count) == 0 && lseek(fileno(f3), 0, SEEK_SET) == 0
+         && packets_readv(fileno(f3), b, 2 * count) == 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (f3 != NULL)
+        fclose(f3);
+
+    for (int i = 0; i < 2 * count && ok; i++)
+        ok = check_arr(&a[i], &b[i]);
+
+    // A few through the socket, small enough not to fill its buffer
+    int few = count < 4 ? count : 4;
+    memset(back->buf, 0, (size_t)back->rows * back->stride * sizeof(uint64_t));
+    ok = ok && packets_writev(fds[0], a, 2 * few) == 0 && packets_readv(fds[1], b, 2 * few) == 0;
+
+    for (int i = 0; i < 2 * few && ok; i++)
+        ok = check_arr(&a[i], &b[i]);
+
+    if (!ok) {
+        handle_error("Packet codecs do not round trip.");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Packet codecs verified: %.1f us per ciphertext written and read back.\n\n",
+            elapsed_ms(&t0, &t1) * 1e3 / count);
+
+    close(fds[0]);
+    close(fds[1]);
+    free(a);
+    free(b);
+    free(buf);
+    free(file);
+    free_resources(nnc, word, back, NULL, NULL, NULL, NULL);
+}
+
 void print_hamming_distance(struct arr *msg, struct arr *dec_msg) {
     int distance = delta_arr(msg, dec_msg);
     fprintf(stdout, "Hamming distance from original message: %d\n\n", distance);
@@ -330,7 +1603,7 @@ void encrypt_decrypt_shortcut(struct mat *ar, struct mat *yr, struct mat *sr, st
         return;
     }
     e->len = N;
-    e->data = weight_array(N, T);
+    e->data = weight_array(N, T, NULL);
     if (e->data == NULL) {
         handle_error("Memory allocation failed for e data.");
         free_resources(NULL, NULL, NULL, NULL, msg, e, NULL);
@@ -380,3 +1653,45 @@ void encrypt_decrypt_shortcut(struct mat *ar, struct mat *yr, struct mat *sr, st
 
     free_resources(NULL, NULL, NULL, NULL, e, dec_key, dec_msg);
 }
+
+// Times the block transpose against the bit-by-bit one on the A and Y shapes
+void bench_transpose(){
+    fprintf(stdout, "Benchmarking matrix transposition...\n");
+
+    compare_transpose("A", K, N);
+    compare_transpose("Y", L, N);
+}
+
+void compare_transpose(const char *name, int rows, int cols){
+    struct mat *m = rand_mat(rows, cols, NULL);
+    if (m == NULL) {
+        handle_error("Failed to generate matrix.");
+        return;
+    }
+
+    struct timespec t0, t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct mat *ref = matrix_transpose_naive(m);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    struct mat *fast = matrix_transpose(m);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    if (ref == NULL || fast == NULL || !check_mat(ref, fast)) {
+        handle_error("Block transpose does not match the reference.");
+        free_resources(m, ref, fast, NULL, NULL, NULL, NULL);
+        return;
+    }
+
+    double naive = elapsed_ms(&t0, &t1);
+    double block = elapsed_ms(&t1, &t2);
+
+    fprintf(stdout, "%s (%dx%d): naive %.2f ms, block %.2f ms, speedup %.1fx\n",
+            name, rows, cols, naive, block, naive / block);
+
+    free_resources(m, ref, fast, NULL, NULL, NULL, NULL);
+}
+
+double elapsed_ms(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
@@ -6,7 +6,7 @@ worldwide. This software is distributed without any warranty.
 
 See <http://creativecommons.org/publicdomain/zero/1.0/>. */
 
-#include <stdint.h>
+#include "../include/xoshiro.h"
 
 /* This is xoshiro256** 1.0, one of our all-purpose, rock-solid
    generators. It has excellent (sub-ns) speed, a state (256 bits) that is
@@ -26,50 +26,66 @@ static inline uint64_t rotl(const uint64_t x, int k) {
 
 uint64_t s[4];
 
-uint64_t next(void) {
-	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+uint64_t next_state(uint64_t *st) {
+	const uint64_t result = rotl(st[1] * 5, 7) * 9;
 
-	const uint64_t t = s[1] << 17;
+	const uint64_t t = st[1] << 17;
 
-	s[2] ^= s[0];
-	s[3] ^= s[1];
-	s[1] ^= s[2];
-	s[0] ^= s[3];
+	st[2] ^= st[0];
+	st[3] ^= st[1];
+	st[1] ^= st[2];
+	st[0] ^= st[3];
 
-	s[2] ^= t;
+	st[2] ^= t;
 
-	s[3] = rotl(s[3], 45);
+	st[3] = rotl(st[3], 45);
 
 	return result;
 }
 
+uint64_t next(void) {
+	return next_state(s);
+}
+
+uint64_t rng_next(struct rng *r) {
+	return next_state(r->s);
+}
+
 
 /* This is the jump function for the generator. It is equivalent
    to 2^128 calls to next(); it can be used to generate 2^128
    non-overlapping subsequences for parallel computations. */
 
-void jump(void) {
-	static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
 
+static void jump_state(const uint64_t *poly, uint64_t *st) {
 	uint64_t s0 = 0;
 	uint64_t s1 = 0;
 	uint64_t s2 = 0;
 	uint64_t s3 = 0;
-	for(int i = 0; i < sizeof JUMP / sizeof *JUMP; i++)
+	for(int i = 0; i < 4; i++)
 		for(int b = 0; b < 64; b++) {
-			if (JUMP[i] & UINT64_C(1) << b) {
-				s0 ^= s[0];
-				s1 ^= s[1];
-				s2 ^= s[2];
-				s3 ^= s[3];
+			if (poly[i] & UINT64_C(1) << b) {
+				s0 ^= st[0];
+				s1 ^= st[1];
+				s2 ^= st[2];
+				s3 ^= st[3];
 			}
-			next();
+			next_state(st);
 		}
 
-	s[0] = s0;
-	s[1] = s1;
-	s[2] = s2;
-	s[3] = s3;
+	st[0] = s0;
+	st[1] = s1;
+	st[2] = s2;
+	st[3] = s3;
+}
+
+void jump(void) {
+	jump_state(JUMP, s);
+}
+
+void rng_jump(struct rng *r) {
+	jump_state(JUMP, r->s);
 }
 
 
@@ -79,26 +95,27 @@ void jump(void) {
    from each of which jump() will generate 2^64 non-overlapping
    subsequences for parallel distributed computations. */
 
+static const uint64_t LONG_JUMP[] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 };
+
 void long_jump(void) {
-	static const uint64_t LONG_JUMP[] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 };
+	jump_state(LONG_JUMP, s);
+}
 
-	uint64_t s0 = 0;
-	uint64_t s1 = 0;
-	uint64_t s2 = 0;
-	uint64_t s3 = 0;
-	for(int i = 0; i < sizeof LONG_JUMP / sizeof *LONG_JUMP; i++)
-		for(int b = 0; b < 64; b++) {
-			if (LONG_JUMP[i] & UINT64_C(1) << b) {
-				s0 ^= s[0];
-				s1 ^= s[1];
-				s2 ^= s[2];
-				s3 ^= s[3];
-			}
-			next();
-		}
+void rng_long_jump(struct rng *r) {
+	jump_state(LONG_JUMP, r->s);
+}
+
+void rng_lanes_init(struct rng_lanes *l, struct rng *r) {
+	for(int i = 0; i < RNG_LANES; i++) {
+		for(int k = 0; k < 4; k++)
+			l->s[k][i] = r->s[k];
+		rng_jump(r);
+	}
+}
 
-	s[0] = s0;
-	s[1] = s1;
-	s[2] = s2;
-	s[3] = s3;
+uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
 }